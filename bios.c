@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/select.h>
@@ -22,9 +23,10 @@
 
 	Basic idea:
 	- Each core is simulated by a pthread
-	- One POSIX timer per core thread
-	- Core threads mask all signals except for USR1.
-	- The PIC thread receives all signals and dispatches them to
+	- One POSIX timer per core thread, which signals the core thread
+	directly, by SIGTIMER.
+	- Core threads mask all signals except for USR1 and SIGTIMER.
+	- The PIC thread receives all other signals and dispatches them to
 	the right core thread by raising SIGUSR1.
 
  */
@@ -47,6 +49,7 @@ typedef struct core
 
 	sig_atomic_t int_disabled;
 	sig_atomic_t halted;
+	int restart_pending;     /* A restart arrived while the core was running */
 	rlnode halted_node;
 	pthread_cond_t halt_cond;
 
@@ -66,11 +69,22 @@ static sigset_t core_signal_set;
 /* Uset to store the singleton set containing SIGUSR1 */
 static sigset_t sigusr1_set;
 
-/* Uset to store the singleton set containing SIGALRM */
-static sigset_t sigalrm_set;
+/* The signals that interrupt a core: SIGUSR1 and SIGTIMER */
+static sigset_t core_interrupt_set;
 
-/* Used to create the signalfd */
-static sigset_t signalfd_set;
+/* 
+	The signal of the core timers. It is a real-time signal, so that it is 
+	queued, and not merged with a pending SIGUSR1.
+ */
+#define SIGTIMER SIGRTMIN
+
+/* 
+	The thread signalled by a SIGEV_THREAD_ID timer. Older versions of glibc
+	do not define this name, only the private member of struct sigevent.
+ */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
 
 /* Array of Core objects, one per core */
 static Core CORE[MAX_CORES];
@@ -90,6 +104,9 @@ static pthread_mutex_t core_halt_mutex = PTHREAD_MUTEX_INITIALIZER;
 /* List of halted cores */
 static rlnode halted_list;
 
+/* Number of calls to cpu_core_restart_one() that found no halted core */
+static unsigned int pending_restarts;
+
 /* PIC thread id */
 static pthread_t PIC_thread;
 
@@ -99,6 +116,12 @@ static struct sigaction USR1_saved_sigaction;
 /* The sigaction for SIGUSR1 (core interrupts) */
 static struct sigaction USR1_sigaction;
 
+/* Save the sigaction for SIGTIMER */
+static struct sigaction TIMER_saved_sigaction;
+
+/* The sigaction for SIGTIMER (core timers) */
+static struct sigaction TIMER_sigaction;
+
 /* A simulated coarse clock measuring time with a res. of 0.1 sec,
    since "boot". Used for serial device timeouts. */
 typedef unsigned long coarse_clock_t;
@@ -111,6 +134,7 @@ static volatile coarse_clock_t  system_clock;
 #define SERIAL_TIMEOUT 300
 
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
+static void sigtimer_handler(int signo, siginfo_t* si, void* ctx);
 
 
 /* PIC daemon statistics */
@@ -124,27 +148,28 @@ static void initialize()
 	/* Create the thread-local var for core no. */
 	CHECKRC(pthread_key_create(&Core_key, NULL));
 
-	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
-	sigemptyset(& USR1_sigaction.sa_mask);
-
-	/* Create the sigmask to block all signals, except USR1 */
-	CHECK(sigfillset(&core_signal_set));
-	CHECK(sigdelset(&core_signal_set, SIGUSR1));
-
 	/* Create the mask for blocking SIGUSR1 */
 	CHECK(sigemptyset(&sigusr1_set));
 	CHECK(sigaddset(&sigusr1_set, SIGUSR1));
 
-	/* Create the mask for  SIGALRM */
-	CHECK(sigemptyset(&sigalrm_set));
-	CHECK(sigaddset(&sigalrm_set, SIGALRM));
+	/* Create the mask for blocking core interrupts */
+	CHECK(sigemptyset(&core_interrupt_set));
+	CHECK(sigaddset(&core_interrupt_set, SIGUSR1));
+	CHECK(sigaddset(&core_interrupt_set, SIGTIMER));
+
+	/* The handlers of core interrupts do not nest */
+	USR1_sigaction.sa_sigaction = sigusr1_handler;
+	USR1_sigaction.sa_flags = SA_SIGINFO;
+	USR1_sigaction.sa_mask = core_interrupt_set;
 
+	TIMER_sigaction.sa_sigaction = sigtimer_handler;
+	TIMER_sigaction.sa_flags = SA_SIGINFO;
+	TIMER_sigaction.sa_mask = core_interrupt_set;
 
-	/* Create signaldf_set */
-	CHECK(sigemptyset(&signalfd_set));
-	CHECK(sigaddset(&signalfd_set, SIGUSR1));
-	CHECK(sigaddset(&signalfd_set, SIGALRM));
+	/* Create the sigmask to block all signals, except USR1 and SIGTIMER */
+	CHECK(sigfillset(&core_signal_set));
+	CHECK(sigdelset(&core_signal_set, SIGUSR1));
+	CHECK(sigdelset(&core_signal_set, SIGTIMER));
 }
 
 
@@ -199,11 +224,15 @@ static void* bootfunc_wrapper(void* _core)
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
-	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
-	core->timer_sigevent.sigev_signo = SIGALRM;
+	/* 
+		Create a thread-specific timer, which signals this thread. Thus, the 
+		ALARM of a running core does not wait for the host to run the PIC thread.
+	 */
+	core->timer_sigevent.sigev_notify = SIGEV_THREAD_ID;
+	core->timer_sigevent.sigev_signo = SIGTIMER;
 	core->timer_sigevent.sigev_value.sival_int = core->id;
-	CHECK(timer_create(CLOCK_REALTIME, & core->timer_sigevent, & core->timer_id));
+	core->timer_sigevent.sigev_notify_thread_id = gettid();
+	CHECK(timer_create(CLOCK_MONOTONIC, & core->timer_sigevent, & core->timer_id));
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
@@ -282,6 +311,19 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 }
 
 
+/*
+	This is the handler run by core threads when their timer expires.
+ */
+static void sigtimer_handler(int signo, siginfo_t* si, void* ctx)
+{
+	Core* core = & CORE[si->si_value.sival_int];
+
+	core->intpending[ALARM] = 1;
+	core->irq_raised[ALARM] ++;
+	sigusr1_handler(signo, si, ctx);
+}
+
+
 /*
 	Peripherals
  */
@@ -495,10 +537,9 @@ static void pic_drain_sigusr1(int sigusr1fd)
 	The PIC daemon is the dispatcher on interrupts to core threads,
 	by calling raise_interrupt().
 
-	Interrupts sent include
-	(a) ALARM, when the per-core timer expires
-	(b) SERIAL_RX_READY  &  SERIAL_TX_READY, when some 
-		io_device becomes ready.
+	Interrupts sent include SERIAL_RX_READY  &  SERIAL_TX_READY, when 
+	some io_device becomes ready. (The ALARM of the per-core timer is
+	sent to the core thread directly.)
 
  */
 static void PIC_daemon(uint serialno)
@@ -520,10 +561,8 @@ static void PIC_daemon(uint serialno)
 
 	int sigusr1fd = signalfd(-1, &sigusr1_set, SFD_NONBLOCK);
 	CHECK(sigusr1fd);
-	int sigalrmfd = signalfd(-1, &sigalrm_set, SFD_NONBLOCK);
-	CHECK(sigalrmfd);
 
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &saved_mask));
 		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
@@ -544,7 +583,6 @@ static void PIC_daemon(uint serialno)
 			if(! term->con.ready) fdset_add(&writefds, term->con.fd, &maxfd);
 		}
 
-		fdset_add(&readfds, sigalrmfd, &maxfd);
 		fdset_add(&readfds, sigusr1fd, &maxfd);
 
 		/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
@@ -558,23 +596,6 @@ static void PIC_daemon(uint serialno)
 		if(selcode<0) continue;
 		__atomic_fetch_add(&PIC_loops,1,__ATOMIC_RELAXED);
 
-		/* First raise ALRM as needed (timers have priority :-) */
-		if( FD_ISSET(sigalrmfd, &readfds) ) {
-			struct signalfd_siginfo sfdinfo;
-
-			while(1) {
-				int rc = read(sigalrmfd, &sfdinfo, sizeof(sfdinfo));
-				if(rc==-1) {
-					assert(errno==EAGAIN || errno==EWOULDBLOCK);
-					break;
-				}
-				assert(rc==sizeof(sfdinfo));
-
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
-			}
-		}
-
 		/* Discard any USR1 signals to PIC (their purpose was to unblock PIC 
 		   from select) */
 		if( FD_ISSET(sigusr1fd, &readfds) ) {
@@ -613,7 +634,6 @@ static void PIC_daemon(uint serialno)
 
 	/* Close signal fds */
 	pic_drain_sigusr1(sigusr1fd);
-	CHECK(close(sigalrmfd));
 	CHECK(close(sigusr1fd));
 
 	/* Restore sigmask */
@@ -651,6 +671,7 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 
 	/* Install signal handler for SIGUSR1 */
 	CHECK(sigaction(SIGUSR1, &USR1_sigaction, &USR1_saved_sigaction));
+	CHECK(sigaction(SIGTIMER, &TIMER_sigaction, &TIMER_saved_sigaction));
 
 	/* Set pic_active to 1 */
 	PIC_thread = pthread_self();
@@ -665,6 +686,15 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 
 	/* Initialize the halted list */
 	rlnode_init(&halted_list, NULL);
+	pending_restarts = 0;
+
+	/* 
+		The halt deadlines are given by bios_clock(), so the cores wait on the
+		monotonic clock, which is not affected when the wall clock is set.
+	 */
+	pthread_condattr_t halt_condattr;
+	CHECKRC(pthread_condattr_init(& halt_condattr));
+	CHECKRC(pthread_condattr_setclock(& halt_condattr, CLOCK_MONOTONIC));
 
 	/* Launch the core threads */
 	ncores = cores;
@@ -673,8 +703,9 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 		CORE[c].bootfunc = bootfunc;
 		CORE[c].id = c;
 
-		pthread_cond_init(& CORE[c].halt_cond, NULL);
+		pthread_cond_init(& CORE[c].halt_cond, & halt_condattr);
 		CORE[c].halted = 0;
+		CORE[c].restart_pending = 0;
 		rlnode_init(& CORE[c].halted_node, &CORE[c]);
 
 		/* Initialize Core statistics */
@@ -690,6 +721,7 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 		CHECK(snprintf(thread_name,16,"core-%d",c));
 		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
 	}
+	CHECKRC(pthread_condattr_destroy(& halt_condattr));
 
 	/* Initialize PIC statistics */
 	PIC_loops = 0; PIC_usr1_queued = PIC_usr1_drained = 0;
@@ -708,6 +740,7 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 
 	/* Restore signal mask before VM execution */
 	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
+	CHECK(sigaction(SIGTIMER, &TIMER_saved_sigaction, NULL));
 
 	/* Delete the Core table */
 	ncores = 0;
@@ -734,18 +767,88 @@ uint cpu_cores()
 
 void cpu_core_halt()
 {
-	/* unmask signals and call sigsuspend */
+	cpu_core_halt_until(BIOS_NO_DEADLINE);
+}
+
+/* Return 1 if some interrupt is pending for the core */
+static inline int core_int_pending(Core* core)
+{
+	for(int intno = 0; intno < maximum_interrupt_no; intno++)
+		if(core->intpending[intno]) return 1;
+	return 0;
+}
+
+/* 
+	Return the time (as returned by bios_clock) when the timer of the core 
+	expires, rounded up, or BIOS_NO_DEADLINE if the timer is not set.
+ */
+static TimerDuration core_timer_expiry(Core* core)
+{
+	struct itimerspec t;
+	CHECK(timer_gettime(core->timer_id, &t));
+	if(t.it_value.tv_sec==0 && t.it_value.tv_nsec==0)
+		return BIOS_NO_DEADLINE;
+	return bios_clock() + 1000000*t.it_value.tv_sec + (t.it_value.tv_nsec+999)/1000 + 1;
+}
+
+/* Return 1 if SIGTIMER is pending for the current core, while it is blocked */
+static inline int core_timer_pending()
+{
+	sigset_t set;
+	CHECK(sigpending(&set));
+	return sigismember(&set, SIGTIMER);
+}
+
+void cpu_core_halt_until(TimerDuration deadline)
+{
 	Core* core = curr_core();
 	assert(! core->int_disabled);
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_interrupt_set, NULL));
+
+	/* 
+		SIGTIMER is blocked while the core is halted; the core is restarted
+		when its timer expires, and the signal is delivered after the halt.
+		A timer that expires before it is read has its signal pending.
+	 */
+	TimerDuration timer = core_timer_expiry(core);
+	if(timer < deadline)
+		deadline = timer;
+
+	struct timespec abstime = {
+		.tv_sec = deadline / 1000000,
+		.tv_nsec = (deadline % 1000000) * 1000
+	};
+
 	pthread_mutex_lock(& core_halt_mutex);
-	core->halted = 1;
-	rlist_push_front(&halted_list, & core->halted_node);
-	while(core->halted)
-		pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+
+	if(core->restart_pending) {
+		/* We were restarted before we halted */
+		core->restart_pending = 0;
+	}
+	else if(pending_restarts > 0) {
+		/* Some core was asked to restart, while none was halted */
+		pending_restarts--;
+	}
+	else if(! core_int_pending(core) && ! core_timer_pending()) {
+		core->halted = 1;
+		rlist_push_front(&halted_list, & core->halted_node);
+		while(core->halted) {
+			if(deadline == BIOS_NO_DEADLINE)
+				pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+			else if(pthread_cond_timedwait(& core->halt_cond, & core_halt_mutex, &abstime)==ETIMEDOUT 
+				&& core->halted) {
+				/* The deadline has passed */
+				core->halted = 0;
+				rlist_remove(& core->halted_node);
+			}
+		}
+		core->restart_pending = 0;
+	}
+
 	assert(! core->halted);
 	pthread_mutex_unlock(& core_halt_mutex);
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &core_interrupt_set, NULL));
 	dispatch_interrupts(core);
 }
 
@@ -756,6 +859,8 @@ static inline void core_restart(Core* core)
 		rlist_remove(& core->halted_node);
 		pthread_cond_signal(& core->halt_cond);
 	}	
+	else
+		core->restart_pending = 1;
 }
 
 void cpu_core_restart(uint c)
@@ -769,8 +874,10 @@ void cpu_core_restart_one()
 {
 	pthread_mutex_lock(& core_halt_mutex);
 	if(! is_rlist_empty(&halted_list)) {
-		core_restart((Core*) rlist_pop_front(&halted_list)->obj);
+		core_restart((Core*) halted_list.next->obj);
 	}	
+	else if(pending_restarts < ncores)
+		pending_restarts++;
 	pthread_mutex_unlock(& core_halt_mutex);	
 }
 
@@ -787,6 +894,11 @@ void cpu_core_barrier_sync()
 	pthread_barrier_wait(& core_barrier);
 }
 
+void cpu_relax()
+{
+	sched_yield();
+}
+
 void cpu_ici(uint core)
 {
 	assert(core < ncores);
@@ -803,7 +915,7 @@ void cpu_disable_interrupts()
 {
 	Core* core = curr_core();
 	if(! core->int_disabled) {
-		CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+		CHECKRC(pthread_sigmask(SIG_BLOCK, &core_interrupt_set, NULL));
 		core->int_disabled = 1;
 	}
 }
@@ -813,12 +925,103 @@ void cpu_enable_interrupts()
 	Core* core = curr_core();
 	if(core->int_disabled) {        
 		core->int_disabled = 0;
-		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));      
+		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &core_interrupt_set, NULL));
 		dispatch_interrupts(curr_core());
 	}
 }
 
 
+#ifdef BIOS_FAST_CONTEXT
+
+/*
+	The x86-64 context switch.
+
+	bios_ctx_switch(void** oldsp, void* newsp) pushes the callee-saved registers
+	(rbp, rbx, r12-r15) and the SSE/x87 control words on the current stack, saves
+	the stack pointer into *oldsp, and then pops the same from newsp. 
+
+	A new context is prepared by cpu_initialize_context(), so that it 'returns'
+	into bios_ctx_start, with the function to call in r12.
+ */
+void bios_ctx_switch(void** oldsp, void* newsp);
+void bios_ctx_start();
+
+__asm__(
+	".pushsection .text\n"
+	".globl bios_ctx_switch\n"
+	".type bios_ctx_switch,@function\n"
+	"bios_ctx_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size bios_ctx_switch,.-bios_ctx_switch\n"
+	"\n"
+	".globl bios_ctx_start\n"
+	".type bios_ctx_start,@function\n"
+	"bios_ctx_start:\n"
+	"	xorl %ebp, %ebp\n"
+	"	callq *%r12\n"
+	"	callq abort\n"
+	".size bios_ctx_start,.-bios_ctx_start\n"
+	".popsection\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The top of the stack, aligned to 16 bytes */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+
+	/* 
+		The initial frame, as pushed by bios_ctx_switch. The slot above the
+		return address is an (unused) return address for bios_ctx_start, 
+		so that the stack is aligned as required when ctx_func is called.
+	 */
+	uint64_t* frame = (uint64_t*)(top - 8*sizeof(uint64_t) - 16);
+
+	uint32_t mxcsr; uint16_t fpucw;
+	__asm__ volatile ("stmxcsr %0" : "=m"(mxcsr));
+	__asm__ volatile ("fnstcw %0" : "=m"(fpucw));
+
+	frame[0] = mxcsr | ((uint64_t)fpucw << 32);  /* control words */
+	frame[1] = 0;                   /* r15 */
+	frame[2] = 0;                   /* r14 */
+	frame[3] = 0;                   /* r13 */
+	frame[4] = (uint64_t)ctx_func;  /* r12 */
+	frame[5] = 0;                   /* rbx */
+	frame[6] = 0;                   /* rbp */
+	frame[7] = (uint64_t)bios_ctx_start;  /* return address */
+	frame[8] = 0;
+
+	ctx->sp = frame;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	bios_ctx_switch(&oldctx->sp, newctx->sp);
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -840,6 +1043,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -858,9 +1063,13 @@ TimerDuration bios_set_timer(TimerDuration usec)
 	};
 
 	struct itimerspec oldtime;
-	
-	timer_settime(curr_core()->timer_id, 0, &newtime, &oldtime);
+
+	/* 
+		Clear a pending ALARM before the timer is set: a short countdown may
+		expire, and its ALARM be raised, before timer_settime() returns. 
+	 */
 	curr_core()->intpending[ALARM] = 0;
+	timer_settime(curr_core()->timer_id, 0, &newtime, &oldtime);
 
 	assert(oldtime.it_interval.tv_sec ==0 && oldtime.it_interval.tv_nsec==0);
 	return 1000000*oldtime.it_value.tv_sec + oldtime.it_value.tv_nsec/1000ull;
@@ -874,7 +1083,9 @@ TimerDuration bios_cancel_timer()
 
 TimerDuration bios_clock()
 {
-	return system_clock * 1000ul;
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_sec*1000000ul + curtime.tv_nsec/1000ul;
 }	
 
 
@@ -241,6 +241,30 @@ void cpu_enable_interrupts();
 void cpu_core_halt();
 
 
+/** @brief A deadline that never expires, for @c cpu_core_halt_until. */
+#define BIOS_NO_DEADLINE ((TimerDuration)-1)
+
+/**
+	@brief Halt the core until an interrupt arrives, or a deadline passes.
+
+	This function is like @c cpu_core_halt, except that the core will also be
+	restarted when the value of @c bios_clock() reaches @c deadline. If @c deadline
+	has already passed, the call returns immediately. If @c deadline is 
+	@c BIOS_NO_DEADLINE, the call is equivalent to @c cpu_core_halt().
+
+	A restart of this core (or a call to @c cpu_core_restart_one() while no core
+	was halted) that happens before the core halts is not lost; the next halt 
+	of the core will return immediately.
+
+	An idle core can use this call to wait for the next timeout, without
+	consuming simulation resources and without a periodic timer.
+
+	@param deadline the time (as returned by @c bios_clock) to restart the core
+	@see cpu_core_halt
+*/
+void cpu_core_halt_until(TimerDuration deadline);
+
+
 /**
 	@brief Restart the given core.
 
@@ -264,10 +288,41 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/**
+	@brief Relax the core while busy-waiting.
+
+	This call tells the VM that the core is spinning, waiting for some other core
+	to make progress (e.g., to release a spinlock). Since the cores are simulated,
+	the spinning core might be keeping the simulation of that other core from
+	running; the call lets the host run it.
+*/
+void cpu_relax();
+
+
+/*
+	On x86-64, contexts are switched by a small assembly routine which saves
+	only the callee-saved registers, the stack pointer and the floating-point 
+	control state. Elsewhere (or when BIOS_UCONTEXT is defined) the portable
+	ucontext routines are used.
+*/
+#if defined(__x86_64__) && !defined(BIOS_UCONTEXT)
+#define BIOS_FAST_CONTEXT
+#endif
+
+#ifdef BIOS_FAST_CONTEXT
+/**
+	@brief A type for saving CPU context into.
+
+	The context is saved on the stack of the thread; only the stack pointer 
+	is kept here.
+*/
+typedef struct cpu_context { void* sp; } cpu_context_t;
+#else
 /**
 	@brief A type for saving CPU context into.
 */
 typedef ucontext_t cpu_context_t;
+#endif
 
 
 /**
@@ -289,6 +344,10 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
 	Save the current context into @c oldctx and load the contents of @c newctx
 	into the CPU.
 
+	The signal mask of the core is not saved or restored by this call. 
+	Therefore, contexts must be switched with the same signal mask (e.g., with 
+	interrupts disabled).
+
 	@param oldctx pointer to the storage for the old context
 	@param newctx pointer to the new context to be loaded
 */
@@ -332,13 +391,10 @@ TimerDuration bios_cancel_timer();
 /**
 	@brief Get the current time from the hardware clock.
 
-	This function returns a real-time clock value, in usec.
-	The value of the clock is 10 times the number of seconds since
-	the epoch. 
-
-	The resolution of the clock is very low, currently 
-	around 100 msec. Therefore, it is inappropriate for any type of
-	precise timing.
+	This function returns a monotonic clock value, in usec since
+	some unspecified time in the past. The clock is not affected by
+	changes to the wall-clock time of the host. The resolution of the 
+	clock is that of the host monotonic clock.
  */
 TimerDuration bios_clock();
 
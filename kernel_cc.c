@@ -19,45 +19,325 @@
   */
 
 
+/*
+ 	Queued spinlocks.
+ 	-----------------
+
+ 	These are MCS locks, for the non-preemptive domain of the kernel. The lock 
+ 	word points to the last of a queue of nodes, one for each core that holds
+ 	or waits for the lock. A core that arrives swaps its own node into the lock
+ 	word, links it after its predecessor and spins on a flag of its own node, 
+ 	until the predecessor passes the lock on. Thus, the lock is acquired in 
+ 	FIFO order, and a waiting core does not write to shared cache lines, no 
+ 	matter how many cores contend.
+
+ 	Each core has a few nodes, so that it can hold a few spinlocks at the same
+ 	time. Since preemption is off, a node is taken and released on the same 
+ 	core, without races with the interrupt handlers.
+ */
+
+#define SPIN_NODES 8
+/* 
+  A waiter yields the host CPU often, because the simulated cores may be more 
+  than the host CPUs; then, a core that is next in the queue may not be running.
+ */
+#define SPIN_SPINS 20
+
+/** \cond HELPER Helper structure for the queued spinlocks. */
+struct __spin_node {
+	struct __spin_node* next;	/* the next core in the queue */
+	Spinlock* lock;				/* the lock the node is used for, or NULL if free */
+	int locked;					/* set while the core waits for the lock */
+} __attribute__((aligned(64)));
+/** \endcond */
+
+static struct __spin_node spin_nodes[MAX_CORES][SPIN_NODES];
+
+void spin_lock(Spinlock* lock)
+{
+	assert(! get_core_preemption());
+
+	struct __spin_node* node = spin_nodes[cpu_core_id];
+	while (node->lock != NULL) {
+		node++;
+		assert(node < spin_nodes[cpu_core_id] + SPIN_NODES);
+	}
+
+	node->lock = lock;
+	node->next = NULL;
+	node->locked = 1;
+
+	struct __spin_node* pred = __atomic_exchange_n(lock, node, __ATOMIC_ACQ_REL);
+	if (pred == NULL)
+		return;
+
+	__atomic_store_n(&pred->next, node, __ATOMIC_RELEASE);
+	int spin = SPIN_SPINS;
+	while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+#if defined(__x86__) || (__x86_64__)
+		__builtin_ia32_pause();
+#endif
+		if (--spin == 0) {
+			spin = SPIN_SPINS;
+			cpu_relax();
+		}
+	}
+}
+
+
+void spin_unlock(Spinlock* lock)
+{
+	struct __spin_node* node = spin_nodes[cpu_core_id];
+	while (node->lock != lock) {
+		node++;
+		assert(node < spin_nodes[cpu_core_id] + SPIN_NODES);
+	}
+
+	struct __spin_node* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if (next == NULL) {
+		/* No successor yet: either free the lock, or wait for the successor to link in */
+		struct __spin_node* self = node;
+		if (__atomic_compare_exchange_n(lock, &self, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			node->lock = NULL;
+			return;
+		}
+		while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+			cpu_relax();
+	}
+
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+	node->lock = NULL;
+}
+
+
+
 /*
  	Pre-emption aware mutex.
  	-------------------------
 
  	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	sleeping mutex if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	The mutex word holds the owner (the locking thread) or 0 if the mutex is 
+ 	free; bit MUTEX_WAITERS is set while threads may be sleeping on it. In the
+ 	preemptive domain, a thread spins for a while, as long as the owner runs 
+ 	on another core, and then it sleeps in a wait queue. Each wait queue is 
+ 	shared by all the mutexes that hash to it, and is protected by a queued 
+ 	spinlock. 
+
+ 	Unlock wakes up the first waiter for the mutex, in FIFO order. The mutex 
+ 	is released, so that a running thread may take it meanwhile; else, every 
+ 	unlock would wait for a wakeup, and the waiters would form a convoy. 
+ 	A woken waiter that fails to take the mutex sleeps again at the head of 
+ 	the queue, and the next unlock hands off the mutex to it directly.
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
+
+#define MUTEX_SPINS 1000
+#define MUTEX_OWNER_CHECK 64
+#define MUTEX_WAITERS ((Mutex) 1)
+#define MUTEX_QUEUES 64
+
+/** \cond HELPER Helper structures for the mutex wait queues. */
+typedef struct __mutex_waiter {
+	struct __mutex_waiter* next;	/* next in the wait queue */
+	Mutex* mutex;					/* the mutex waited for */
+	TCB* thread;					/* the thread to wake up */
+	int handoff;					/* set if the mutex must be handed off to the thread */
+	int granted;					/* set when the mutex is handed off to the thread */
+} __mutex_waiter;
+
+typedef struct __mutex_queue {
+	Spinlock spinlock;
+	__mutex_waiter* head;
+	__mutex_waiter* tail;
+} __mutex_queue;
+/** \endcond */
+
+static __mutex_queue mutex_queues[MUTEX_QUEUES];
+
+static inline __mutex_queue* mutex_queue(Mutex* lock)
+{
+	uintptr_t h = (uintptr_t) lock;
+	return &mutex_queues[((h >> 3) ^ (h >> 9)) % MUTEX_QUEUES];
+}
+
+/* 
+  The owner of a mutex locked by the current thread. Before the scheduler 
+  starts, the core runs as its idle thread.
+ */
+static inline Mutex mutex_self()
+{
+	TCB* self = CURTHREAD;
+	return (Mutex) (self != NULL ? self : &CURCORE.idle_thread);
+}
+
+/* Return 1 if the owner of the mutex is running on another core */
+static int mutex_owner_running(Mutex owner)
+{
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (c != cpu_core_id 
+			&& (Mutex) __atomic_load_n(&cctx[c].current_thread, __ATOMIC_RELAXED) == owner)
+			return 1;
+	return 0;
+}
+
+/* Remove a waiter from its wait queue, if it is still there */
+static void mutex_queue_remove(__mutex_queue* q, __mutex_waiter* w)
+{
+	__mutex_waiter** p = &q->head;
+	__mutex_waiter* prev = NULL;
+	while (*p != NULL && *p != w) {
+		prev = *p;
+		p = &(*p)->next;
+	}
+	if (*p == w) {
+		*p = w->next;
+		if (q->tail == w) q->tail = prev;
+	}
+}
+
+/*
+  Sleep until the mutex is released or handed off to us. Return 1 if it 
+  was handed off, and 0 if the caller must try to lock it again. A thread
+  that was woken up before (@c handoff) waits at the head of the queue.
+ */
+static int mutex_sleep(Mutex* lock, int handoff)
+{
+	int preempt = preempt_off;
+	__mutex_queue* q = mutex_queue(lock);
+	__mutex_waiter w = { .next = NULL, .mutex = lock, .thread = CURTHREAD, 
+		.handoff = handoff, .granted = 0 };
+	int granted = 0;
+
+	spin_lock(&q->spinlock);
+
+	/* Announce the waiter; the owner will not release the mutex without the queue lock */
+	Mutex v = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	if ((v & ~MUTEX_WAITERS) != 0 && ((v & MUTEX_WAITERS) 
+		|| __atomic_compare_exchange_n(lock, &v, v | MUTEX_WAITERS, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))) {
+		if (handoff) {
+			w.next = q->head;
+			q->head = &w;
+			if (q->tail == NULL) q->tail = &w;
+		} else {
+			if (q->tail) q->tail->next = &w; else q->head = &w;
+			q->tail = &w;
+		}
+
+		CURTHREAD->wchan = "Mutex_Lock";
+		sleep_releasing_spinlock(STOPPED, &q->spinlock, SCHED_MUTEX, NO_TIMEOUT);
+		CURTHREAD->wchan = NULL;
+
+		spin_lock(&q->spinlock);
+		granted = w.granted;
+		if (! granted)
+			mutex_queue_remove(q, &w);
+	}
+	spin_unlock(&q->spinlock);
+
+	if (preempt) preempt_on;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return granted;
+}
+
 void Mutex_Lock(Mutex* lock)
 {
-#define MUTEX_SPINS 1000
+	Mutex self = mutex_self();
+	Mutex v = 0;
+	if (__atomic_compare_exchange_n(lock, &v, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	int spin = MUTEX_SPINS;
+	int woken = 0;
+	Mutex checked = 0;	/* the owner last looked up on the other cores */
+	int running = 0;	/* set if it was running then */
+	while (1) {
+		/* A released mutex keeps its MUTEX_WAITERS bit */
+		v = __atomic_load_n(lock, __ATOMIC_RELAXED);
+		if ((v & ~MUTEX_WAITERS) == 0) {
+			if (__atomic_compare_exchange_n(lock, &v, self | v, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+
+		if (get_core_preemption()) {
+			/* Scanning the cores is costly; do it for a new owner, and once per batch of spins */
+			Mutex owner = v & ~MUTEX_WAITERS;
+			if (owner != checked || spin % MUTEX_OWNER_CHECK == 0) {
+				running = mutex_owner_running(owner);
+				checked = owner;
+			}
+			if (spin <= 0 || !running) {
+				if (mutex_sleep(lock, woken))
+					return;
+				woken = 1;
+				spin = MUTEX_SPINS;
+				checked = 0;
+				continue;
+			}
+		}
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
 #if defined(__x86__) || (__x86_64__)
-      __builtin_ia32_pause();
+		__builtin_ia32_pause();
 #endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(get_core_preemption())
-      		yield(SCHED_MUTEX); 
-      }
-    }
-  }
-#undef MUTEX_SPINS
+		if (spin > 0)
+			spin--;
+		else if (! get_core_preemption()) {
+			spin = MUTEX_SPINS;
+			cpu_relax();
+		}
+	}
+}
+
+
+int Mutex_TryLock(Mutex* lock)
+{
+	Mutex v = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	return (v & ~MUTEX_WAITERS) == 0
+		&& __atomic_compare_exchange_n(lock, &v, mutex_self() | v, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+	Mutex v = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	if (!(v & MUTEX_WAITERS) 
+		&& __atomic_compare_exchange_n(lock, &v, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return;
+
+	/* There may be waiters: hand off the mutex to the first one */
+	int preempt = preempt_off;
+	__mutex_queue* q = mutex_queue(lock);
+	spin_lock(&q->spinlock);
+
+	__mutex_waiter* w = q->head;
+	while (w != NULL && w->mutex != lock)
+		w = w->next;
+
+	if (w != NULL) {
+		mutex_queue_remove(q, w);
+		__mutex_waiter* more = w->next;
+		while (more != NULL && more->mutex != lock)
+			more = more->next;
+
+		/* Either hand off the mutex to the waiter, or release it */
+		Mutex owner = w->handoff ? (Mutex) w->thread : 0;
+		__atomic_store_n(lock, owner | (more ? MUTEX_WAITERS : 0), __ATOMIC_RELEASE);
+		w->granted = w->handoff;
+		/* Wake up under the queue lock, so that the waiter's frame stays valid */
+		wakeup(w->thread);
+	} else {
+		__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+	}
+
+	spin_unlock(&q->spinlock);
+	if (preempt) preempt_on;
 }
 
 
@@ -76,6 +356,15 @@ typedef struct __cv_waiter {
 } __cv_waiter;
 /** \endcond */
 
+/* The waitset lock of a condition variable is a spinlock, opaque to programs */
+_Static_assert(sizeof(((CondVar*)0)->waitset_lock) == sizeof(Spinlock),
+	"CondVar::waitset_lock cannot hold a Spinlock");
+
+static inline Spinlock* cv_lock(CondVar* cv)
+{
+	return (Spinlock*) &cv->waitset_lock;
+}
+
 /**
    @internal
    A helper routine to remove a condition waiter from the CondVar ring.
@@ -124,7 +413,8 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0 };
 	rlnode_init(& waiter.node, &waiter);
 
-	Mutex_Lock(&(cv->waitset_lock));
+	int preempt = preempt_off;
+	spin_lock(cv_lock(cv));
 	/* We just push the current thread to the back of the list */
 	if(cv->waitset) {
 		__cv_waiter* wset = cv->waitset;
@@ -135,17 +425,18 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 
 	/* Now atomically release mutex and sleep */
 	Mutex_Unlock(mutex);
-	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
+	sleep_releasing_spinlock(STOPPED, cv_lock(cv), cause, timeout);
 
 	/* Woke up, we must check wether we were signaled, and tidy up */
-	Mutex_Lock(&(cv->waitset_lock));
+	spin_lock(cv_lock(cv));
 	if(! waiter.removed) {
 		assert(! waiter.signalled);
 
 		/* We must remove ourselves from the ring! */
 		remove_from_ring(cv, &waiter);
 	}
-	Mutex_Unlock(&(cv->waitset_lock));
+	spin_unlock(cv_lock(cv));
+	if(preempt) preempt_on;
 
 	Mutex_Lock(mutex);
 	return waiter.signalled;
@@ -157,15 +448,19 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
   Helper for Cond_Signal and Cond_Broadcast. This method 
   will actually find a waiter to signal, if one exists. 
   Else, it leaves the cv->waitset == NULL.
+
+  If @c handoff is set, the waiter is woken up by @c wakeup_handoff(), 
+  since the signaller often blocks soon after (e.g., a pipe writer that 
+  goes on to read the reply). 
  */
-static inline void cv_signal(CondVar* cv)
+static inline void cv_signal(CondVar* cv, int handoff)
 {
 	/* Wakeup first process in the waiters' queue, if it exists. */
 	while(cv->waitset) {
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
 		waiter->removed = 1;
-		if(wakeup(waiter->thread)) {
+		if(handoff ? wakeup_handoff(waiter->thread) : wakeup(waiter->thread)) {
 			waiter->signalled = 1;
 			return;
 		}
@@ -186,19 +481,29 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 }
 
 
+/*
+  The waitset lock is a spinlock, held with preemption off; thus, a woken
+  thread of higher priority does not preempt us, only to spin on the lock.
+ */
 void Cond_Signal(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  int preempt = preempt_off;
+  spin_lock(cv_lock(cv));
+  cv_signal(cv, 1);
+  spin_unlock(cv_lock(cv));
+  if(preempt) preempt_on;
 }
 
 
 void Cond_Broadcast(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  int preempt = preempt_off;
+  spin_lock(cv_lock(cv));
+  /* Only the first waiter is handed off the core */
+  cv_signal(cv, 1);
+  while(cv->waitset) cv_signal(cv, 0);
+  spin_unlock(cv_lock(cv));
+  if(preempt) preempt_on;
 }
 
 
@@ -257,33 +562,45 @@ static int kernel_sem = 1;
 /* Semaphore condition */
 static CondVar kernel_sem_cv = COND_INIT;
 
+/*
+  Preemption is off while kernel_mutex is held, so that a thread woken up
+  by Cond_Signal() does not preempt the holder of the mutex.
+ */
 void kernel_lock()
 {
+	int preempt = preempt_off;
 	Mutex_Lock(& kernel_mutex);
 	while(kernel_sem<=0) {
 		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
 	}
 	kernel_sem--;
 	Mutex_Unlock(& kernel_mutex);
+	if(preempt) preempt_on;
 }
 
 void kernel_unlock()
 {
+	int preempt = preempt_off;
 	Mutex_Lock(& kernel_mutex);
 	kernel_sem++;
 	Cond_Signal(&kernel_sem_cv);
 	Mutex_Unlock(& kernel_mutex);
+	if(preempt) preempt_on;
 }
 
 int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
+	int preempt = preempt_off;
+
 	/* Atomically release kernel semaphore */
 	Mutex_Lock(& kernel_mutex);
 	kernel_sem++;
 	Cond_Signal(&kernel_sem_cv);	
 
+	CURTHREAD->wchan = wchan_name;
 	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
+	CURTHREAD->wchan = NULL;
 
 	/* Reacquire kernel semaphore */
 	while(kernel_sem<=0)
@@ -291,6 +608,7 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 	kernel_sem--;
 	Mutex_Unlock(& kernel_mutex);		
 
+	if(preempt) preempt_on;
 	return ret;
 }
 
@@ -306,10 +624,12 @@ void kernel_broadcast(CondVar* cv)
 
 void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
 {
+	int preempt = preempt_off;
 	Mutex_Lock(& kernel_mutex);
 	kernel_sem++;
 	Cond_Signal(&kernel_sem_cv);
 	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	if(preempt) preempt_on;
 }
 
 
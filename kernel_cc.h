@@ -82,6 +82,41 @@ void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
 
 
 
+/**
+	@brief Lock a queued spinlock.
+
+	Queued (MCS) spinlocks are used for the non-preemptive locks of the kernel.
+	The waiting cores get the lock in FIFO order, and each one spins on a
+	private cache line. A spinlock must be locked and unlocked with preemption 
+	off, on the same core, and a core may hold a few spinlocks at the same 
+	time.
+
+	@param lock the spinlock to lock
+	@see Spinlock
+ */
+void spin_lock(Spinlock* lock);
+
+/**
+	@brief Unlock a queued spinlock, which the current core locked.
+
+	@param lock the spinlock to unlock
+	@see spin_lock
+ */
+void spin_unlock(Spinlock* lock);
+
+
+/**
+	@brief Try to lock a mutex without waiting.
+
+	This is used by the scheduler, when it needs to lock against the normal
+	lock ordering. 
+
+	@param lock the mutex to lock
+	@returns 1 if the mutex was locked, 0 if it was already locked by someone else
+ */
+int Mutex_TryLock(Mutex* lock);
+
+
 /** @brief Set the preemption status for the current thread.
 
  	Depending on the value of the argument, this function will set preemption on 
@@ -1,6 +1,7 @@
 #include "tinyos.h"
 #include "kernel_streams.h"
 #include "kernel_proc.h"
+#include "kernel_threads.h"
 
 typedef struct procinfo_cb
 {
@@ -50,6 +51,26 @@ void get_procinfo(PCB * proc,procinfo* pinfo)
 
     pinfo->thread_count= proc->thread_count;
 
+    /* The totals of the exited threads, plus the counters of the live ones */
+    pinfo->run_time = proc->run_time;
+    pinfo->wait_time = proc->wait_time;
+    pinfo->voluntary_switches = proc->voluntary_switches;
+    pinfo->involuntary_switches = proc->involuntary_switches;
+    pinfo->migrations = proc->migrations;
+
+    for(rlnode* n = proc->ptcb_list.next; n != &proc->ptcb_list; n = n->next) {
+        PTCB* ptcb = n->ptcb;
+        if(ptcb->exited) continue;
+        TCB* tcb = ptcb->tcb;
+        TimerDuration run_time, wait_time;
+        sched_thread_times(tcb, &run_time, &wait_time);
+        pinfo->run_time += run_time;
+        pinfo->wait_time += wait_time;
+        pinfo->voluntary_switches += tcb->voluntary_switches;
+        pinfo->involuntary_switches += tcb->involuntary_switches;
+        pinfo->migrations += tcb->migrations;
+    }
+
     pinfo->main_task = proc->main_task;
 
     pinfo->argl = proc->argl;
@@ -124,4 +145,75 @@ Fid_t sys_OpenInfo()
 
     return fid;
 
-}
\ No newline at end of file
+}
+
+
+/* 
+    The run-queue latency stream. The cursor goes over the levels,
+    then over the causes.
+*/
+
+typedef struct latencyinfo_cb
+{
+    latencyinfo linfo;
+
+    int cursor;
+
+}latencyinfo_cb;
+
+#define LATENCY_LEVELS (MAX_SCHED_LEVELS+2)
+
+
+int latencyinfo_read(void* latinf, char* buf, uint size)
+{
+    latencyinfo_cb* linfoCB = (latencyinfo_cb*) latinf;
+
+    while(linfoCB->cursor < LATENCY_LEVELS + SCHED_CAUSES) {
+        int row = linfoCB->cursor++;
+        int level = row < LATENCY_LEVELS ? row : -1;
+        int cause = row < LATENCY_LEVELS ? -1 : row - LATENCY_LEVELS;
+
+        if(sched_latency_read(level, cause, &linfoCB->linfo) > 0) {
+            size = size<=sizeof(linfoCB->linfo) ? size : sizeof(linfoCB->linfo);
+            memcpy(buf, (char*) &linfoCB->linfo, size);
+            return size;
+        }
+    }
+
+    return 0;
+}
+
+
+int latencyinfo_close(void* latinf)
+{
+    free(latinf);
+    return 0;
+}
+
+
+static file_ops latencyinfo_fops = {
+  .Open = NULL,
+  .Read = latencyinfo_read,
+  .Write = NULL,
+  .Close = latencyinfo_close
+};
+
+
+Fid_t sys_OpenLatencyInfo()
+{
+    Fid_t fid;
+    FCB * fcb;
+
+    if(!FCB_reserve(1,&fid,&fcb))
+        /* return error if there are not available fids or fcbs */
+        return NOFILE;
+
+    latencyinfo_cb* linfoCB = (latencyinfo_cb*) xmalloc(sizeof(latencyinfo_cb));
+    linfoCB->cursor = 0;
+
+    fcb->streamobj=linfoCB;
+
+    fcb->streamfunc=&latencyinfo_fops;
+
+    return fid;
+}
@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_trace.h"
 
 
 
@@ -26,6 +27,7 @@ static struct {
   Task init_task;
   int argl;
   void* args;
+  sched_params params;
 } boot_rec;
 
 
@@ -35,10 +37,11 @@ void boot_tinyos_kernel()
 
   if(cpu_core_id==0) {
     /* Initialize the kenrel data structures */
+    initialize_trace(boot_rec.params.trace);
     initialize_processes();
     initialize_devices();
     initialize_files();
-    initialize_scheduler();
+    initialize_scheduler(&boot_rec.params);
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -60,12 +63,32 @@ void boot_tinyos_kernel()
 
 
 void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
+{
+  boot_sched(ncores, nterm, NULL, boot_task, argl, args);
+}
+
+
+void boot_sched(uint ncores, uint nterm, const sched_params* params, 
+  Task boot_task, int argl, void* args)
 {
   boot_rec.init_task = boot_task;
   boot_rec.argl = argl;
   boot_rec.args = args;
 
+  if(params != NULL)
+    boot_rec.params = *params;
+  else
+    boot_rec.params = (sched_params){ 0 };
+
+  CHECK_CONDITION(boot_rec.params.levels <= MAX_SCHED_LEVELS);
+  CHECK_CONDITION(boot_rec.params.policy <= SCHED_POLICY_FAIR);
+  if(boot_rec.params.trace == NULL)
+    boot_rec.params.trace = getenv("TINYOS_TRACE");
+
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+
+  /* All cores have halted, write the trace (if any) */
+  trace_dump();
 }
 
 
@@ -37,6 +37,13 @@ static inline void initialize_PCB(PCB* pcb)
   pcb->argl = 0;
   pcb->args = NULL;
   pcb->thread_count=0;
+  pcb->gang=0;
+  pcb->gang_count=0;
+  pcb->run_time=0;
+  pcb->wait_time=0;
+  pcb->voluntary_switches=0;
+  pcb->involuntary_switches=0;
+  pcb->migrations=0;
 
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
@@ -46,6 +53,8 @@ static inline void initialize_PCB(PCB* pcb)
   rlnode_init(& pcb->ptcb_list,NULL);
   rlnode_init(& pcb->children_node, pcb);
   rlnode_init(& pcb->exited_node, pcb);
+  rlnode_init(& pcb->gang_queue, NULL);
+  rlnode_init(& pcb->gang_node, pcb);
   pcb->child_exit = COND_INIT;
 }
 
@@ -86,6 +95,12 @@ PCB* acquire_PCB()
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
+    pcb->gang = 0;
+    pcb->run_time = 0;
+    pcb->wait_time = 0;
+    pcb->voluntary_switches = 0;
+    pcb->involuntary_switches = 0;
+    pcb->migrations = 0;
     pcb_freelist = pcb_freelist->parent;
     process_count++;
   }
@@ -181,8 +196,12 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     the initialization of the PCB.
    */
   if(call != NULL) {
-    TCB* main_tcb = spawn_thread(newproc, start_main_thread);
+    TCB* main_tcb = spawn_thread(newproc, start_main_thread, 0);
     newproc->main_thread = main_tcb;
+    if(newproc->parent != NULL) {
+      sched_set_nice(main_tcb, CURTHREAD->nice);
+      main_tcb->affinity = CURTHREAD->affinity;
+    }
 
     //aquiring the newly made ptcb 
     PTCB* ptcb=initialize_PTCB(call,argl,args);
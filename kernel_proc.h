@@ -63,6 +63,18 @@ typedef struct process_control_block {
 
   int thread_count;
 
+  int gang;               /**< @brief Set if the threads of the process are gang-scheduled 
+                             @see SetGang */
+  rlnode gang_queue;      /**< @brief The ready threads of the gang (protected by the scheduler) */
+  unsigned int gang_count;  /**< @brief The number of threads in @c gang_queue */
+  rlnode gang_node;       /**< @brief Intrusive node for the scheduler's list of gangs */
+
+  TimerDuration run_time; /**< @brief The total @c TCB::run_time of the exited threads */
+  TimerDuration wait_time;  /**< @brief The total @c TCB::wait_time of the exited threads */
+  unsigned long voluntary_switches;   /**< @brief The total of the exited threads */
+  unsigned long involuntary_switches; /**< @brief The total of the exited threads */
+  unsigned long migrations; /**< @brief The total of the exited threads */
+
 } PCB;
 
 
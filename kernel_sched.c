@@ -1,10 +1,13 @@
 
 #include <assert.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include "kernel_cc.h"
 #include "kernel_proc.h"
 #include "kernel_sched.h"
+#include "kernel_trace.h"
 #include "tinyos.h"
 
 #ifndef NVALGRIND
@@ -15,24 +18,39 @@
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  On the x86 (Pentium) architecture, the stack grows downward. Therefore, we
+  can allocate the TCB at the bottom of the memory block used as the stack.
+  Between the stack and the TCB, there is a guard page, mapped with no access.
 
   +-------------+
-  |   TCB       |
+  | first frame |
   +-------------+
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
-  | first frame |
+  | guard page  |
+  +-------------+
+  |   TCB       |
   +-------------+
 
+  The block is reserved with mmap, and its pages are only committed when 
+  they are touched. Thus, the resident memory of a thread is proportional 
+  to the stack it actually uses.
+
+  Each guard page costs (about two) memory mappings of the host process,
+  which are limited. Therefore, at most a quarter of the host limit is used 
+  for guard pages; when this budget is exhausted, threads are created 
+  without a guard page.
+  With this layout, the stack of a new block (placed below the previous 
+  block by mmap) is adjacent to the TCB of the previous block, so that
+  blocks without a guard page are merged into a single mapping.
+
   Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  hit the guard page and crash own thread, before it affects other threads 
+  (which may make debugging easier).
 
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
   we do not support stack growth anyway!
@@ -40,10 +58,19 @@
 
 /*
   A counter for active threads. By "active", we mean 'existing',
-  with the exception of idle threads (they don't count).
+  with the exception of idle threads (they don't count). It is 
+  updated by atomic operations.
  */
 volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
+
+/* The affinity mask of all the cores, set by initialize_scheduler() */
+static cpumask_t sched_all_cores;
+
+/* Set unless sched_params::no_handoff disables wakeup_handoff() */
+static int sched_handoff_on;
+
+/* Set unless sched_params::no_affine_wakeup disables the preference of a woken thread for its last core */
+static int sched_affine_on;
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -52,37 +79,77 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
-
 
-/**Number of priority queues*/
-#define PRIORITY_QUEUES 3
 
-/**Number of yields called before each boost occurs*/
-#define BOOST_PERIOD 1200
+/** The time between two boosts of the queues of a core (in usec) */
+#define BOOST_PERIOD (100*QUANTUM)
 
-//#define MMAPPED_THREAD_MEM
+#define MMAPPED_THREAD_MEM
 #ifdef MMAPPED_THREAD_MEM
 
-
+/* The size of the guard page below the stack */
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread. The memory is reserved without swap space
+  (MAP_NORESERVE). The stack is executable, because gcc places the 
+  trampolines of nested functions on the stack.
  */
 void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
 
 void* allocate_thread(size_t size)
 {
 	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
 
 	return ptr;
 }
+
+static unsigned int guard_pages;       /* The number of guard pages in use */
+static unsigned int max_guard_pages;   /* The budget of guard pages */
+
+/* Compute the budget of guard pages, from the host limit of mappings */
+static void initialize_guard_pages()
+{
+	unsigned long max_map_count = 65530;   /* the Linux default */
+	FILE* f = fopen("/proc/sys/vm/max_map_count", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%lu", &max_map_count) != 1)
+			max_map_count = 65530;
+		fclose(f);
+	}
+	max_guard_pages = max_map_count / 4;
+	guard_pages = 0;
+}
+
+/*
+  Change the access of the guard page to PROT_NONE, so that a stack 
+  overflow is detected as seg.fault. Return 1 on success, 0 if the 
+  thread has no guard page.
+ */
+static int protect_guard_page(void* guard)
+{
+	if (__atomic_add_fetch(&guard_pages, 1, __ATOMIC_RELAXED) <= max_guard_pages
+		&& mprotect(guard, THREAD_GUARD_SIZE, PROT_NONE) == 0)
+		return 1;
+	__atomic_sub_fetch(&guard_pages, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Release the guard page of a block about to be freed */
+static void release_guard_page(void* guard) 
+{ 
+	__atomic_sub_fetch(&guard_pages, 1, __ATOMIC_RELAXED); 
+}
 #else
+
+#define THREAD_GUARD_SIZE 0
+static void initialize_guard_pages() { }
+static int protect_guard_page(void* guard) { return 0; }
+static void release_guard_page(void* guard) { }
+
 /*
   Use malloc to allocate a thread. This is probably faster than  mmap, but
   cannot be made easily to 'detect' stack overflow.
@@ -97,6 +164,133 @@ void* allocate_thread(size_t size)
 }
 #endif
 
+/* The size of the memory block of a thread with the given stack size */
+#define THREAD_SIZE(stack_size) (THREAD_GUARD_SIZE + (stack_size) + THREAD_TCB_SIZE)
+
+/* Allocate a new thread block, and return the TCB in it */
+static TCB* allocate_tcb(size_t stack_size)
+{
+	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE(stack_size));
+	__atomic_add_fetch(&CURCORE.tcb_allocs, 1, __ATOMIC_RELAXED);
+	tcb->stack_size = stack_size;
+	tcb->stack_guard = protect_guard_page(((void*)tcb) + THREAD_TCB_SIZE);
+	return tcb;
+}
+
+/* Free the block of a TCB */
+static void free_tcb(TCB* tcb)
+{
+	if (tcb->stack_guard)
+		release_guard_page(((void*)tcb) + THREAD_TCB_SIZE);
+	free_thread(tcb, THREAD_SIZE(tcb->stack_size));
+}
+
+/*
+  The TCB cache.
+
+  Freed thread blocks (TCB and stack) of the default stack size are kept for 
+  reuse, so that thread creation and exit do not go to the allocator in 
+  steady state. Each core 
+  keeps up to TCB_CACHE_SIZE blocks in CCB::tcb_cache, which is only accessed 
+  by the core itself, with preemption off. When the core cache is full or 
+  empty, half of it is moved to or from a global pool. Blocks above 
+  TCB_POOL_SIZE in the global pool are freed, outside the pool lock.
+ */
+#define TCB_CACHE_SIZE 16
+#define TCB_POOL_SIZE 256
+
+static rlnode tcb_pool;                 /* The global pool of free blocks */
+static unsigned int tcb_pool_count;     /* The number of blocks in tcb_pool */
+static Spinlock tcb_pool_spinlock = SPINLOCK_INIT;
+
+/* Get a thread block from the cache of the current core, or NULL */
+static TCB* tcb_cache_get()
+{
+	TCB* tcb = NULL;
+	int preempt = preempt_off;
+	CCB* core = &CURCORE;
+
+	/* Refill half the cache from the pool */
+	if (core->tcb_cache_count == 0 && tcb_pool_count > 0) {
+		spin_lock(&tcb_pool_spinlock);
+		while (tcb_pool_count > 0 && core->tcb_cache_count < TCB_CACHE_SIZE/2) {
+			rlist_push_back(&core->tcb_cache, rlist_pop_front(&tcb_pool));
+			tcb_pool_count--;
+			core->tcb_cache_count++;
+		}
+		spin_unlock(&tcb_pool_spinlock);
+	}
+
+	/* The most recently freed block is probably in the cpu cache */
+	if (core->tcb_cache_count > 0) {
+		tcb = rlist_pop_back(&core->tcb_cache)->tcb;
+		core->tcb_cache_count--;
+		__atomic_store_n(&core->tcb_reuses, core->tcb_reuses+1, __ATOMIC_RELAXED);
+	}
+
+	if (preempt)
+		preempt_on;
+	return tcb;
+}
+
+/* Return a thread block to the cache of the current core */
+static void tcb_cache_put(TCB* tcb)
+{
+	if (tcb->stack_size != THREAD_STACK_SIZE) {
+		free_tcb(tcb);
+		return;
+	}
+
+	rlnode trimmed;
+	rlnode_init(&trimmed, NULL);
+
+	int preempt = preempt_off;
+	CCB* core = &CURCORE;
+
+	/* Move half the cache to the pool, and trim the pool */
+	if (core->tcb_cache_count == TCB_CACHE_SIZE) {
+		spin_lock(&tcb_pool_spinlock);
+		while (core->tcb_cache_count > TCB_CACHE_SIZE/2) {
+			rlist_push_back(&tcb_pool, rlist_pop_front(&core->tcb_cache));
+			core->tcb_cache_count--;
+			tcb_pool_count++;
+		}
+		while (tcb_pool_count > TCB_POOL_SIZE) {
+			rlist_push_back(&trimmed, rlist_pop_front(&tcb_pool));
+			tcb_pool_count--;
+		}
+		spin_unlock(&tcb_pool_spinlock);
+	}
+
+	rlnode_init(&tcb->sched_node, tcb);
+	rlist_push_back(&core->tcb_cache, &tcb->sched_node);
+	core->tcb_cache_count++;
+
+	if (preempt)
+		preempt_on;
+
+	while (!is_rlist_empty(&trimmed))
+		free_tcb(rlist_pop_front(&trimmed)->tcb);
+}
+
+/* Free the blocks in the cache of the current core and in the pool */
+static void tcb_cache_drain()
+{
+	CCB* core = &CURCORE;
+	while (!is_rlist_empty(&core->tcb_cache))
+		free_tcb(rlist_pop_front(&core->tcb_cache)->tcb);
+	core->tcb_cache_count = 0;
+
+	int preempt = preempt_off;
+	spin_lock(&tcb_pool_spinlock);
+	while (!is_rlist_empty(&tcb_pool))
+		free_tcb(rlist_pop_front(&tcb_pool)->tcb);
+	tcb_pool_count = 0;
+	spin_unlock(&tcb_pool_spinlock);
+	if (preempt)
+		preempt_on;
+}
+
 /*
   This is the function that is used to start normal threads.
 */
@@ -116,10 +310,16 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	/* The stack size must be a multiple of page size */
+	if (stack_size == 0)
+		stack_size = THREAD_STACK_SIZE;
+	stack_size = ((stack_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+
+	TCB* tcb = (stack_size == THREAD_STACK_SIZE) ? tcb_cache_get() : NULL;
+	if (tcb == NULL)
+		tcb = allocate_tcb(stack_size);
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -130,46 +330,72 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->phase = CTX_CLEAN;
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
+	tcb->wchan = NULL;
+	tcb->trace_id = 0;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
-	tcb->its = QUANTUM;
-	tcb->rts = QUANTUM;
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
-	tcb->priority=PRIORITY_QUEUES/2;
+	tcb->priority=sched_levels/2;
+	tcb->its = sched_quantum[tcb->priority];
+	tcb->rts = tcb->its;
+	tcb->last_core = cpu_core_id;
+	tcb->migrations = 0;
+	tcb->run_time = 0;
+	tcb->wait_time = 0;
+	tcb->ready_time = 0;
+	tcb->voluntary_switches = 0;
+	tcb->involuntary_switches = 0;
+	tcb->affinity = sched_all_cores;
+	tcb->sched_core = -1;
+	tcb->boost_epoch = 0;
+	tcb->nice = 0;
+	tcb->vruntime = 0;
+	tcb->fair_core = cpu_core_id;
+	rbnode_init(&tcb->fair_node, tcb);
+	tcb->rt_runtime = 0;
+	tcb->rt_period = 0;
+	tcb->rt_misses = 0;
+	rbnode_init(&tcb->rt_node, tcb);
+	tcb->state_spinlock = MUTEX_INIT;
 
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = ((void*)tcb) + THREAD_TCB_SIZE + THREAD_GUARD_SIZE;
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
 #endif
 
 	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+	__atomic_add_fetch(&active_threads, 1, __ATOMIC_RELAXED);
 
 	return tcb;
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called from gain(), for the previous thread of the core,
+  after its state_spinlock has been released.
  */
+static void edf_release(TCB* tcb); /* forward */
+
 void release_TCB(TCB* tcb)
 {
+	edf_release(tcb);
+
 #ifndef NVALGRIND
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	tcb_cache_put(tcb);
 	
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
+	int last = (__atomic_sub_fetch(&active_threads, 1, __ATOMIC_RELAXED) == 0);
+
+	/* Halted idle cores must notice that the scheduler is done */
+	if (last)
+		cpu_core_restart_all();
 }
 
 /*
@@ -187,220 +413,1707 @@ CCB cctx[MAX_CORES];
 
 /*
   Since the scheduler is based on MLFQ , it is consisted of many queues.
-  Each queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED[i].
+  Each core keeps its own set of queues, in CCB::sched_queue[i], each
+  implemented as a doubly linked list. The queues of a core are protected
+  by the core's @c queue_spinlock. A core selects the next thread from its
+  own queues and, only when these are empty, steals from the tail of
+  another core's queues. Every BOOST_PERIOD usec, the queued threads of 
+  a core are boosted to the next higher level, by rotating the queues.
+
+  The state of each thread (@c state, @c phase, @c wakeup_time and the
+  use of @c sched_node) is protected by the thread's own @c state_spinlock.
+
+  Also, the sleeping threads with a timeout are kept in a hierarchical
+  timer wheel, protected by @c timeout_spinlock. A lower bound of the 
+  earliest wakeup time in the wheel is kept in @c next_timeout,
+  so that cores can check for expired timeouts without locking.
+
+  The lock ordering is 
+     state_spinlock  ->  timeout_spinlock  ->  queue_spinlock.
+  Timeout expiry needs to lock a thread while holding timeout_spinlock,
+  therefore it only tries to lock it, and leaves busy threads for a 
+  later pass.
+*/
+unsigned int sched_levels = PRIORITY_QUEUES; /* The number of MLFQ levels */
+TimerDuration sched_quantum[MAX_SCHED_LEVELS]; /* The time-slice of each level */
+
+/*
+  The timer wheel.
+
+  Time is divided into ticks of TIMER_TICK usec. The wheel has 
+  TIMER_LEVELS levels of TIMER_SLOTS slots each; a slot of level L
+  spans TIMER_SLOTS^L ticks. A thread whose wakeup tick is @c e is
+  kept at the lowest level L where it fits, in slot (e >> L*TIMER_BITS) % TIMER_SLOTS.
+  When the wheel clock crosses the boundary of a slot of level L>0, the 
+  threads of this slot are cascaded (re-inserted) into lower levels. 
+  Threads with a wakeup time beyond the span of the wheel are kept in 
+  the top level, and are re-inserted at each cascade until they fit.
+
+  Threads whose wakeup tick has passed are moved to TIMEOUT_EXPIRED,
+  from where they are made ready. 
+
+  Insertion and removal are O(1), since a thread is removed from its slot 
+  by rlist_remove(). Each level keeps a bitmap of the non-empty slots, which 
+  allows expiry to skip empty slots quickly. Bits are cleared lazily, when
+  an empty slot is visited.
+*/
+#define TIMER_TICK 1000ul          /* usec per tick */
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 4
+#define TIMER_SPAN (1ull << (TIMER_BITS*TIMER_LEVELS))  /* ticks covered by the wheel */
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+static rlnode TIMER_WHEEL[TIMER_LEVELS][TIMER_SLOTS]; /* The wheel slots */
+static uint64_t timer_bitmap[TIMER_LEVELS];   /* Bit i is set if slot i may be non-empty */
+static TimerDuration timer_tick;        /* The last tick processed by the wheel */
+static rlnode TIMEOUT_EXPIRED;          /* Threads whose timeout has expired */
 
-  Both of these structures are protected by @c sched_spinlock.
+Spinlock timeout_spinlock = SPINLOCK_INIT; /* spinlock for the timer wheel */
+TimerDuration next_timeout = NO_TIMEOUT; /* A lower bound of the earliest wakeup time in the wheel */
 
+/*
+  The idle cores.
+
+  Bit i of @c sched_idle_cores is set while core i has nothing to run and
+  is halted (or about to halt). A core that queues a thread restarts an 
+  idle core only if this bitmap is non-zero; thus, in the common case where
+  no core is idle, a wakeup costs a single load, and does not touch the 
+  global halt mutex of the BIOS.
+
+  An idle core sets its bit before it looks for work for the last time, and 
+  a waker reads the bitmap after it has queued its thread, with a full fence
+  in between on both sides. Thus, either the idle core finds the thread, or
+  the waker finds the bit set, and no wakeup is lost. The same holds for a 
+  lower @c next_timeout.
+*/
+static uint64_t sched_idle_cores;
+
+/* The state of gang scheduling (see gang_pick_next) */
+static Spinlock gang_spinlock = SPINLOCK_INIT;  /* Protects the gang queues and the slot of the active gang */
+static rlnode gang_list;           /* The processes with ready gang threads, in round-robin order */
+static PCB* gang_active;           /* The process of the current gang slot, or NULL */
+static TimerDuration gang_end;     /* When the current gang slot ends */
+static TimerDuration gang_next;    /* When the next gang slot is due */
+static unsigned int gang_ready;    /* The number of ready gang threads */
+static unsigned int gang_restricted;  /* The number of ready gang threads that may not run on all cores */
+
+static void sched_wakeup_expired_timeouts(); /* forward */
+static int gang_preempts(CCB* core, TimerDuration now); /* forward */
+static void sched_release_handoff(CCB* core); /* forward */
+static inline int is_realtime(TCB* tcb); /* forward */
+static void edf_timer_add(TCB* tcb); /* forward */
+static void edf_timer_remove(TCB* tcb); /* forward */
+
+/* 
+  The time the timer of a core must fire at, for a time-slice that ends at 
+  @c deadline. This is the earliest timeout of the real-time threads of the
+  core (see edf_timer_add), if it is earlier, so that they are woken up, and
+  their budget is refilled, on time. Similarly, while gang threads wait for 
+  their slot, this is the time the next gang slot is due.
 */
-int yield_counter=0;/*The number of yields that have been called since the last boost*/
-rlnode SCHED[PRIORITY_QUEUES]; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+static TimerDuration sched_alarm_time(CCB* core, TimerDuration deadline, TimerDuration now)
+{
+	TimerDuration t = __atomic_load_n(&core->rt_timer, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&gang_ready, __ATOMIC_RELAXED) > 0 
+		&& __atomic_load_n(&gang_active, __ATOMIC_RELAXED) == NULL) {
+		TimerDuration g = __atomic_load_n(&gang_next, __ATOMIC_RELAXED);
+		if (g < t)
+			t = g;
+	}
+	if (t < now + TIMER_TICK)
+		t = now + TIMER_TICK;
+	return (t < deadline) ? t : deadline;
+}
 
 /* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+void yield_handler() 
+{ 
+	CCB* core = &CURCORE;
+	core->timer_deadline = NO_TIMEOUT;
+
+	/* 
+	  A stale alarm, raised before the timer was reprogrammed, or an alarm 
+	  for the timeout of a real-time thread, must not end the current 
+	  time-slice. Expire the timeouts (a woken thread preempts this core by
+	  an ICI) and re-arm the timer. An alarm for a gang slot that is due 
+	  preempts the current thread.
+	 */
+	TimerDuration now = bios_clock();
+	if (core->slice_deadline != NO_TIMEOUT && now + QUANTUM_SLACK < core->slice_deadline) {
+		sched_release_handoff(core);
+		if (gang_preempts(core, now)) {
+			yield(SCHED_PREEMPT);
+			return;
+		}
+		int preempt = 0;
+		if (__atomic_load_n(&core->rt_timer, __ATOMIC_RELAXED) <= now) {
+			preempt = preempt_off;
+			sched_wakeup_expired_timeouts();
+		}
+		core->timer_deadline = sched_alarm_time(core, core->slice_deadline, now);
+		bios_set_timer(core->timer_deadline - now);
+		if (preempt)
+			preempt_on;
+		return;
+	}
+
+	yield(SCHED_QUANTUM); 
+}
 
-/* Interrupt handle for inter-core interrupts */
+/*
+*Return the highest level whose queue is not empty, from the bitmap of the core.
+*The bitmap must not be 0.
+*/
+static inline int sched_top_level(uint64_t bitmap)
+{
+	return 63 - __builtin_clzll(bitmap);
+}
+
+/* 
+  Interrupt handler for inter-core interrupts. 
+  An ICI is sent when a thread of higher priority than the running thread
+  is added to the queues of this core, or when a gang slot starts. It is 
+  also sent when a real-time thread of this core enters the timer wheel at 
+  another core, with a timeout earlier than the core timer.
+*/
 void ici_handler()
-{ /* noop for now... */
+{
+	CCB* core = &CURCORE;
+	uint64_t bitmap = __atomic_load_n(&core->sched_bitmap, __ATOMIC_RELAXED);
+
+	/* Re-arm the timer, unless it is due (its alarm may be pending) */
+	TimerDuration now = bios_clock();
+	if (core->slice_deadline != NO_TIMEOUT && now < core->slice_deadline && now < core->timer_deadline
+		&& __atomic_load_n(&core->rt_timer, __ATOMIC_RELAXED) < core->timer_deadline) {
+		core->timer_deadline = sched_alarm_time(core, core->slice_deadline, now);
+		bios_set_timer(core->timer_deadline - now);
+	}
+
+	/* The thread may have been stolen, or the core may have switched already */
+	if ((bitmap && sched_top_level(bitmap) > core->current_priority)
+		|| __atomic_load_n(&core->rt_next, __ATOMIC_RELAXED) < core->rt_running
+		|| gang_preempts(core, now))
+		yield(SCHED_PREEMPT);
 }
 
 
 
 /*
-*This functions checks whether it's the right time to boost or not.
-*When the number of yields called matches the BOOST_PERIOD then we need to boost the scheduler queues.
-*Returns 1 if it is the right time, 0 if not.
+  Scheduling classes.
+
+  The scheduling policy is implemented by a scheduling class, selected at
+  boot time by sched_params::policy. The rest of the scheduler takes care of 
+  the thread states, the timeouts, the locking, the restart of idle cores 
+  and the preemption of cores. The class decides the order in which the 
+  ready threads of a core are run, and how the priorities of threads change.
+
+  The class keeps the ready threads of a core in CCB::sched_queue, and keeps
+  CCB::sched_bitmap up to date: bit i is set iff the core has a ready thread 
+  at priority level i. The bitmap is read by other cores, to decide on 
+  preemption. The @c enqueue and @c dequeue methods are called with the 
+  core's @c queue_spinlock held, and CCB::sched_count is maintained by the 
+  caller (see sched_count_update). The methods that may be NULL are marked 
+  as optional.
+
+  A core takes from the queues of another core only threads that may run 
+  on it (see sched_allowed). Scanning for such a thread is bounded by 
+  SCHED_STEAL_SCAN; threads are placed on allowed cores when queued, so this 
+  is only needed for stealing.
+*/
+typedef struct sched_class {
+	const char* name;   /* The name of the policy */
+	unsigned int levels;   /* The number of priority levels used, or 0 for sched_params::levels */
+
+	/* Initialize the scheduling data of a core, at boot (optional) */
+	void (*init)(CCB* core);
+
+	/* Add a ready thread to the queues of a core */
+	void (*enqueue)(CCB* core, TCB* tcb);
+
+	/* 
+	  Remove and return the next thread to run from the (non-empty) queues 
+	  of a core. If @c steal is set, another core is stealing from this core, 
+	  and the thread that is least likely to be in the core's cache is returned.
+	  When the current core is not @c core, only a thread allowed on the current
+	  core is returned, or NULL if none is found.
+	 */
+	TCB* (*dequeue)(CCB* core, int steal);
+
+	/* Remove a given thread from the queues of a core */
+	void (*remove)(CCB* core, TCB* tcb);
+
+	/* 
+	  Return the next thread to run at the current core, or NULL if the current
+	  thread (when READY) or the idle thread should run.
+	 */
+	TCB* (*pick_next)(CCB* core, TCB* current);
+
+	/* Called at each call to yield(), with the current time (optional) */
+	void (*on_tick)(CCB* core, TimerDuration now);
+
+	/* 
+	  Adjust the scheduling data of a thread that is yielding at time @c now, 
+	  after its cause is set (optional). The time-slice started at CCB::slice_start.
+	 */
+	void (*on_yield)(CCB* core, TCB* tcb, TimerDuration now);
+
+	/* 
+	  Adjust the scheduling data of a thread whose nice value changed, or of a 
+	  new thread (in state INIT) that was given its nice value (optional). It 
+	  is called with the thread's @c state_spinlock held. A queued thread is
+	  taken out of its queue for the call, and queued again after it.
+	 */
+	void (*on_nice)(TCB* tcb);
+} sched_class;
+
+static const sched_class* sched_policy_class;   /* The class of the policy in use */
+
+#define SCHED_STEAL_SCAN 8   /* The threads examined when taking a thread for another core */
+
+/* Return 1 if the thread may run on the given core */
+static inline int sched_allowed(TCB* tcb, int core_id)
+{
+	return (tcb->affinity >> core_id) & 1;
+}
+
+/*
+  Account for @c delta (+1 or -1) threads queued at a core. A thread that 
+  leaves the queues stops being the hand-off thread of the core.
+
+  *** MUST BE CALLED WITH core->queue_spinlock HELD ***
+*/
+static inline void sched_count_update(CCB* core, TCB* tcb, int delta)
+{
+	if (delta > 0)
+		tcb->sched_restricted = (tcb->affinity != sched_all_cores);
+	else if (core->handoff == tcb)
+		core->handoff = NULL;
+	tcb->sched_core = (delta > 0) ? (int)core->id : -1;
+	core->sched_count += delta;
+	if (tcb->sched_restricted)
+		core->sched_restricted += delta;
+}
+
+/*
+  Return the first node of a (non-empty) queue of a core, from the head or,
+  if @c steal is set, from the tail, whose thread may run on the current core.
+  At most SCHED_STEAL_SCAN nodes are examined. Return NULL if none is found.
+*/
+static rlnode* sched_list_select(CCB* core, rlnode* queue, int steal)
+{
+	rlnode* sel = steal ? queue->prev : queue->next;
+	if (core->id == cpu_core_id)
+		return sel;
+	for (int i = 0; i < SCHED_STEAL_SCAN && sel != queue; i++, sel = steal ? sel->prev : sel->next)
+		if (sched_allowed(sel->tcb, cpu_core_id))
+			return sel;
+	return NULL;
+}
+
+
+/*
+*This function is used to get the next tcb to run from the queues of a core.
+*The head of the queue is taken for the core's own queues, and the tail when stealing 
+*from another core.
+*If all the queues are empty it returns NULL.
+*/
+static TCB* sched_queue_pop(CCB* core, int steal)
+{
+	TCB* tcb = NULL;
+
+	spin_lock(&core->queue_spinlock);
+	if(core->sched_count > 0) {
+		tcb = sched_policy_class->dequeue(core, steal);
+		if(tcb != NULL)
+			sched_count_update(core, tcb, -1);
+	}
+	spin_unlock(&core->queue_spinlock);
+
+	return tcb;
+}
+
+/*
+*This function is used when the queues of a core are empty.
+*It picks as victim the core with the most ready threads (the counts are read 
+*without locking, as a hint) and steals a thread from it. If the victim has no
+*thread allowed on this core, the other cores are tried in turn.
+*Returns NULL if there is nothing to steal.
+*/
+static TCB* sched_queue_steal(CCB* core)
+{
+	uint ncores = cpu_cores();
+	CCB* victim = NULL;
+	unsigned int victim_count = 0;
+
+	for(uint i=1; i<ncores; i++) {
+		CCB* c = &cctx[(core->id + i) % ncores];
+		unsigned int count = __atomic_load_n(&c->sched_count, __ATOMIC_RELAXED);
+		if(count > victim_count) {
+			victim = c;
+			victim_count = count;
+		}
+	}
+	if(victim == NULL)
+		return NULL;
+
+	TCB* tcb = sched_queue_pop(victim, 1);
+	for(uint i=1; tcb == NULL && i<ncores; i++) {
+		CCB* c = &cctx[(core->id + i) % ncores];
+		if(c != victim && __atomic_load_n(&c->sched_count, __ATOMIC_RELAXED) > 0)
+			tcb = sched_queue_pop(c, 1);
+	}
+	return tcb;
+}
+
+/*
+*This function is used when a core reschedules, while a thread of higher priority 
+*than any thread in its own queues waits at another core (e.g., because it was 
+*sent there by a wakeup, and the ICI has not been served yet).
+*It pulls the thread from the core with the highest priority ready thread, if this
+*priority is higher than @c level. The bitmaps are read without locking, as a hint.
+*Returns NULL if there is nothing to pull.
+*/
+static TCB* sched_queue_pull(CCB* core, int level)
+{
+	uint ncores = cpu_cores();
+	CCB* victim = NULL;
+
+	for(uint i=1; i<ncores; i++) {
+		CCB* c = &cctx[(core->id + i) % ncores];
+		uint64_t bitmap = __atomic_load_n(&c->sched_bitmap, __ATOMIC_RELAXED);
+		if(bitmap && sched_top_level(bitmap) > level) {
+			victim = c;
+			level = sched_top_level(bitmap);
+		}
+	}
+
+	return (victim == NULL) ? NULL : sched_queue_pop(victim, 0);
+}
+
+/* The tick at which a wakeup time expires (rounded up) */
+static inline TimerDuration timer_expiry_tick(TimerDuration wakeup_time)
+{
+	return wakeup_time/TIMER_TICK + (wakeup_time % TIMER_TICK != 0);
+}
+
+/*
+  Insert TCB into the timer wheel. All ticks up to @c timer_tick have 
+  been processed. If the wakeup tick of the TCB has already been 
+  processed, the TCB is added to TIMEOUT_EXPIRED.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timer_wheel_insert(TCB* tcb)
+{
+	TimerDuration e = timer_expiry_tick(tcb->wakeup_time);
+	TimerDuration base = timer_tick + 1;
+
+	if (e < base) {
+		rlist_push_back(&TIMEOUT_EXPIRED, &tcb->sched_node);
+		return;
+	}
+
+	/* Far timeouts are placed at the end of the wheel span */
+	if (e - base >= TIMER_SPAN)
+		e = base + TIMER_SPAN - 1;
+
+	/* Find the lowest level that fits */
+	int level = 0;
+	while ((e - base) >> ((level + 1) * TIMER_BITS))
+		level++;
+
+	int slot = (e >> (level * TIMER_BITS)) & TIMER_MASK;
+	rlist_push_back(&TIMER_WHEEL[level][slot], &tcb->sched_node);
+	timer_bitmap[level] |= 1ull << slot;
+}
+
+/*
+  Re-insert the threads of the slot of the given level that starts at 
+  tick @c t into lower levels. The slots of the lower levels that start
+  at @c t must have been cascaded already.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timer_wheel_cascade(int level, TimerDuration t)
+{
+	int slot = (t >> (level * TIMER_BITS)) & TIMER_MASK;
+	rlnode* list = &TIMER_WHEEL[level][slot];
+
+	timer_bitmap[level] &= ~(1ull << slot);
+	while (!is_rlist_empty(list))
+		timer_wheel_insert(rlist_pop_front(list)->tcb);
+}
+
+/*
+  Advance the wheel up to tick @c now, moving the expired threads 
+  to TIMEOUT_EXPIRED.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timer_wheel_advance(TimerDuration now)
+{
+	while (timer_tick < now) {
+		/* Nothing in the wheel: jump to now */
+		int empty = 1;
+		for (int l = 0; l < TIMER_LEVELS; l++)
+			if (timer_bitmap[l]) { empty = 0; break; }
+		if (empty) {
+			timer_tick = now;
+			break;
+		}
+
+		TimerDuration t = timer_tick + 1;
+
+		/* Cascade at slot boundaries, lower levels first */
+		for (int l = 1; l < TIMER_LEVELS && (t & ((1ull << (l * TIMER_BITS)) - 1)) == 0; l++)
+			timer_wheel_cascade(l, t);
+
+		/* Find the next non-empty slot of level 0, up to the next boundary */
+		uint64_t pending = timer_bitmap[0] >> (t & TIMER_MASK);
+		TimerDuration boundary = (t | TIMER_MASK) + 1;
+		TimerDuration next = pending ? t + __builtin_ctzll(pending) : boundary;
+
+		if (next > now) {
+			timer_tick = now;
+			break;
+		}
+		if (next == boundary) {
+			timer_tick = boundary - 1;
+			continue;
+		}
+
+		/* Expire slot 'next' */
+		int slot = next & TIMER_MASK;
+		rlist_append(&TIMEOUT_EXPIRED, &TIMER_WHEEL[0][slot]);
+		timer_bitmap[0] &= ~(1ull << slot);
+		timer_tick = next;
+	}
+}
+
+/*
+  Update next_timeout to a lower bound of the earliest wakeup time.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void sched_update_next_timeout()
+{
+	TimerDuration t = NO_TIMEOUT;
+
+	if (!is_rlist_empty(&TIMEOUT_EXPIRED)) {
+		/* Retry as soon as possible */
+		t = timer_tick * TIMER_TICK;
+	}
+	else {
+		/* 
+		  For each level, find the next non-empty slot in circular order,
+		  and take the earliest tick at which such a slot is expired or cascaded. 
+		*/
+		for (int l = 0; l < TIMER_LEVELS; l++) {
+			if (timer_bitmap[l] == 0) continue;
+			TimerDuration cur = timer_tick >> (l * TIMER_BITS);
+			int from = (cur + 1) & TIMER_MASK;
+			uint64_t rot = (timer_bitmap[l] >> from) | (from ? timer_bitmap[l] << (TIMER_SLOTS - from) : 0);
+			TimerDuration tick = (cur + 1 + __builtin_ctzll(rot)) << (l * TIMER_BITS);
+			if (tick * TIMER_TICK < t)
+				t = tick * TIMER_TICK;
+		}
+	}
+
+	__atomic_store_n(&next_timeout, t, __ATOMIC_RELAXED);
+}
+
+/*
+  Restart an idle core, if there is one. Core @c hint is preferred, if it 
+  is idle. The bit of the core is cleared by the waker, so that concurrent 
+  wakers restart different cores.
+*/
+static void sched_wake_idle_core(int hint)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint64_t idle = __atomic_load_n(&sched_idle_cores, __ATOMIC_RELAXED);
+
+	while (idle) {
+		int c = (hint >= 0 && (idle & (1ull << hint))) ? hint : __builtin_ctzll(idle);
+		uint64_t bit = 1ull << c;
+		if (__atomic_fetch_and(&sched_idle_cores, ~bit, __ATOMIC_RELAXED) & bit) {
+			cpu_core_restart(c);
+			return;
+		}
+		idle = __atomic_load_n(&sched_idle_cores, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+  Possibly add TCB to the scheduler timer wheel.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+{
+	if (timeout != NO_TIMEOUT) {
+		/* set the wakeup time */
+		TimerDuration curtime = bios_clock();
+		tcb->wakeup_time = curtime + timeout;
+
+		spin_lock(&timeout_spinlock);
+
+		timer_wheel_insert(tcb);
+		if (is_realtime(tcb))
+			edf_timer_add(tcb);
+
+		/* Lower next_timeout, if needed */
+		TimerDuration t = timer_expiry_tick(tcb->wakeup_time) * TIMER_TICK;
+		int earlier = (t < next_timeout);
+		if (earlier)
+			__atomic_store_n(&next_timeout, t, __ATOMIC_RELAXED);
+
+		spin_unlock(&timeout_spinlock);
+
+		/* Idle cores may be halted until a later time; restart one to take notice */
+		if (earlier)
+			sched_wake_idle_core(is_realtime(tcb) ? tcb->rt_core : -1);
+	}
+}
+
+/*
+  Remove TCB from the scheduler timer wheel. This takes O(1) time. 
+  The bit of its slot in the level bitmap is left for a later cleanup,
+  and @c next_timeout remains a valid lower bound.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock AND timeout_spinlock HELD ***
+*/
+static void sched_cancel_timeout(TCB* tcb)
+{
+	/* tcb is in the timer wheel, fix it (a READY thread is a throttled real-time thread) */
+	assert(tcb->sched_node.next != &(tcb->sched_node) && (tcb->state == STOPPED || tcb->state == READY));
+	rlist_remove(&tcb->sched_node);
+	if (is_realtime(tcb))
+		edf_timer_remove(tcb);
+	tcb->wakeup_time = NO_TIMEOUT;
+}
+
+/*
+  Add TCB to the scheduler queues of the given core. If @c handoff is set,
+  the thread becomes the hand-off thread of the current core; see 
+  sched_handoff().
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_queue_add(CCB* core, TCB* tcb, int handoff)
+{
+	spin_lock(&core->queue_spinlock);
+	sched_policy_class->enqueue(core, tcb);
+	sched_count_update(core, tcb, 1);
+	if (handoff)
+		core->handoff = tcb;
+	spin_unlock(&core->queue_spinlock);
+
+	/* Restart an idle core, preferably the one we queued at */
+	if (!handoff)
+		sched_wake_idle_core(core->id);
+}
+
+/*
+  Hand-off wakeups.
+
+  A thread woken by wakeup_handoff() that does not preempt some core is 
+  queued at the current core, as its hand-off thread, and no idle core is
+  restarted for it. When the current thread blocks, the hand-off thread 
+  runs next (see sched_take_handoff), without the cost of restarting an 
+  idle core and migrating the thread to it. If the current thread does not
+  block within HANDOFF_DELAY usec, or it yields without blocking, the 
+  hand-off is over, and an idle core is restarted to run the thread. A core
+  that becomes idle in the meantime finds the thread in the queues of this 
+  core, as it finds any other queued thread.
+*/
+#define HANDOFF_DELAY TIMER_TICK   /* How long a hand-off thread waits for the current thread to block */
+
+/*
+  Queue a ready thread at the current core as its hand-off thread, and set 
+  the core timer to end the hand-off.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_handoff(TCB* tcb)
+{
+	CCB* core = &CURCORE;
+	sched_queue_add(core, tcb, 1);
+
+	/* Without an idle core to run the thread, there is nothing to do at the end of the hand-off */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if ((__atomic_load_n(&sched_idle_cores, __ATOMIC_RELAXED) & tcb->affinity) == 0)
+		return;
+
+	TimerDuration now = bios_clock();
+	if (core->timer_deadline == NO_TIMEOUT || core->timer_deadline > now + HANDOFF_DELAY) {
+		core->timer_deadline = now + HANDOFF_DELAY;
+		bios_set_timer(HANDOFF_DELAY);
+	}
+}
+
+/* End the hand-off of a core, if any, and restart an idle core to run the thread */
+static void sched_release_handoff(CCB* core)
+{
+	if (__atomic_load_n(&core->handoff, __ATOMIC_RELAXED) == NULL)
+		return;
+
+	int preempt = preempt_off;
+	spin_lock(&core->queue_spinlock);
+	int released = (core->handoff != NULL);
+	core->handoff = NULL;
+	spin_unlock(&core->queue_spinlock);
+	if (preempt)
+		preempt_on;
+
+	if (released)
+		sched_wake_idle_core(-1);
+}
+
+/*
+	Return the core running the thread of the lowest priority, among the
+	cores of @c mask, if this priority is lower than @c priority, else 
+	return NULL. On ties, the current core is preferred, since it needs no 
+	ICI to be preempted. If some core of @c mask is idle, NULL is returned 
+	as well; the thread is then queued for an idle core to run it.
+
+	The priorities published by the cores are read without locking; a 
+	wrong guess only costs a useless ICI, or a late preemption.
+ */
+static CCB* sched_preempt_target(int priority, uint64_t mask)
+{
+	uint ncores = cpu_cores();
+	CCB* target = NULL;
+	int lowest = priority;
+
+	for (uint i = 0; i < ncores; i++) {
+		CCB* c = &cctx[(cpu_core_id + i) % ncores];
+		if (!(mask & (1ull << c->id)))
+			continue;
+		int p = __atomic_load_n(&c->current_priority, __ATOMIC_RELAXED);
+		if (p < 0)
+			return NULL;
+		if (p < lowest) {
+			lowest = p;
+			target = c;
+		}
+	}
+	return target;
+}
+
+/*
+  Real-time threads.
+
+  Threads with real-time parameters (see SetRealtime) are scheduled ahead of
+  the scheduling class of the policy: each core runs its ready real-time 
+  threads, by earliest deadline first (EDF), before any other thread. A core 
+  that runs a real-time thread publishes the priority EDF_PRIORITY, which is
+  above all levels of the classes and of gang threads, and the deadline of the thread in 
+  CCB::rt_running.
+
+  A real-time thread may use @c rt_runtime usec of cpu time in each period. 
+  A period starts when the thread is ready after the end of its previous 
+  period, at @c rt_release, or when it wakes up too late to use the rest of
+  its budget by its deadline, and its absolute deadline is @c rt_reldeadline 
+  usec after its start. A thread that has used its budget is throttled: it 
+  is kept in the timer wheel (in state READY) until @c rt_release, and then
+  it starts a new period. A time-slice may end after the budget is used up,
+  e.g., when the host does not run the core at the time; the overrun is paid
+  from the budget of the next period, up to a whole budget.
+
+  The real-time threads of a core that are in the timer wheel, sleeping or
+  throttled, are also kept in CCB::rt_timers, by the time their timeout 
+  expires. The timer of the core fires at the earliest of these times, and
+  the core expires the timeouts of the wheel. Thus, a real-time thread is 
+  woken up, and its budget is refilled, on time and by its own core, while
+  the timers of the other cores are not affected.
+
+  Scheduling is partitioned: each real-time thread is assigned to one core,
+  and only this core runs it; it is never stolen. A thread is assigned to 
+  the core with the least real-time load among the cores of its affinity 
+  mask, and it is admitted only if the 
+  total density (runtime over deadline) of the real-time threads of the 
+  core stays within EDF_MAX_UTIL. Thus, EDF meets all their deadlines, and 
+  the rest of the core is left to the other threads.
+*/
+#define EDF_MAX_UTIL 950000ul            /* The real-time density allowed per core, in millionths */
+#define EDF_PRIORITY (MAX_SCHED_LEVELS+1)  /* The priority published while running a real-time thread */
+
+static Spinlock edf_admission_lock = SPINLOCK_INIT;   /* Protects CCB::rt_util */
+
+static inline int is_realtime(TCB* tcb)
+{
+	return tcb->rt_period != 0;
+}
+
+/* Start a new period of a real-time thread, at time @c start, paying for any overrun from its budget */
+static void edf_new_period(TCB* tcb, TimerDuration start)
+{
+	tcb->rt_release = start + tcb->rt_period;
+	tcb->rt_deadline = start + tcb->rt_reldeadline;
+	tcb->rt_budget = tcb->rt_runtime - tcb->rt_overrun;
+	tcb->rt_overrun = 0;
+	tcb->rt_missed = 0;
+}
+
+/*
+  Start a new period for a real-time thread that wakes up at time @c now, if
+  the rest of its budget cannot be used by its deadline at the density of the
+  thread (the wakeup rule of the constant bandwidth server). Else, a thread 
+  that wakes up shortly before the end of its period would run past its 
+  deadline.
+*/
+static void edf_on_wakeup(TCB* tcb, TimerDuration now)
+{
+	if (now >= tcb->rt_deadline
+		|| tcb->rt_budget * tcb->rt_reldeadline > (tcb->rt_deadline - now) * tcb->rt_runtime)
+		edf_new_period(tcb, now);
+}
+
+/* 
+  Publish the earliest deadline of the ready real-time threads of a core.
+
+  *** MUST BE CALLED WITH core->queue_spinlock HELD ***
+*/
+static inline void edf_update_next(CCB* core)
+{
+	rbnode* first = rbtree_first(&core->rt_tree);
+	__atomic_store_n(&core->rt_next, (first != NULL) ? first->key : NO_TIMEOUT, __ATOMIC_RELAXED);
+}
+
+/* 
+  Publish the earliest timeout of the real-time threads of a core.
+
+  *** MUST BE CALLED WITH core->queue_spinlock HELD ***
+*/
+static inline void edf_update_timer(CCB* core)
+{
+	rbnode* first = rbtree_first(&core->rt_timers);
+	__atomic_store_n(&core->rt_timer, (first != NULL) ? first->key : NO_TIMEOUT, __ATOMIC_RELAXED);
+}
+
+/*
+  Add a real-time thread that entered the timer wheel to the timers of its
+  core. If the core is not the current one, and its timer fires later, it is
+  sent an ICI to re-arm it; an idle core wakes up by @c next_timeout.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock AND timeout_spinlock HELD ***
+*/
+static void edf_timer_add(TCB* tcb)
+{
+	CCB* core = &cctx[tcb->rt_core];
+	TimerDuration t = timer_expiry_tick(tcb->wakeup_time) * TIMER_TICK;
+
+	spin_lock(&core->queue_spinlock);
+	tcb->rt_node.key = t;
+	rbtree_insert(&core->rt_timers, &tcb->rt_node);
+	edf_update_timer(core);
+	spin_unlock(&core->queue_spinlock);
+
+	TimerDuration alarm = __atomic_load_n(&core->timer_deadline, __ATOMIC_RELAXED);
+	if (core->id != cpu_core_id && alarm != NO_TIMEOUT && t < alarm)
+		cpu_ici(core->id);
+}
+
+/*
+  Remove a real-time thread that leaves the timer wheel from the timers of
+  its core.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock AND timeout_spinlock HELD ***
+*/
+static void edf_timer_remove(TCB* tcb)
+{
+	CCB* core = &cctx[tcb->rt_core];
+	spin_lock(&core->queue_spinlock);
+	rbtree_remove(&core->rt_timers, &tcb->rt_node);
+	edf_update_timer(core);
+	spin_unlock(&core->queue_spinlock);
+}
+
+/*
+  Add a ready real-time thread to the queue of its core, and preempt or 
+  restart the core if needed. If the thread has used its budget for the 
+  current period, throttle it instead. If @c timeout_locked is set, the
+  caller holds @c timeout_spinlock.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void edf_queue_add(TCB* tcb, int timeout_locked)
+{
+	TimerDuration now = bios_clock();
+	if (now >= tcb->rt_release)
+		edf_new_period(tcb, now);
+
+	if (tcb->rt_budget == 0) {
+		/* Throttle until the end of the period; the wheel cannot expire it before now */
+		if (!timeout_locked)
+			spin_lock(&timeout_spinlock);
+		tcb->wakeup_time = tcb->rt_release;
+		timer_wheel_insert(tcb);
+		edf_timer_add(tcb);
+		TimerDuration t = timer_expiry_tick(tcb->wakeup_time) * TIMER_TICK;
+		int earlier = (t < next_timeout);
+		if (earlier)
+			__atomic_store_n(&next_timeout, t, __ATOMIC_RELAXED);
+		if (!timeout_locked)
+			spin_unlock(&timeout_spinlock);
+		if (earlier)
+			sched_wake_idle_core(tcb->rt_core);
+		return;
+	}
+
+	CCB* core = &cctx[tcb->rt_core];
+	spin_lock(&core->queue_spinlock);
+	tcb->rt_node.key = tcb->rt_deadline;
+	rbtree_insert(&core->rt_tree, &tcb->rt_node);
+	edf_update_next(core);
+	spin_unlock(&core->queue_spinlock);
+
+	/* Restart the core if it is idle (as in sched_wake_idle_core), else preempt it if needed */
+	uint64_t bit = 1ull << core->id;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if ((__atomic_load_n(&sched_idle_cores, __ATOMIC_RELAXED) & bit)
+		&& (__atomic_fetch_and(&sched_idle_cores, ~bit, __ATOMIC_RELAXED) & bit))
+		cpu_core_restart(core->id);
+	else if (tcb->rt_deadline < __atomic_load_n(&core->rt_running, __ATOMIC_RELAXED))
+		cpu_ici(core->id);
+}
+
+/*
+  Return the ready real-time thread of the core with the earliest deadline,
+  removing it from the queue, or NULL if there is none. If @c rt_current is
+  set, the current thread is a real-time thread that can go on running, and 
+  it is returned, unless a thread of an earlier deadline is queued.
+*/
+static TCB* edf_pick_next(CCB* core, TCB* current, int rt_current)
+{
+	TCB* next_thread = NULL;
+
+	if (__atomic_load_n(&core->rt_next, __ATOMIC_RELAXED) != NO_TIMEOUT) {
+		spin_lock(&core->queue_spinlock);
+		rbnode* first = rbtree_first(&core->rt_tree);
+		if (first != NULL && !(rt_current && current->rt_deadline <= first->key)) {
+			next_thread = first->tcb;
+			rbtree_remove(&core->rt_tree, first);
+			edf_update_next(core);
+		}
+		spin_unlock(&core->queue_spinlock);
+	}
+
+	return (next_thread == NULL && rt_current) ? current : next_thread;
+}
+
+/*
+  Charge the time-slice that just ended, since the start of the current 
+  period, to the budget of a real-time thread, and count a deadline miss 
+  if the thread ran past its deadline. A thread that remains ready past 
+  the end of its period starts a new one.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void edf_on_yield(CCB* core, TCB* tcb, TimerDuration now)
+{
+	TimerDuration start = tcb->rt_release - tcb->rt_period;
+	TimerDuration from = (core->slice_start > start) ? core->slice_start : start;
+	TimerDuration used = (now > from) ? now - from : 0;
+	if (used > tcb->rt_budget) {
+		tcb->rt_overrun += used - tcb->rt_budget;
+		if (tcb->rt_overrun > tcb->rt_runtime)
+			tcb->rt_overrun = tcb->rt_runtime;
+		tcb->rt_budget = 0;
+	}
+	else
+		tcb->rt_budget -= used;
+
+	if (now > tcb->rt_deadline && !tcb->rt_missed) {
+		tcb->rt_misses++;
+		tcb->rt_missed = 1;
+	}
+
+	if (tcb->state == READY && now >= tcb->rt_release)
+		edf_new_period(tcb, now);
+}
+
+int sched_set_realtime(TimerDuration runtime, TimerDuration period, TimerDuration deadline)
+{
+	TCB* tcb = CURTHREAD;
+	unsigned long util = 0;
+
+	if (period != 0) {
+		if (deadline == 0)
+			deadline = period;
+		if (runtime == 0 || runtime > deadline || deadline > period)
+			return -1;
+		util = (runtime * 1000000ul + deadline - 1) / deadline;
+	}
+
+	int preempt = preempt_off;
+	spin_lock(&edf_admission_lock);
+
+	/* Give up the old reservation, then find the least loaded core that fits */
+	if (is_realtime(tcb)) {
+		cctx[tcb->rt_core].rt_util -= tcb->rt_util;
+	}
+	CCB* core = NULL;
+	if (period != 0) {
+		for (uint c = 0; c < cpu_cores(); c++)
+			if (sched_allowed(tcb, c) && cctx[c].rt_util + util <= EDF_MAX_UTIL 
+				&& (core == NULL || cctx[c].rt_util < core->rt_util))
+				core = &cctx[c];
+		if (core == NULL) {
+			/* Not admitted: keep the old parameters */
+			if (is_realtime(tcb))
+				cctx[tcb->rt_core].rt_util += tcb->rt_util;
+			spin_unlock(&edf_admission_lock);
+			if (preempt)
+				preempt_on;
+			return -1;
+		}
+		core->rt_util += util;
+	}
+
+	Mutex_Lock(&tcb->state_spinlock);
+	tcb->rt_runtime = runtime;
+	tcb->rt_period = period;
+	tcb->rt_reldeadline = deadline;
+	tcb->rt_util = util;
+	tcb->rt_misses = 0;
+	tcb->rt_overrun = 0;
+	if (core != NULL) {
+		tcb->rt_core = core->id;
+		edf_new_period(tcb, bios_clock());
+	}
+	Mutex_Unlock(&tcb->state_spinlock);
+
+	spin_unlock(&edf_admission_lock);
+	if (preempt)
+		preempt_on;
+
+	/* Move to the queue of the assigned core, or of the scheduling class */
+	yield(SCHED_USER);
+	return 0;
+}
+
+void sched_set_nice(TCB* tcb, int nice)
+{
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->state_spinlock);
+
+	/* 
+	  The class finds the queue of a thread by its priority, so a queued 
+	  thread leaves its queue while its priority changes. A thread that is 
+	  not queued cannot be queued while we hold its state_spinlock.
+	 */
+	int c = __atomic_load_n(&tcb->sched_core, __ATOMIC_RELAXED);
+	CCB* core = (c >= 0) ? &cctx[c] : NULL;
+	if (core != NULL) {
+		spin_lock(&core->queue_spinlock);
+		if (tcb->sched_core == c)
+			sched_policy_class->remove(core, tcb);
+		else {
+			spin_unlock(&core->queue_spinlock);
+			core = NULL;
+		}
+	}
+
+	tcb->nice = nice;
+	if (sched_policy_class->on_nice)
+		sched_policy_class->on_nice(tcb);
+
+	if (core != NULL) {
+		sched_policy_class->enqueue(core, tcb);
+		spin_unlock(&core->queue_spinlock);
+	}
+	Mutex_Unlock(&tcb->state_spinlock);
+	if (preempt)
+		preempt_on;
+}
+
+int sched_set_affinity(TCB* tcb, uint64_t mask)
+{
+	mask &= sched_all_cores;
+	if (mask == 0)
+		return -1;
+
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->state_spinlock);
+	int ret = is_realtime(tcb) ? -1 : 0;
+	if (ret == 0)
+		tcb->affinity = mask;
+	Mutex_Unlock(&tcb->state_spinlock);
+	if (preempt)
+		preempt_on;
+
+	/* Move to an allowed core */
+	if (ret == 0 && tcb == CURTHREAD && !sched_allowed(tcb, cpu_core_id))
+		yield(SCHED_USER);
+	return ret;
+}
+
+/* Give up the reservation of an exiting real-time thread */
+static void edf_release(TCB* tcb)
+{
+	if (is_realtime(tcb)) {
+		spin_lock(&edf_admission_lock);
+		cctx[tcb->rt_core].rt_util -= tcb->rt_util;
+		spin_unlock(&edf_admission_lock);
+	}
+}
+
+
+/*
+  Gang scheduling.
+
+  The threads of a process in gang mode (see SetGang) are scheduled ahead 
+  of the scheduling class of the policy, in gang slots: during the slot of 
+  a gang, each core that does not run a real-time thread runs a ready thread 
+  of the gang, if there is one, and a core running a gang thread publishes
+  the priority GANG_PRIORITY. Thus, the threads of the gang run together, and
+  a thread that waits at a barrier or a condition variable for another 
+  thread of the gang does not wait for the other thread to get a core.
+
+  The ready threads of a gang are kept in a queue of its PCB, and the gangs
+  with ready threads are kept in @c gang_list, in round-robin order. A slot 
+  starts at the first call to the scheduler on some core after the slot is 
+  due (the core timers fire at that time) and lasts GANG_SLOT usec. The 
+  core that starts the slot sends an ICI to the other cores, and a gang 
+  thread that becomes ready during the slot of its gang preempts a core by 
+  an ICI, as other threads do. All threads of the gang end their time-slice
+  at the end of the slot. The next slot is due GANG_GAP usec later, which 
+  is left to the other threads; however, a core with nothing else to run 
+  starts a slot at once.
+
+  Co-scheduling pays off only when the cores of the VM run in parallel on
+  the host. With fewer host cpus than cores, the threads of a slot still 
+  take turns on the host, and a thread that waits for another thread of its
+  gang may also wait for the gap between the slots; then, the waits of a 
+  gang are usually longer than under the policy.
+*/
+#define GANG_PRIORITY MAX_SCHED_LEVELS  /* The priority published while running a gang thread */
+#define GANG_SLOT QUANTUM               /* The length of a gang slot */
+#define GANG_GAP QUANTUM                /* The time between two gang slots, left to the other threads */
+
+static inline int is_gang(TCB* tcb)
+{
+	return tcb->owner_pcb->gang && !is_realtime(tcb);
+}
+
+void sched_set_gang(PCB* pcb, int gang)
+{
+	__atomic_store_n(&pcb->gang, gang, __ATOMIC_RELAXED);
+
+	/* Move to the queue of the gang, or of the scheduling class */
+	if (pcb == CURPROC)
+		yield(SCHED_USER);
+}
+
+/*
+  Return 1 if the core runs a thread that must give way to a gang thread: 
+  it does not run a gang or real-time thread, and either the gang of the 
+  current slot has ready threads, or a slot is due. The state of the gangs
+  is read without locking, as a hint.
+*/
+static int gang_preempts(CCB* core, TimerDuration now)
+{
+	if (__atomic_load_n(&gang_ready, __ATOMIC_RELAXED) == 0 
+		|| __atomic_load_n(&core->current_priority, __ATOMIC_RELAXED) >= GANG_PRIORITY)
+		return 0;
+	PCB* pcb = __atomic_load_n(&gang_active, __ATOMIC_RELAXED);
+	if (pcb != NULL && now < __atomic_load_n(&gang_end, __ATOMIC_RELAXED))
+		return __atomic_load_n(&pcb->gang_count, __ATOMIC_RELAXED) > 0;
+	return now >= __atomic_load_n(&gang_next, __ATOMIC_RELAXED);
+}
+
+/*
+  Add a ready gang thread to the queue of its process. During the slot of 
+  the gang, preempt a core that runs a thread of lower priority, else 
+  restart an idle core.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void gang_queue_add(TCB* tcb)
+{
+	PCB* pcb = tcb->owner_pcb;
+
+	spin_lock(&gang_spinlock);
+	if (pcb->gang_count++ == 0)
+		rlist_push_back(&gang_list, &pcb->gang_node);
+	rlist_push_back(&pcb->gang_queue, &tcb->sched_node);
+	tcb->sched_restricted = (tcb->affinity != sched_all_cores);
+	gang_ready++;
+	if (tcb->sched_restricted)
+		gang_restricted++;
+	int active = (pcb == gang_active && bios_clock() < gang_end);
+	spin_unlock(&gang_spinlock);
+
+	CCB* target = active ? sched_preempt_target(GANG_PRIORITY, tcb->affinity) : NULL;
+	if (target != NULL)
+		cpu_ici(target->id);
+	else
+		sched_wake_idle_core(-1);
+}
+
+/*
+  Remove a thread from the queue of its gang.
+
+  *** MUST BE CALLED WITH gang_spinlock HELD ***
+*/
+static void gang_queue_remove(TCB* tcb)
+{
+	PCB* pcb = tcb->owner_pcb;
+	rlist_remove(&tcb->sched_node);
+	if (--pcb->gang_count == 0)
+		rlist_remove(&pcb->gang_node);
+	gang_ready--;
+	if (tcb->sched_restricted)
+		gang_restricted--;
+}
+
+/* Send an ICI to the cores that do not run a gang or real-time thread, and restart the idle ones */
+static void gang_start_slot()
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (uint c = 0; c < cpu_cores(); c++) {
+		uint64_t bit = 1ull << c;
+		if (c == cpu_core_id)
+			continue;
+		if ((__atomic_load_n(&sched_idle_cores, __ATOMIC_RELAXED) & bit)
+			&& (__atomic_fetch_and(&sched_idle_cores, ~bit, __ATOMIC_RELAXED) & bit))
+			cpu_core_restart(c);
+		else if (__atomic_load_n(&cctx[c].current_priority, __ATOMIC_RELAXED) < GANG_PRIORITY)
+			cpu_ici(c);
+	}
+}
+
+/*
+  Return the gang thread to run at the current core, removing it from its
+  queue, or NULL if there is none. The slot of the active gang is ended, if
+  its time is over, and the slot of the next gang is started, if it is due, 
+  or if @c idle is set (the core has nothing else to run). The current 
+  thread, if it is a ready gang thread, is preferred, and its gang is 
+  preferred for a new slot. The time-slice of the returned thread ends with 
+  the slot.
+*/
+static TCB* gang_pick_next(CCB* core, TCB* current, int idle)
+{
+	int gang_current = current->state == READY && current->type != IDLE_THREAD 
+		&& is_gang(current) && sched_allowed(current, core->id);
+	if (__atomic_load_n(&gang_ready, __ATOMIC_RELAXED) == 0 && !gang_current)
+		return NULL;
+
+	TimerDuration now = bios_clock();
+	TCB* next_thread = NULL;
+	int start = 0;
+
+	spin_lock(&gang_spinlock);
+
+	/* End the slot of the active gang; the gang goes to the back of the list */
+	if (gang_active != NULL && now >= gang_end) {
+		if (gang_active->gang_count > 0) {
+			rlist_remove(&gang_active->gang_node);
+			rlist_push_back(&gang_list, &gang_active->gang_node);
+		}
+		__atomic_store_n(&gang_active, NULL, __ATOMIC_RELAXED);
+		__atomic_store_n(&gang_next, now + GANG_GAP, __ATOMIC_RELAXED);
+	}
+
+	/* Start the slot of the next gang */
+	if (gang_active == NULL && (now >= gang_next || idle)) {
+		PCB* pcb = gang_current ? current->owner_pcb 
+			: !is_rlist_empty(&gang_list) ? gang_list.next->pcb : NULL;
+		if (pcb != NULL) {
+			__atomic_store_n(&gang_end, now + GANG_SLOT, __ATOMIC_RELAXED);
+			__atomic_store_n(&gang_active, pcb, __ATOMIC_RELAXED);
+			start = 1;
+		}
+	}
+
+	/* Run a thread of the active gang */
+	if (gang_active != NULL) {
+		if (gang_current && current->owner_pcb == gang_active)
+			next_thread = current;
+		else {
+			rlnode* n = gang_active->gang_queue.next;
+			for (int i = 0; i < SCHED_STEAL_SCAN && n != &gang_active->gang_queue; i++, n = n->next)
+				if (sched_allowed(n->tcb, core->id)) {
+					next_thread = n->tcb;
+					gang_queue_remove(next_thread);
+					break;
+				}
+		}
+		if (next_thread != NULL)
+			next_thread->its = gang_end - now;
+	}
+
+	spin_unlock(&gang_spinlock);
+
+	if (start)
+		gang_start_slot();
+	return next_thread;
+}
+
+
+/*
+	Return the core to queue a ready thread at, when it does not preempt 
+	another core. Among the cores the thread may run on, this is the core it
+	last ran on, if this core is idle (its cache may still be warm), else the
+	current core, else an idle core, else the core it last ran on, else the 
+	first allowed core. If @c sched_params::no_affine_wakeup is set, an idle
+	last core is not preferred to the current core.
+ */
+static CCB* sched_place(TCB* tcb)
+{
+	uint64_t mask = tcb->affinity;
+	uint64_t idle = __atomic_load_n(&sched_idle_cores, __ATOMIC_RELAXED) & mask;
+	int last = tcb->last_core;
+
+	if (sched_affine_on && (idle & (1ull << last)))
+		return &cctx[last];
+	if (mask & (1ull << cpu_core_id))
+		return &CURCORE;
+	if (idle)
+		return &cctx[__builtin_ctzll(idle)];
+	if (mask & (1ull << last))
+		return &cctx[last];
+	return &cctx[__builtin_ctzll(mask)];
+}
+
+/*
+	Adjust the state of a thread to make it READY. The thread must have 
+	already been removed from the timer wheel.
+
+	If the thread has a higher priority than the thread running on some core,
+	it is added to the queue of that core (the one running the lowest priority 
+	thread), and the core is preempted by an ICI. However, if the core the 
+	thread last ran on runs a thread of lower priority, this core is 
+	preempted instead, since its cache may still be warm (unless 
+	@c sched_params::no_affine_wakeup is set). Else, the thread 
+	is added to the queue of the core chosen by sched_place(), or, if 
+	@c handoff is set, to the queue of the current core, as its hand-off 
+	thread (see wakeup_handoff). A real-time 
+	thread is added to the queue of its own core, and a gang thread to the
+	queue of its gang. If @c timeout_locked is set, the caller holds 
+	@c timeout_spinlock.
+
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+ */
+static void sched_make_ready(TCB* tcb, int timeout_locked, int handoff)
+{
+	assert(tcb->state == STOPPED || tcb->state == INIT);
+	assert(tcb->wakeup_time == NO_TIMEOUT);
+
+	/* Mark as ready */
+	tcb->state = READY;
+	tcb->ready_time = bios_clock();
+	trace_wakeup(tcb);
+
+	/* Possibly add to the scheduler queue of this core, or preempt another */
+	if (tcb->phase == CTX_CLEAN && is_realtime(tcb)) {
+		edf_on_wakeup(tcb, tcb->ready_time);
+		edf_queue_add(tcb, timeout_locked);
+	}
+	else if (tcb->phase == CTX_CLEAN && is_gang(tcb)) {
+		gang_queue_add(tcb);
+	}
+	else if (tcb->phase == CTX_CLEAN) {
+		CCB* target = NULL;
+		int last = tcb->last_core;
+		if (sched_affine_on && sched_allowed(tcb, last)) {
+			int p = __atomic_load_n(&cctx[last].current_priority, __ATOMIC_RELAXED);
+			if (p >= 0 && p < tcb->priority)
+				target = &cctx[last];
+		}
+		if (target == NULL)
+			target = sched_preempt_target(tcb->priority, tcb->affinity);
+		if (target != NULL) {
+			sched_queue_add(target, tcb, 0);
+			cpu_ici(target->id);
+		}
+		else if (handoff && sched_allowed(tcb, cpu_core_id))
+			sched_handoff(tcb);
+		else
+			sched_queue_add(sched_place(tcb), tcb, 0);
+	}
+}
+
+/*
+  Advance the timer wheel to the current time, and wake up the threads 
+  whose timeout has expired.
+*/
+static void sched_wakeup_expired_timeouts()
+{
+	TimerDuration curtime = bios_clock();
+
+	/* Quick check, without locking */
+	if (__atomic_load_n(&next_timeout, __ATOMIC_RELAXED) > curtime)
+		return;
+
+	spin_lock(&timeout_spinlock);
+
+	timer_wheel_advance(curtime / TIMER_TICK);
+
+	rlnode* n = TIMEOUT_EXPIRED.next;
+	while (n != &TIMEOUT_EXPIRED) {
+		TCB* tcb = n->tcb;
+		n = n->next;
+
+		/* If the thread is locked, it is being woken up or switched out. Leave it. */
+		if (Mutex_TryLock(&tcb->state_spinlock)) {
+			sched_cancel_timeout(tcb);
+			if (tcb->state == READY) {
+				/* 
+				  A throttled real-time thread: its next period starts at its 
+				  release, unless the core was late to expire it
+				 */
+				edf_new_period(tcb, (curtime < tcb->rt_release + 2*TIMER_TICK) ? tcb->rt_release : curtime);
+				edf_queue_add(tcb, 1);
+			}
+			else
+				sched_make_ready(tcb, 1, 0);
+			Mutex_Unlock(&tcb->state_spinlock);
+		}
+	}
+
+	sched_update_next_timeout();
+	spin_unlock(&timeout_spinlock);
+}
+
+/*
+  Take a ready thread out of the queues of the core it waits at, to run it 
+  at the current core. Return 1 on success, or 0 if the thread is not in 
+  the queues of a core, or it may not run on the current core.
 */
-static int check_for_boost()
+static int sched_queue_take(TCB* tcb)
 {
-	yield_counter++;
-	if(yield_counter==BOOST_PERIOD){
-		yield_counter=0;
-		return 1;
+	int c = __atomic_load_n(&tcb->sched_core, __ATOMIC_RELAXED);
+	if (c < 0 || !sched_allowed(tcb, cpu_core_id))
+		return 0;
+
+	CCB* core = &cctx[c];
+	int taken = 0;
+	spin_lock(&core->queue_spinlock);
+	if (tcb->sched_core == c) {
+		sched_policy_class->remove(core, tcb);
+		sched_count_update(core, tcb, -1);
+		taken = 1;
 	}
-
-	return 0;
+	spin_unlock(&core->queue_spinlock);
+	return taken;
 }
 
 /*
-*This is a helper function to use when boosting.
-*It changes the priority of each tcb contained in sched_queue and increments it.
+  Take the hand-off thread of the core, if the current thread is blocking, 
+  and no thread of higher priority is queued at the core. Else, end the 
+  hand-off.
 */
-static void change_queue_priority(rlnode * sched_queue)
+static TCB* sched_take_handoff(CCB* core, TCB* current)
 {
-	for(int i=0;i<rlist_len(sched_queue);i++)
-	{
-		rlnode * tcb_node = rlist_pop_front(sched_queue);
-		tcb_node->tcb->priority++;
-		rlist_push_back(sched_queue,tcb_node);
+	if (__atomic_load_n(&core->handoff, __ATOMIC_RELAXED) == NULL)
+		return NULL;
+	if (current->state != STOPPED && current->state != EXITED) {
+		sched_release_handoff(core);
+		return NULL;
 	}
-	
+
+	TCB* tcb = NULL;
+	spin_lock(&core->queue_spinlock);
+	if (core->handoff != NULL && core->handoff->priority >= sched_top_level(core->sched_bitmap)) {
+		tcb = core->handoff;
+		sched_policy_class->remove(core, tcb);
+		sched_count_update(core, tcb, -1);
+	}
+	spin_unlock(&core->queue_spinlock);
+
+	if (tcb == NULL)
+		sched_release_handoff(core);
+	return tcb;
 }
 
-/*
-*This function is used to get the next tcb to run.
-*It pops the first element from the highest priority queue that is not empty and returns it.
-*If all the queues are empty it returns the address of the lowest priority queue.
-*/
-static rlnode * sched_queue_pop()
+int sched_yield_to(TCB* tcb)
 {
-	for(int i=PRIORITY_QUEUES-1; i>=0; i--)
-		if(!is_rlist_empty(&SCHED[i]))
-			return rlist_pop_front(&SCHED[i]);
+	if (tcb == CURTHREAD)
+		return -1;
 
-	return &SCHED[0];
+	int preempt = preempt_off;
+	int taken = sched_queue_take(tcb);
+	if (taken) {
+		CURCORE.yield_target = tcb;
+		yield(SCHED_USER);
+	}
+	if (preempt)
+		preempt_on;
+	return taken ? 0 : -1;
 }
 
 /*
-*This function is used to implement the boost functionality of the scheduler.
-*For every priority queue (except the highest priority queue), we change the priority of its elements 
-*and then append them to the next higher priority.
+  Select the next thread to run at the current core: a real-time thread, 
+  if there is one, else the thread the current thread yields to, else a 
+  thread of the gang of the current slot, else the hand-off thread of the 
+  core, else the thread decided by the scheduling class, else a thread of 
+  a gang whose slot is not due. If there is no thread to run, return the current thread 
+  (if it is READY) or the core's idle thread. A real-time or gang thread, or
+  a thread not allowed on this core, is never passed to the class; the idle
+  thread is passed in its place.
 */
-static void sched_boost()
+static TCB* sched_queue_select(TCB* current)
 {
-	for(int i=0; i<PRIORITY_QUEUES-1; i++){
-		change_queue_priority(&SCHED[i]);
-		rlist_append(&SCHED[i+1],&SCHED[i]);
+	CCB* core = &CURCORE;
+
+	int rt_current = is_realtime(current) && current->state == READY 
+		&& current->rt_budget > 0 && current->rt_core == core->id;
+	TCB* next_thread = edf_pick_next(core, current, rt_current);
+
+	/* The thread yielded to gets the rest of the time-slice; it waits for a real-time thread */
+	TCB* target = core->yield_target;
+	core->yield_target = NULL;
+	if (target != NULL && next_thread == NULL) {
+		target->its = (current->rts > TIMER_TICK) ? current->rts : TIMER_TICK;
+		return target;
+	}
+	if (target != NULL) {
+		Mutex_Lock(&target->state_spinlock);
+		sched_queue_add(core, target, 0);
+		Mutex_Unlock(&target->state_spinlock);
 	}
-} 
-
 
-/*
-  Possibly add TCB to the scheduler timeout list.
+	int gang = 0;
+	if (next_thread == NULL)
+		gang = (next_thread = gang_pick_next(core, current, 0)) != NULL;
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
+	if (next_thread == NULL)
+		next_thread = sched_take_handoff(core, current);
 
+	int class_current = !is_realtime(current) && !is_gang(current) && sched_allowed(current, core->id);
+	if (next_thread == NULL)
+		next_thread = sched_policy_class->pick_next(core, class_current ? current : &core->idle_thread);
 
-static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
-{
-	if (timeout != NO_TIMEOUT) {
-		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+	if (next_thread == NULL)
+		gang = (next_thread = gang_pick_next(core, current, 1)) != NULL;
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+	if (next_thread == NULL)
+		next_thread = (current->state == READY && class_current) ? current : &core->idle_thread;
+
+	/* 
+	  The time-slice depends on the level of the thread, or on the budget of a 
+	  real-time thread; the slice of a gang thread was set by gang_pick_next().
+	  A thread that was preempted gets the rest of its time-slice, so that 
+	  frequent preemptions (e.g., by a periodic real-time thread) do not keep
+	  its quantum from ever expiring.
+	 */
+	if (next_thread->type == IDLE_THREAD)
+		next_thread->its = QUANTUM;
+	else if (is_realtime(next_thread))
+		next_thread->its = next_thread->rt_budget;
+	else if (!gang) {
+		TimerDuration quantum = sched_quantum[next_thread->priority];
+		next_thread->its = (next_thread->curr_cause == SCHED_PREEMPT 
+			&& next_thread->rts > 0 && next_thread->rts < quantum) ? next_thread->rts : quantum;
 	}
+
+	return next_thread;
 }
 
-/*
-  Add TCB to the end of the scheduler list.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+/*
+  The MLFQ scheduling class.
+
+  Each level has its own queue. Threads are selected from the highest 
+  non-empty level, in round-robin order. The level of a thread changes
+  according to the cause of its last yield: a thread whose quantum expired
+  drops one level, and a thread that waited for I/O rises to the top level.
+  Every BOOST_PERIOD usec, the queued threads of a core are boosted to the 
+  next higher level.
+
+  The nice value of a thread bounds its level: a thread of negative nice is
+  never demoted below its floor, and a thread of positive nice never rises 
+  above its ceiling, by I/O or by boosts. A thread of nice -20 always stays 
+  at the top level, and a thread of nice 19 at the bottom level. The nice 
+  value also biases the starting level of a new thread.
 */
-static void sched_queue_add(TCB* tcb)
+
+/* The lowest level a thread may be demoted to */
+static inline int mlfq_floor(TCB* tcb)
 {
-	/* Insert the tcb at its corresponding priority queue */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+	return (tcb->nice < 0) ? (-tcb->nice) * (sched_levels - 1) / (-NICE_MIN) : 0;
+}
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+/* The highest level a thread may rise to */
+static inline int mlfq_ceiling(TCB* tcb)
+{
+	return (tcb->nice > 0) ? (sched_levels - 1) - tcb->nice * (sched_levels - 1) / NICE_MAX : sched_levels - 1;
 }
 
 /*
-	Adjust the state of a thread to make it READY.
-
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
- */
-static void sched_make_ready(TCB* tcb)
+*This functions checks whether it's the right time to boost or not.
+*The queues of a core are boosted every BOOST_PERIOD usec.
+*Returns 1 if it is the right time, 0 if not.
+*/
+static int check_for_boost(CCB* core, TimerDuration now)
 {
-	assert(tcb->state == STOPPED || tcb->state == INIT);
-
-	/* Possibly remove from TIMEOUT_LIST */
-	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
-	}
+	if(now < core->boost_time)
+		return 0;
 
-	/* Mark as ready */
-	tcb->state = READY;
+	core->boost_time = now + BOOST_PERIOD;
+	return 1;
+}
 
-	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+/*
+*This function returns the queue of the given priority level of a core.
+*The queues rotate by one position at each boost, so that the queue of level i
+*becomes the queue of level i+1.
+*/
+static inline rlnode* sched_level_queue(CCB* core, int level)
+{
+	return &core->sched_queue[(level + sched_levels - core->boost_epoch % sched_levels) % sched_levels];
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+*This function is used to implement the boost functionality of the scheduler.
+*Every thread in the queues of the core (except the highest priority queue) moves 
+*to the next higher priority. This takes O(1) time: the top queue is prepended to 
+*the queue below it, and the queues are rotated, so that this merged queue becomes 
+*the top one, and the (empty) old top queue becomes the lowest one.
+*The priority of each thread is corrected when it is popped.
+*/
+static void sched_boost(CCB* core)
+{
+	int top = sched_levels-1;
+	if(top == 0)
+		return;
+
+	spin_lock(&core->queue_spinlock);
+	rlist_prepend(sched_level_queue(core, top-1), sched_level_queue(core, top));
+	core->boost_epoch++;
+	trace_boost();
+
+	uint64_t bitmap = core->sched_bitmap;
+	core->sched_bitmap = ((bitmap << 1) & ((1ull << top) - 1)) 
+		| ((bitmap >> (top-1)) ? (1ull << top) : 0);
+	spin_unlock(&core->queue_spinlock);
+} 
+
+static void mlfq_init(CCB* core)
+{
+	core->boost_epoch = 0;
+	core->boost_time = bios_clock() + BOOST_PERIOD;
+}
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+/*
+  Add TCB to the end of the queue of its level. A thread preempted by a 
+  wakeup is added to the head of the queue instead, since it did not use 
+  up its time-slice.
 */
-static void sched_wakeup_expired_timeouts()
+static void mlfq_enqueue(CCB* core, TCB* tcb)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	rlnode* queue = sched_level_queue(core, tcb->priority);
+	tcb->boost_epoch = core->boost_epoch;
+	if (tcb->curr_cause == SCHED_PREEMPT)
+		rlist_push_front(queue, &tcb->sched_node);
+	else
+		rlist_push_back(queue, &tcb->sched_node);
+	core->sched_bitmap |= 1ull << tcb->priority;
+}
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
+/*
+*Pop an element from the highest priority queue that is not empty.
+*/
+static TCB* mlfq_dequeue(CCB* core, int steal)
+{
+	int i = sched_top_level(core->sched_bitmap);
+	rlnode* queue = sched_level_queue(core, i);
+	rlnode* sel = sched_list_select(core, queue, steal);
+	if(sel == NULL)
+		return NULL;
+	rlist_remove(sel);
+	if(is_rlist_empty(queue))
+		core->sched_bitmap &= ~(1ull << i);
+
+	/* The priority is brought up to date with the boosts of the queue */
+	TCB* tcb = sel->tcb;
+	int ceiling = mlfq_ceiling(tcb);
+	if(i > ceiling) {
+		/* Boosted above its ceiling: move it down there, and take another thread */
+		tcb->priority = ceiling;
+		mlfq_enqueue(core, tcb);
+		return mlfq_dequeue(core, steal);
 	}
+	tcb->priority = i;
+	return tcb;
 }
 
-/*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+/* Remove a thread from its queue, bringing its priority up to date with the boosts of the queue */
+static void mlfq_remove(CCB* core, TCB* tcb)
+{
+	int level = tcb->priority + (int)(core->boost_epoch - tcb->boost_epoch);
+	if (level > (int)sched_levels - 1)
+		level = sched_levels - 1;
+	rlist_remove(&tcb->sched_node);
+	if (is_rlist_empty(sched_level_queue(core, level)))
+		core->sched_bitmap &= ~(1ull << level);
+
+	int ceiling = mlfq_ceiling(tcb);
+	tcb->priority = (level > ceiling) ? ceiling : level;
+}
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+/*
+  Remove the head of the scheduler list of the current core, if any, and
+  return it. A thread of higher priority waiting at another core is preferred.
+  If the core's list is empty and there is no other thread to run, 
+  try to steal from another core.
 */
-static TCB* sched_queue_select(TCB* current)
+static TCB* mlfq_pick_next(CCB* core, TCB* current)
 {
-	/* Get the head of the highest priority queue list */
-	rlnode* sel = sched_queue_pop();
+	/* The priority to beat, in order to pull a thread from another core */
+	uint64_t bitmap = __atomic_load_n(&core->sched_bitmap, __ATOMIC_RELAXED);
+	int level = bitmap ? sched_top_level(bitmap) : -1;
+	if (current->state == READY && current->type != IDLE_THREAD && current->priority > level)
+		level = current->priority;
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	TCB* next_thread = sched_queue_pull(core, level);
 
+	/* Get the head of the highest priority queue list */
 	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		next_thread = sched_queue_pop(core, 0);
 
-	next_thread->its = QUANTUM;
+	/* Rather than staying idle, steal work */
+	if (next_thread == NULL && (current->state != READY || current->type == IDLE_THREAD))
+		next_thread = sched_queue_steal(core);
 
 	return next_thread;
 }
 
+static void mlfq_on_tick(CCB* core, TimerDuration now)
+{
+	if(check_for_boost(core, now))
+		sched_boost(core);
+}
+
 /*
 *This function changes the priority of the thread that just called yield,
 *based on its current or last cause.
-*It returns the priority to be assingned for the that thread.
 */
-static int set_next_priority(TCB* current_thread)
+static void mlfq_on_yield(CCB* core, TCB* current_thread, TimerDuration now)
 {
 	int current_priority=current_thread->priority;
 
 	switch (current_thread->curr_cause) {
 		//Check if the thread quantum was over.
 		case SCHED_QUANTUM:
-		//if the thread is not already in the lowest priority
-			if(current_priority>0)
+		//if the thread is not already at its lowest priority
+			if(current_priority>mlfq_floor(current_thread))
 			//decrement its priority
 				current_priority--;
 			break;
 		//Check for an I/O thread.
 		case SCHED_IO:
 			//change its priority to the highest possible
-			current_priority=PRIORITY_QUEUES-1;
+			current_priority=mlfq_ceiling(current_thread);
 			break;
 		//Check for a thread that called yield inside a mutex lock.
 		case SCHED_MUTEX:
-			//if it was previously yielded for the same reason and its not already in the lowest priority queue
+			//if it was previously yielded for the same reason and its not already at its lowest priority
 			if(current_thread->last_cause==SCHED_MUTEX)
-				if(current_priority>0)
+				if(current_priority>mlfq_floor(current_thread))
 				//decrement its priority
 					current_priority--;
 			break;
@@ -408,14 +2121,318 @@ static int set_next_priority(TCB* current_thread)
 		default:
 			assert(1);
 		}
-	return current_priority;
+	current_thread->priority=current_priority;
+}
+
+/*
+  Start a new thread at the middle level, biased by its nice value, and
+  keep other threads within their floor and ceiling.
+*/
+static void mlfq_on_nice(TCB* tcb)
+{
+	int priority = tcb->priority;
+	if (tcb->state == INIT)
+		priority = (int)(sched_levels / 2) - tcb->nice * (int)sched_levels / (2*(-NICE_MIN));
+
+	int floor = mlfq_floor(tcb), ceiling = mlfq_ceiling(tcb);
+	if (priority < floor)
+		priority = floor;
+	if (priority > ceiling)
+		priority = ceiling;
+	tcb->priority = priority;
+}
+
+static const sched_class mlfq_class = {
+	.name = "mlfq",
+	.levels = 0,
+	.init = mlfq_init,
+	.enqueue = mlfq_enqueue,
+	.dequeue = mlfq_dequeue,
+	.remove = mlfq_remove,
+	.pick_next = mlfq_pick_next,
+	.on_tick = mlfq_on_tick,
+	.on_yield = mlfq_on_yield,
+	.on_nice = mlfq_on_nice
+};
+
+
+/*
+  The round-robin scheduling class.
+
+  All threads have the same priority, and each core runs its ready threads
+  in FIFO order, from a single queue. There is no preemption by wakeups.
+*/
+
+static void rr_enqueue(CCB* core, TCB* tcb)
+{
+	rlist_push_back(&core->sched_queue[0], &tcb->sched_node);
+	core->sched_bitmap = 1;
+}
+
+static TCB* rr_dequeue(CCB* core, int steal)
+{
+	rlnode* queue = &core->sched_queue[0];
+	rlnode* sel = sched_list_select(core, queue, steal);
+	if(sel == NULL)
+		return NULL;
+	rlist_remove(sel);
+	if(is_rlist_empty(queue))
+		core->sched_bitmap = 0;
+	return sel->tcb;
+}
+
+static void rr_remove(CCB* core, TCB* tcb)
+{
+	rlist_remove(&tcb->sched_node);
+	if(is_rlist_empty(&core->sched_queue[0]))
+		core->sched_bitmap = 0;
+}
+
+static TCB* rr_pick_next(CCB* core, TCB* current)
+{
+	TCB* next_thread = sched_queue_pop(core, 0);
+
+	/* Rather than staying idle, steal work */
+	if (next_thread == NULL && (current->state != READY || current->type == IDLE_THREAD))
+		next_thread = sched_queue_steal(core);
+
+	return next_thread;
+}
+
+static const sched_class rr_class = {
+	.name = "rr",
+	.levels = 1,
+	.enqueue = rr_enqueue,
+	.dequeue = rr_dequeue,
+	.remove = rr_remove,
+	.pick_next = rr_pick_next
+};
+
+
+/*
+  The fair-share scheduling class.
+
+  Each thread accumulates virtual runtime: the time it has run, scaled by
+  NICE_0_WEIGHT over its weight, which is derived from its nice value. Each
+  core keeps its ready threads in CCB::fair_tree, ordered by virtual runtime,
+  and runs the one with the least. Thus, the threads of a core get cpu time
+  in proportion to their weights.
+
+  The virtual runtimes of the threads of a core are relative to the core's
+  @c min_vruntime, a lower bound that only moves forward. A thread that is
+  queued at a different core has its virtual runtime moved to the clock of 
+  that core. Also, a thread is queued at most FAIR_SLEEPER_CREDIT behind 
+  @c min_vruntime, so that a long sleep does not build up a large credit.
+
+  Across cores, the threads are balanced by weight: every FAIR_BALANCE_PERIOD 
+  usec, a core pulls a thread from the core of the highest load (total 
+  weight), if this lowers the imbalance between the two cores.
+
+  All threads have priority 0, so there is no preemption by wakeups.
+*/
+
+/* The weight of each nice value, from NICE_MIN to NICE_MAX. Each step is about 1.25x */
+static const unsigned int nice_to_weight[NICE_MAX-NICE_MIN+1] = {
+	/* -20 */ 88761, 71755, 56483, 46273, 36291,
+	/* -15 */ 29154, 23254, 18705, 14949, 11916,
+	/* -10 */  9548,  7620,  6100,  4904,  3906,
+	/*  -5 */  3121,  2501,  1991,  1586,  1277,
+	/*   0 */  1024,   820,   655,   526,   423,
+	/*   5 */   335,   272,   215,   172,   137,
+	/*  10 */   110,    87,    70,    56,    45,
+	/*  15 */    36,    29,    23,    18,    15
+};
+#define NICE_0_WEIGHT 1024
+
+#define FAIR_SLEEPER_CREDIT (QUANTUM/2)   /* The most a woken thread can be behind min_vruntime */
+#define FAIR_BALANCE_PERIOD (4*QUANTUM)   /* The time between two balancing attempts of a core */
+#define FAIR_BALANCE_SCAN 8               /* The threads examined by a balancing attempt */
+
+static inline unsigned int fair_weight(TCB* tcb)
+{
+	return nice_to_weight[tcb->nice - NICE_MIN];
+}
+
+/* The load of a core, read without locking */
+static inline unsigned long fair_core_load(CCB* core)
+{
+	return __atomic_load_n(&core->fair_load, __ATOMIC_RELAXED) 
+		+ __atomic_load_n(&core->fair_running, __ATOMIC_RELAXED);
+}
+
+static void fair_init(CCB* core)
+{
+	rbtree_init(&core->fair_tree);
+	core->min_vruntime = 0;
+	core->fair_load = 0;
+	core->fair_running = 0;
+	core->balance_time = bios_clock() + FAIR_BALANCE_PERIOD;
+}
+
+static void fair_enqueue(CCB* core, TCB* tcb)
+{
+	/* Move the virtual runtime to the clock of this core */
+	long lag = (long)(tcb->vruntime - cctx[tcb->fair_core].min_vruntime);
+	if (lag < -(long)FAIR_SLEEPER_CREDIT)
+		lag = -(long)FAIR_SLEEPER_CREDIT;
+	tcb->vruntime = (lag < 0 && core->min_vruntime < -lag) ? 0 : core->min_vruntime + lag;
+	tcb->fair_core = core->id;
+
+	tcb->fair_node.key = tcb->vruntime;
+	rbtree_insert(&core->fair_tree, &tcb->fair_node);
+	tcb->fair_weight = fair_weight(tcb);
+	core->fair_load += tcb->fair_weight;
+	core->sched_bitmap = 1;
+}
+
+/* Remove a thread from the tree of a core */
+static void fair_remove(CCB* core, TCB* tcb)
+{
+	rbtree_remove(&core->fair_tree, &tcb->fair_node);
+	core->fair_load -= tcb->fair_weight;
+	if (is_rbtree_empty(&core->fair_tree))
+		core->sched_bitmap = 0;
+}
+
+/* Take the thread of the least virtual runtime, or of the highest when stealing */
+static TCB* fair_dequeue(CCB* core, int steal)
+{
+	rbnode* n = steal ? rbtree_last(&core->fair_tree) : rbtree_first(&core->fair_tree);
+	if (core->id != cpu_core_id) {
+		for (int i = 0; n != NULL && !sched_allowed(n->tcb, cpu_core_id); i++)
+			n = (i < SCHED_STEAL_SCAN) ? (steal ? rbtree_prev(n) : rbtree_next(n)) : NULL;
+		if (n == NULL)
+			return NULL;
+	}
+	TCB* tcb = n->tcb;
+	fair_remove(core, tcb);
+	if (!steal && tcb->vruntime > core->min_vruntime)
+		core->min_vruntime = tcb->vruntime;
+	return tcb;
+}
+
+/*
+  Run the thread of the least virtual runtime, unless it is the current
+  thread. If the core has no other thread, steal one.
+*/
+static TCB* fair_pick_next(CCB* core, TCB* current)
+{
+	TCB* next_thread = NULL;
+	int runnable = (current->state == READY && current->type != IDLE_THREAD);
+
+	spin_lock(&core->queue_spinlock);
+	rbnode* first = rbtree_first(&core->fair_tree);
+	if (first != NULL && !(runnable && current->vruntime <= first->key)) {
+		next_thread = fair_dequeue(core, 0);
+		sched_count_update(core, next_thread, -1);
+	}
+	spin_unlock(&core->queue_spinlock);
+
+	/* Rather than staying idle, steal work */
+	if (next_thread == NULL && !runnable)
+		next_thread = sched_queue_steal(core);
+
+	/* Publish the weight of the thread about to run, for load balancing */
+	TCB* running = (next_thread != NULL) ? next_thread : (runnable ? current : NULL);
+	__atomic_store_n(&core->fair_running, (running != NULL) ? fair_weight(running) : 0, __ATOMIC_RELAXED);
+
+	return next_thread;
+}
+
+/*
+  Pull a thread from the core of the highest load, if moving it lowers the 
+  imbalance, i.e., if its weight is less than the difference of the loads. 
+  Of the threads with the highest virtual runtime, the first that fits is 
+  moved.
+*/
+static void fair_balance(CCB* core)
+{
+	uint ncores = cpu_cores();
+
+	/* 
+	  Our own load is known exactly: the queued threads, and the current 
+	  thread if it stays ready. CCB::fair_running may still hold the weight 
+	  of a thread that has just blocked.
+	 */
+	TCB* current = CURTHREAD;
+	unsigned long load = __atomic_load_n(&core->fair_load, __ATOMIC_RELAXED)
+		+ ((current->state == READY && current->type != IDLE_THREAD) ? fair_weight(current) : 0);
+	CCB* busiest = NULL;
+	unsigned long busiest_load = load;
+
+	for (uint i = 1; i < ncores; i++) {
+		CCB* c = &cctx[(core->id + i) % ncores];
+		unsigned long l = fair_core_load(c);
+		if (l > busiest_load) {
+			busiest = c;
+			busiest_load = l;
+		}
+	}
+	if (busiest == NULL)
+		return;
+
+	TCB* tcb = NULL;
+	spin_lock(&busiest->queue_spinlock);
+	rbnode* n = rbtree_last(&busiest->fair_tree);
+	for (int i = 0; n != NULL && i < FAIR_BALANCE_SCAN; i++, n = rbtree_prev(n)) {
+		if (n->tcb->fair_weight < busiest_load - load && sched_allowed(n->tcb, core->id)) {
+			tcb = n->tcb;
+			fair_remove(busiest, tcb);
+			sched_count_update(busiest, tcb, -1);
+			break;
+		}
+	}
+	spin_unlock(&busiest->queue_spinlock);
+
+	if (tcb != NULL) {
+		spin_lock(&core->queue_spinlock);
+		fair_enqueue(core, tcb);
+		sched_count_update(core, tcb, 1);
+		spin_unlock(&core->queue_spinlock);
+	}
+}
+
+static void fair_on_tick(CCB* core, TimerDuration now)
+{
+	if (now < core->balance_time)
+		return;
+	core->balance_time = now + FAIR_BALANCE_PERIOD;
+	fair_balance(core);
+}
+
+/* Charge the time-slice that just ended to the virtual runtime */
+static void fair_on_yield(CCB* core, TCB* tcb, TimerDuration now)
+{
+	if (tcb->type == IDLE_THREAD || now < core->slice_start)
+		return;
+	tcb->vruntime += (now - core->slice_start) * NICE_0_WEIGHT / fair_weight(tcb);
 }
 
+static const sched_class fair_class = {
+	.name = "fair",
+	.levels = 1,
+	.init = fair_init,
+	.enqueue = fair_enqueue,
+	.dequeue = fair_dequeue,
+	.remove = fair_remove,
+	.pick_next = fair_pick_next,
+	.on_tick = fair_on_tick,
+	.on_yield = fair_on_yield
+};
+
+
+/* The scheduling classes, indexed by sched_policy */
+static const sched_class* sched_classes[] = {
+	[SCHED_POLICY_MLFQ] = &mlfq_class,
+	[SCHED_POLICY_RR] = &rr_class,
+	[SCHED_POLICY_FAIR] = &fair_class
+};
+
 
 /*
-  Make the process ready.
+  Make the process ready, possibly as the hand-off thread of the current core.
  */
-int wakeup(TCB* tcb)
+static int sched_wakeup(TCB* tcb, int handoff)
 {
 	int ret = 0;
 
@@ -423,14 +2440,20 @@ int wakeup(TCB* tcb)
 	int oldpre = preempt_off;
 
 	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&tcb->state_spinlock);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
+		/* Possibly remove from the timer wheel */
+		if (tcb->wakeup_time != NO_TIMEOUT) {
+			spin_lock(&timeout_spinlock);
+			sched_cancel_timeout(tcb);
+			spin_unlock(&timeout_spinlock);
+		}
+		sched_make_ready(tcb, 0, handoff);
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&tcb->state_spinlock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -439,10 +2462,20 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+int wakeup(TCB* tcb)
+{
+	return sched_wakeup(tcb, 0);
+}
+
+int wakeup_handoff(TCB* tcb)
+{
+	return sched_wakeup(tcb, sched_handoff_on);
+}
+
 /*
-  Atomically put the current process to sleep, after unlocking mx.
+  Atomically put the current process to sleep, after unlocking mx or sl.
  */
-void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
+static void sched_sleep(Thread_state state, Mutex* mx, Spinlock* sl, enum SCHED_CAUSE cause,
 	TimerDuration timeout)
 {
 	assert(state == STOPPED || state == EXITED);
@@ -450,21 +2483,27 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 	TCB* tcb = CURTHREAD;
 
 	int preempt = preempt_off;
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&tcb->state_spinlock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
+	if (state == EXITED)
+		trace_exit(tcb);
+	else
+		trace_block(tcb, cause, tcb->wchan);
 
 	/* register the timeout (if any) for the sleeping thread */
 	if (state != EXITED)
 		sched_register_timeout(tcb, timeout);
 
-	/* Release mx */
+	/* Release mx or sl */
 	if (mx != NULL)
 		Mutex_Unlock(mx);
+	if (sl != NULL)
+		spin_unlock(sl);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	/* Release the thread spinlock before calling yield() !!! */
+	Mutex_Unlock(&tcb->state_spinlock);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -474,46 +2513,91 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 		preempt_on;
 }
 
+void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
+	TimerDuration timeout)
+{
+	sched_sleep(state, mx, NULL, cause, timeout);
+}
+
+void sleep_releasing_spinlock(Thread_state state, Spinlock* sl, enum SCHED_CAUSE cause,
+	TimerDuration timeout)
+{
+	sched_sleep(state, NULL, sl, cause, timeout);
+}
+
 /* This function is the entry point to the scheduler's context switching */
 
 void yield(enum SCHED_CAUSE cause)
 {
-	/* Reset the timer, so that we are not interrupted by ALARM */
-	TimerDuration remaining = bios_cancel_timer();
-
-	/* We must stop preemption but save it! */
+	/* We must stop preemption but save it! An ALARM that arrives now is held pending. */
 	int preempt = preempt_off;
 
 	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+	CCB* core = &CURCORE;
 
-	Mutex_Lock(&sched_spinlock);
+	/* 
+	  The timer is not cancelled here; gain() decides whether it must be
+	  reprogrammed. The remaining time-slice is accounted in software.
+	 */
+	TimerDuration now = bios_clock();
+	TimerDuration remaining = (core->slice_deadline != NO_TIMEOUT && core->slice_deadline > now) 
+		? core->slice_deadline - now : 0;
+
+	Mutex_Lock(&current->state_spinlock);
 
 	/* Update CURTHREAD state */
-	if (current->state == RUNNING)
+	if (current->state == RUNNING) {
 		current->state = READY;
+		current->ready_time = now;
+	}
+
+	/* Account the time-slice to the thread and the core */
+	TimerDuration used = (now > core->slice_start) ? now - core->slice_start : 0;
+	if (current->type == IDLE_THREAD)
+		core->idle_time += used;
+	else {
+		current->run_time += used;
+		core->busy_time += used;
+	}
 
 	/* Update CURTHREAD scheduler data */
 	current->rts = remaining;
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
-	current->priority=set_next_priority(current);
+	if (is_realtime(current))
+		edf_on_yield(core, current, now);
+	else if (sched_policy_class->on_yield && !is_gang(current))
+		sched_policy_class->on_yield(core, current, now);
+
+	Mutex_Unlock(&current->state_spinlock);
+
 	/* Wake up threads whose sleep timeout has expired */
 	sched_wakeup_expired_timeouts();
 
+	/* 
+	  Let the scheduling class do its periodic work, while the current thread
+	  is still out of the queues and the next one is still in them 
+	 */
+	if (sched_policy_class->on_tick)
+		sched_policy_class->on_tick(core, now);
+
 	/* Get next */
 	TCB* next = sched_queue_select(current);
 	assert(next != NULL);
 
-	//checking if we need to boost.
-	if(check_for_boost())
-		sched_boost();
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
-
-	Mutex_Unlock(&sched_spinlock);
+	core->previous_thread = current;
 
 	/* Switch contexts */
 	if (current != next) {
+		core->switches++;
+		if (current->type != IDLE_THREAD) {
+			if (current->state == READY && (cause == SCHED_QUANTUM || cause == SCHED_PREEMPT))
+				current->involuntary_switches++;
+			else
+				current->voluntary_switches++;
+		}
+		trace_switch(current, next, cause);
 		CURTHREAD = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
@@ -524,6 +2608,65 @@ void yield(enum SCHED_CAUSE cause)
 	gain(preempt);
 }
 
+/*
+  Program the core timer for a time-slice of @c rts usec, starting now.
+
+  The host timer is only reprogrammed if it is not already set to fire
+  within QUANTUM_SLACK before the end of the new slice. Therefore, a slice 
+  may end up to QUANTUM_SLACK usec early. When the timer is reprogrammed,
+  any pending ALARM is cleared by bios_set_timer().
+*/
+static void sched_set_timer(CCB* core, TimerDuration rts)
+{
+	TimerDuration now = bios_clock();
+	TimerDuration deadline = now + rts;
+	core->slice_start = now;
+	core->slice_deadline = deadline;
+
+	TimerDuration alarm = sched_alarm_time(core, deadline, now);
+	if (core->timer_deadline != NO_TIMEOUT 
+		&& core->timer_deadline > now
+		&& core->timer_deadline <= alarm 
+		&& alarm - core->timer_deadline <= QUANTUM_SLACK) {
+		/* Keep the programmed deadline: the slice ends at the timer */
+		if (alarm == deadline)
+			core->slice_deadline = core->timer_deadline;
+		return;
+	}
+
+	core->timer_deadline = alarm;
+	bios_set_timer(alarm - now);
+}
+
+/*
+  Cancel the core timer.
+*/
+static void sched_cancel_timer(CCB* core)
+{
+	core->slice_deadline = NO_TIMEOUT;
+	if (core->timer_deadline != NO_TIMEOUT) {
+		core->timer_deadline = NO_TIMEOUT;
+		bios_cancel_timer();
+	}
+}
+
+/*
+  Add a run-queue latency to a histogram of the current core. The latency
+  of a thread is measured from TCB::ready_time, which is set when the thread
+  becomes ready, before it is queued.
+*/
+static inline void sched_latency_add(sched_latency* h, TimerDuration wait)
+{
+	int b = (wait == 0) ? 0 : 64 - __builtin_clzll(wait);
+	if (b >= LATENCY_BUCKETS)
+		b = LATENCY_BUCKETS - 1;
+	h->buckets[b]++;
+	h->count++;
+	h->total += wait;
+	if (wait > h->max)
+		h->max = wait;
+}
+
 /*
   This function must be called at the beginning of each new timeslice.
   This is done mostly from inside yield().
@@ -538,42 +2681,170 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
-
+	CCB* core = &CURCORE;
 	TCB* current = CURTHREAD;
 
 	/* Mark current state */
+	Mutex_Lock(&current->state_spinlock);
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	if (current->last_core != core->id && current->type != IDLE_THREAD) {
+		current->migrations++;
+		core->migrations++;
+		trace_migrate(current, current->last_core);
+	}
+	current->last_core = core->id;
+	Mutex_Unlock(&current->state_spinlock);
+
+	/* Publish the priority of the running thread, and its deadline if it is real-time */
+	int priority = (current->type == IDLE_THREAD) ? -1 : is_realtime(current) ? EDF_PRIORITY 
+		: is_gang(current) ? GANG_PRIORITY : current->priority;
+	__atomic_store_n(&core->current_priority, priority, __ATOMIC_RELAXED);
+	__atomic_store_n(&core->rt_running, 
+		is_realtime(current) ? current->rt_deadline : NO_TIMEOUT, __ATOMIC_RELAXED);
 
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = core->previous_thread;
 	if (current != prev) {
+		if (current->type != IDLE_THREAD) {
+			TimerDuration now = bios_clock();
+			TimerDuration wait = (now > current->ready_time) ? now - current->ready_time : 0;
+			current->wait_time += wait;
+			sched_latency_add(&core->latency_level[priority], wait);
+			sched_latency_add(&core->latency_cause[current->curr_cause], wait);
+		}
+		Mutex_Lock(&prev->state_spinlock);
 		prev->phase = CTX_CLEAN;
-		switch (prev->state) {
+		Thread_state prev_state = prev->state;
+		switch (prev_state) {
 		case READY:
-			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+			if (is_realtime(prev))
+				edf_queue_add(prev, 0);
+			else if (prev->type != IDLE_THREAD && is_gang(prev))
+				gang_queue_add(prev);
+			else if (prev->type != IDLE_THREAD)
+				sched_queue_add(sched_allowed(prev, core->id) ? core : sched_place(prev), prev, 0);
 			break;
 		case EXITED:
-			release_TCB(prev);
-			break;
 		case STOPPED:
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
+		Mutex_Unlock(&prev->state_spinlock);
+
+		/* Nobody can access an exited thread, release it after unlocking */
+		if (prev_state == EXITED)
+			release_TCB(prev);
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/* Set a 1-quantum alarm, before a pending ALARM can be delivered */
+	sched_set_timer(core, current->rts);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
+}
+
+/*
+  A thread is running if it is the current thread of the core it last ran 
+  on; a thread that has just yielded is still RUNNING until its core 
+  switches away from it. The fields are read without locking.
+*/
+int sched_thread_running(TCB* tcb)
+{
+	Thread_state state = __atomic_load_n(&tcb->state, __ATOMIC_RELAXED);
+	CCB* core = &cctx[__atomic_load_n(&tcb->last_core, __ATOMIC_RELAXED)];
+	return state == RUNNING && __atomic_load_n(&core->current_thread, __ATOMIC_RELAXED) == tcb;
+}
+
+/*
+  The accounting of yield() and gain() is completed with the time since the 
+  last context switch. The fields are read without locking.
+*/
+void sched_thread_times(TCB* tcb, TimerDuration* run_time, TimerDuration* wait_time)
+{
+	TimerDuration now = bios_clock();
+	*run_time = tcb->run_time;
+	*wait_time = tcb->wait_time;
+
+	Thread_state state = __atomic_load_n(&tcb->state, __ATOMIC_RELAXED);
+	if (sched_thread_running(tcb)) {
+		CCB* core = &cctx[__atomic_load_n(&tcb->last_core, __ATOMIC_RELAXED)];
+		TimerDuration start = __atomic_load_n(&core->slice_start, __ATOMIC_RELAXED);
+		if (now > start)
+			*run_time += now - start;
+	}
+	else if (state == READY) {
+		TimerDuration ready = __atomic_load_n(&tcb->ready_time, __ATOMIC_RELAXED);
+		if (now > ready)
+			*wait_time += now - ready;
+	}
+}
+
+_Static_assert(SCHED_CAUSES == LATENCY_CAUSES,
+	"enum SCHED_CAUSE and LATENCY_CAUSES are out of sync");
+
+unsigned long sched_latency_read(int level, int cause, latencyinfo* info)
+{
+	assert((level < 0) != (cause < 0));
+	assert(level < MAX_SCHED_LEVELS+2 && cause < SCHED_CAUSES);
+
+	info->level = level;
+	info->cause = cause;
+	info->count = info->total = info->max = 0;
+	for (int b = 0; b < LATENCY_BUCKETS; b++)
+		info->buckets[b] = 0;
+
+	for (uint c = 0; c < cpu_cores(); c++) {
+		sched_latency* h = (level >= 0) ? &cctx[c].latency_level[level] : &cctx[c].latency_cause[cause];
+		info->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+		info->total += __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+		unsigned long max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+		if (max > info->max)
+			info->max = max;
+		for (int b = 0; b < LATENCY_BUCKETS; b++)
+			info->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+	}
+	return info->count;
+}
+
+void sched_core_times(CCB* core, TimerDuration* busy_time, TimerDuration* idle_time)
+{
+	TimerDuration now = bios_clock();
+	*busy_time = __atomic_load_n(&core->busy_time, __ATOMIC_RELAXED);
+	*idle_time = __atomic_load_n(&core->idle_time, __ATOMIC_RELAXED);
+
+	TCB* current = __atomic_load_n(&core->current_thread, __ATOMIC_RELAXED);
+	TimerDuration start = __atomic_load_n(&core->slice_start, __ATOMIC_RELAXED);
+	if (current != NULL && now > start) {
+		if (current->type == IDLE_THREAD)
+			*idle_time += now - start;
+		else
+			*busy_time += now - start;
+	}
+}
 
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+/* 
+  Return 1 if this core has a thread in its ready queues, or some other core 
+  or gang has a ready thread that may run on all cores. The threads with an 
+  affinity mask are queued at a core they may run on, which is restarted if
+  it is idle.
+*/
+static int sched_work_pending()
+{
+	CCB* core = &CURCORE;
+	if (__atomic_load_n(&core->rt_next, __ATOMIC_RELAXED) != NO_TIMEOUT
+		|| __atomic_load_n(&core->sched_count, __ATOMIC_RELAXED) > 0
+		|| __atomic_load_n(&gang_ready, __ATOMIC_RELAXED) 
+			> __atomic_load_n(&gang_restricted, __ATOMIC_RELAXED))
+		return 1;
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (__atomic_load_n(&cctx[c].sched_count, __ATOMIC_RELAXED) 
+			> __atomic_load_n(&cctx[c].sched_restricted, __ATOMIC_RELAXED))
+			return 1;
+	return 0;
 }
 
 static void idle_thread()
@@ -583,23 +2854,109 @@ static void idle_thread()
 
 	/* We come here whenever we cannot find a ready thread for our core */
 	while (active_threads > 0) {
-		cpu_core_halt();
+		/* 
+		  Halt without a quantum timer, until the next timeout expires or
+		  some core restarts us because a thread became ready.
+		 */
+		sched_cancel_timer(&CURCORE);
+
+		/* Announce that we are idle, then check for work for the last time */
+		uint64_t bit = 1ull << cpu_core_id;
+		__atomic_fetch_or(&sched_idle_cores, bit, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		TimerDuration deadline = __atomic_load_n(&next_timeout, __ATOMIC_RELAXED);
+		if (! sched_work_pending())
+			cpu_core_halt_until((deadline == NO_TIMEOUT) ? BIOS_NO_DEADLINE : deadline);
+		__atomic_fetch_and(&sched_idle_cores, ~bit, __ATOMIC_RELAXED);
+
 		yield(SCHED_IDLE);
 	}
 
 	/* If the idle thread exits here, we are leaving the scheduler! */
-	bios_cancel_timer();
+	sched_cancel_timer(&CURCORE);
 	cpu_core_restart_all();
 }
 
 /*
   Initialize the scheduler queue
  */
-void initialize_scheduler()
+void initialize_scheduler(const sched_params* params)
 {
-	for(int i=0;i<PRIORITY_QUEUES;i++)
-		rlnode_init(&SCHED[i], NULL);
-	rlnode_init(&TIMEOUT_LIST, NULL);
+	assert(params->policy < sizeof(sched_classes)/sizeof(sched_classes[0]));
+	sched_policy_class = sched_classes[params->policy];
+
+	sched_handoff_on = !params->no_handoff;
+	sched_affine_on = !params->no_affine_wakeup;
+
+	sched_levels = (params->levels > 0) ? params->levels : PRIORITY_QUEUES;
+	if (sched_policy_class->levels > 0)
+		sched_levels = sched_policy_class->levels;
+	assert(sched_levels <= MAX_SCHED_LEVELS);
+
+	/* A shift by the width of the mask would be undefined */
+	sched_all_cores = (cpu_cores() < 8*sizeof(cpumask_t)) 
+		? ((cpumask_t)1 << cpu_cores()) - 1 : ~(cpumask_t)0;
+
+	/* The default time-slice doubles at each level below the top, up to MAX_QUANTUM */
+	for(int i=0; i<sched_levels; i++) {
+		TimerDuration q = QUANTUM;
+		for(int l=sched_levels-1; l>i && q<MAX_QUANTUM; l--)
+			q *= 2;
+		sched_quantum[i] = (params->quantum[i] > 0) ? params->quantum[i] : q;
+	}
+
+	for(uint c=0; c<MAX_CORES; c++) {
+		CCB* core = &cctx[c];
+		for(int i=0;i<MAX_SCHED_LEVELS;i++)
+			rlnode_init(&core->sched_queue[i], NULL);
+		core->sched_bitmap = 0;
+		core->sched_count = 0;
+		core->sched_restricted = 0;
+		core->migrations = 0;
+		core->busy_time = 0;
+		core->idle_time = 0;
+		core->switches = 0;
+		core->slice_start = bios_clock();
+		memset(core->latency_level, 0, sizeof(core->latency_level));
+		memset(core->latency_cause, 0, sizeof(core->latency_cause));
+		core->queue_spinlock = SPINLOCK_INIT;
+		if (sched_policy_class->init)
+			sched_policy_class->init(core);
+		core->current_priority = -1;
+		core->handoff = NULL;
+		core->yield_target = NULL;
+		rbtree_init(&core->rt_tree);
+		core->rt_next = NO_TIMEOUT;
+		core->rt_running = NO_TIMEOUT;
+		rbtree_init(&core->rt_timers);
+		core->rt_timer = NO_TIMEOUT;
+		core->rt_util = 0;
+		rlnode_init(&core->tcb_cache, NULL);
+		core->tcb_cache_count = 0;
+		core->tcb_allocs = 0;
+		core->tcb_reuses = 0;
+	}
+	rlnode_init(&tcb_pool, NULL);
+	tcb_pool_count = 0;
+	initialize_guard_pages();
+	tcb_pool_spinlock = SPINLOCK_INIT;
+	for(int l=0; l<TIMER_LEVELS; l++) {
+		for(int i=0; i<TIMER_SLOTS; i++)
+			rlnode_init(&TIMER_WHEEL[l][i], NULL);
+		timer_bitmap[l] = 0;
+	}
+	rlnode_init(&TIMEOUT_EXPIRED, NULL);
+	timer_tick = bios_clock() / TIMER_TICK;
+	timeout_spinlock = SPINLOCK_INIT;
+	next_timeout = NO_TIMEOUT;
+	edf_admission_lock = SPINLOCK_INIT;
+	gang_spinlock = SPINLOCK_INIT;
+	rlnode_init(&gang_list, NULL);
+	gang_active = NULL;
+	gang_end = 0;
+	gang_next = 0;
+	gang_ready = 0;
+	gang_restricted = 0;
 }
 
 void run_scheduler()
@@ -613,14 +2970,19 @@ void run_scheduler()
 
 	curcore->idle_thread.owner_pcb = get_pcb(0);
 	curcore->idle_thread.type = IDLE_THREAD;
+	curcore->idle_thread.affinity = 1ull << cpu_core_id;
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
+	curcore->idle_thread.state_spinlock = MUTEX_INIT;
 
 	curcore->idle_thread.its = QUANTUM;
 	curcore->idle_thread.rts = QUANTUM;
 
+	curcore->slice_deadline = NO_TIMEOUT;
+	curcore->timer_deadline = NO_TIMEOUT;
+
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
 
@@ -634,6 +2996,7 @@ void run_scheduler()
 
 	/* Finished scheduling */
 	assert(CURTHREAD == &CURCORE.idle_thread);
+	tcb_cache_drain();
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
 }
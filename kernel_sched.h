@@ -84,13 +84,32 @@ typedef enum {
 enum SCHED_CAUSE {
 	SCHED_QUANTUM, /**< @brief The quantum has expired */
 	SCHED_IO, /**< @brief The thread is waiting for I/O */
-	SCHED_MUTEX, /**< @brief @c Mutex_Lock yielded on contention */
+	SCHED_MUTEX, /**< @brief @c Mutex_Lock slept on contention */
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_PREEMPT /**< @brief A thread of higher priority was made ready for this core */
 };
 
+/** @brief The number of values of @c enum SCHED_CAUSE (equal to @c LATENCY_CAUSES) */
+#define SCHED_CAUSES (SCHED_PREEMPT+1)
+
+/**
+  @brief A queued spinlock.
+
+  The kernel uses it for its non-preemptive locks, including the queues of
+  the cores and the lock of the waiters of a @c CondVar. It is not part of 
+  the program API; it is locked by @c spin_lock (see kernel_cc.h).
+
+  @see SPINLOCK_INIT
+  @see spin_lock
+ */
+typedef struct __spin_node* Spinlock;
+
+/** @brief The initial (unlocked) value of a @c Spinlock. */
+#define SPINLOCK_INIT NULL
+
 /**
   @brief The thread control block
 
@@ -120,8 +139,12 @@ typedef struct thread_control_block {
 	Thread_phase phase; /**< @brief The phase of the thread */
 
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
+	size_t stack_size; /**< @brief The size of the thread stack, which lies above the TCB */
+	int stack_guard; /**< @brief Set if there is a guard page between the TCB and the stack */
 
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
+	const char* wchan; /**< @brief The wait channel the thread sleeps at, or NULL */
+	unsigned int trace_id; /**< @brief The id of the thread in the scheduler trace, or 0 if it has none */
 
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler lists */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
@@ -131,6 +154,40 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
   int priority;/***/
+	int last_core; /**< @brief The core this thread last ran on, used as a hint for wakeups */
+	unsigned long migrations; /**< @brief The number of times the thread ran on a different core than the last time */
+	TimerDuration run_time; /**< @brief The time the thread ran on a core, up to its last time-slice */
+	TimerDuration wait_time; /**< @brief The time the thread was ready, waiting for a core */
+	TimerDuration ready_time; /**< @brief When the thread last became ready */
+	unsigned long voluntary_switches; /**< @brief The number of times the thread blocked or yielded the core */
+	unsigned long involuntary_switches; /**< @brief The number of times the thread was switched out by 
+	                                         the expiry of its quantum, or by preemption */
+	uint64_t affinity; /**< @brief Bit @c i is set iff the thread may run on core @c i */
+	int sched_restricted; /**< @brief Set if the thread was counted in CCB::sched_restricted when queued */
+	int sched_core; /**< @brief The core whose ready queues hold the thread, or -1 (set under the 
+	                     @c queue_spinlock of the core) */
+	unsigned int boost_epoch; /**< @brief The value of CCB::boost_epoch when the thread was queued (MLFQ) */
+	int nice; /**< @brief The nice value of the thread, from @c NICE_MIN to @c NICE_MAX */
+
+	TimerDuration vruntime; /**< @brief The virtual runtime, for the fair-share policy */
+	int fair_core; /**< @brief The core whose @c min_vruntime @c vruntime is relative to */
+	unsigned int fair_weight; /**< @brief The weight of the thread, while it is in a @c fair_tree */
+	rbnode fair_node; /**< @brief Node to use when queueing in a @c fair_tree */
+
+	TimerDuration rt_runtime; /**< @brief The real-time budget per period, or 0 */
+	TimerDuration rt_period; /**< @brief The real-time period, or 0 for a thread that is not real-time */
+	TimerDuration rt_reldeadline; /**< @brief The deadline, relative to the start of a period */
+	TimerDuration rt_release; /**< @brief When the current period ends */
+	TimerDuration rt_deadline; /**< @brief The absolute deadline of the current period */
+	TimerDuration rt_budget; /**< @brief The budget left in the current period */
+	TimerDuration rt_overrun; /**< @brief The time used beyond the budget, to be paid from the next period (at most rt_runtime) */
+	unsigned long rt_util; /**< @brief The density of the thread, in millionths of a core */
+	unsigned long rt_misses; /**< @brief The number of periods whose deadline was missed */
+	int rt_missed; /**< @brief Set if the deadline of the current period was missed */
+	int rt_core; /**< @brief The core the real-time thread is assigned to */
+	rbnode rt_node; /**< @brief Node to use when queueing in a @c rt_tree, or in the @c rt_timers of a core */
+
+	Mutex state_spinlock; /**< @brief Protects @c state, @c phase, @c wakeup_time and @c sched_node */
 
 } TCB;
 
@@ -146,6 +203,26 @@ typedef struct thread_control_block {
  *
  ************************/
 
+/** @brief The default number of MLFQ priority queues (levels). */
+#define PRIORITY_QUEUES 3
+
+/** @brief The number of MLFQ priority queues (levels), set at boot time. */
+extern unsigned int sched_levels;
+
+/** @brief The time-slice of each MLFQ level (in usec), set at boot time. */
+extern TimerDuration sched_quantum[MAX_SCHED_LEVELS];
+
+/** @brief A log2 histogram of run-queue latencies, kept by a core.
+
+  @see latencyinfo
+ */
+typedef struct sched_latency {
+	unsigned long count; /**< @brief The number of latencies */
+	unsigned long total; /**< @brief The sum of the latencies (in usec) */
+	unsigned long max; /**< @brief The longest latency (in usec) */
+	unsigned long buckets[LATENCY_BUCKETS]; /**< @brief The histogram */
+} sched_latency;
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
@@ -158,6 +235,55 @@ typedef struct core_control_block {
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 	sig_atomic_t preemption; /**< @brief Marks preemption, used by the locking code */
 
+	rlnode sched_queue[MAX_SCHED_LEVELS]; /**< @brief The core's MLFQ ready queues, one per priority (rotated by boosts) */
+	uint64_t sched_bitmap; /**< @brief Bit @c i is set iff @c sched_queue[i] is not empty */
+	unsigned int sched_count; /**< @brief Number of threads in the core's ready queues */
+	unsigned int sched_restricted; /**< @brief Number of threads in the core's ready queues that may
+	                                    not run on all cores */
+	Spinlock queue_spinlock; /**< @brief Protects @c sched_queue, @c sched_bitmap and @c sched_count */
+	unsigned int boost_epoch; /**< @brief The number of boosts of the queues; the queue of level @c i
+	                               is @c sched_queue[(i - boost_epoch) mod sched_levels] */
+	TimerDuration boost_time; /**< @brief When the next boost of the queues is due */
+	int current_priority; /**< @brief The priority of the running thread, or -1 for the idle thread. 
+	                           It is read by other cores without locking. */
+	TCB* handoff; /**< @brief A thread woken by the running thread and queued at this core, to run 
+	                   when the running thread blocks, or NULL (protected by @c queue_spinlock) */
+	TCB* yield_target; /**< @brief The thread the running thread yields to, taken from the queues */
+	unsigned long migrations; /**< @brief The number of threads that ran on this core after running on another */
+	TimerDuration busy_time; /**< @brief The time the core ran threads other than its idle thread */
+	TimerDuration idle_time; /**< @brief The time the core ran its idle thread */
+	unsigned long switches; /**< @brief The number of context switches of the core */
+	sched_latency latency_level[MAX_SCHED_LEVELS+2]; /**< @brief The run-queue latencies of the threads 
+	                                                      switched in, by the priority they run at */
+	sched_latency latency_cause[SCHED_CAUSES]; /**< @brief The run-queue latencies of the threads switched in, 
+	                                                by the cause for which they last left a core */
+
+	rbtree fair_tree; /**< @brief The ready threads, by virtual runtime, for the fair-share policy */
+	TimerDuration min_vruntime; /**< @brief A lower bound of the virtual runtime of the core's threads */
+	unsigned long fair_load; /**< @brief The total weight of the threads in @c fair_tree */
+	unsigned int fair_running; /**< @brief The weight of the running thread, or 0 */
+	TimerDuration balance_time; /**< @brief When the next load balancing of the core is due */
+
+	rbtree rt_tree; /**< @brief The ready real-time threads, by absolute deadline (protected by @c queue_spinlock) */
+	TimerDuration rt_next; /**< @brief The earliest deadline in @c rt_tree, or @c NO_TIMEOUT. 
+	                            It is read by other cores without locking. */
+	TimerDuration rt_running; /**< @brief The deadline of the running thread, or @c NO_TIMEOUT if it is
+	                               not real-time. It is read by other cores without locking. */
+	rbtree rt_timers; /**< @brief The real-time threads of the core in the timer wheel, by the time their timeout 
+	                       expires (protected by @c queue_spinlock) */
+	TimerDuration rt_timer; /**< @brief The earliest time in @c rt_timers, or @c NO_TIMEOUT. 
+	                             It is read without locking. */
+	unsigned long rt_util; /**< @brief The total density of the real-time threads assigned to the core */
+
+	TimerDuration slice_start; /**< @brief When the current thread was switched in */
+	TimerDuration slice_deadline; /**< @brief When the time-slice of the current thread ends */
+	TimerDuration timer_deadline; /**< @brief When the core timer will fire, or @c NO_TIMEOUT if it is not set */
+
+	rlnode tcb_cache; /**< @brief Free TCB blocks kept by this core for reuse */
+	unsigned int tcb_cache_count; /**< @brief The number of blocks in @c tcb_cache */
+	unsigned long tcb_allocs; /**< @brief The number of thread blocks allocated by threads on this core */
+	unsigned long tcb_reuses; /**< @brief The number of threads created on this core with a cached block */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -199,9 +325,11 @@ extern CCB cctx[MAX_CORES];
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param stack_size The size of the thread stack in bytes, rounded up to 
+                a multiple of the page size. If 0, @c THREAD_STACK_SIZE is used.
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
 
 /**
   @brief Wakeup a blocked thread.
@@ -215,6 +343,23 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a blocked thread, handing off the core to it.
+
+  This is like @c wakeup(), but it is meant for a caller that is likely to
+  block soon, e.g., after waking up a consumer, or a thread that waits for 
+  it to release a resource. Unless the woken thread preempts some core, it
+  is queued at the current core, and it runs on it as soon as the current 
+  thread blocks, ahead of the other queued threads (but not of threads of 
+  higher priority). If the current thread does not block in its time-slice,
+  the hand-off is forgotten. If @c sched_params::no_handoff is set at boot,
+  this is the same as @c wakeup().
+
+  @param tcb the thread to be made @c READY.
+  @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
+*/
+int wakeup_handoff(TCB* tcb);
+
 /** 
   @brief Block the current thread.
 
@@ -247,6 +392,18 @@ int wakeup(TCB* tcb);
    */
 void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
+/** 
+  @brief Block the current thread, releasing a spinlock.
+
+  This is the same as @c sleep_releasing(), except that the spinlock @c sl, 
+  which must not be `NULL`, is released instead of a mutex.
+
+  @see sleep_releasing
+  @see spin_lock
+ */
+void sleep_releasing_spinlock(Thread_state newstate, Spinlock* sl, enum SCHED_CAUSE cause, 
+	TimerDuration timeout);
+
 /**
   @brief Give up the CPU.
 
@@ -256,6 +413,127 @@ void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, T
  */
 void yield(enum SCHED_CAUSE cause);
 
+/**
+  @brief Yield the rest of the time-slice to another thread.
+
+  If @c tcb is ready and waiting in the queues of some core, and it may run 
+  on the current core, it runs at once, on the current core, for the rest 
+  of the time-slice of the current thread, which stays ready. Real-time and
+  gang threads, which are not queued by the scheduling class, are not 
+  yielded to.
+
+  @param tcb the thread to yield to
+  @returns 0 if the thread ran, or -1 if it could not be yielded to
+ */
+int sched_yield_to(TCB* tcb);
+
+/**
+  @brief Set the real-time parameters of the current thread.
+
+  The thread becomes a real-time thread, scheduled by EDF before all other
+  threads, with a budget of @c runtime usec in each period of @c period usec,
+  and a deadline @c deadline usec after the start of each period. If 
+  @c period is 0, the thread stops being real-time.
+
+  The thread is assigned to the core with the least real-time load, if
+  admitting it does not overload the core; else, the call fails. On success, 
+  the thread yields, to move to its new queue.
+
+  @param runtime the budget per period
+  @param period the period, or 0
+  @param deadline the relative deadline, or 0 for a deadline equal to @c period
+  @returns 0 on success, or -1 if the parameters are invalid or the thread
+     is not admitted
+  @see SetRealtime
+ */
+int sched_set_realtime(TimerDuration runtime, TimerDuration period, TimerDuration deadline);
+
+/**
+  @brief Set the nice value of a thread.
+
+  The scheduling class adjusts the priority of the thread accordingly. For
+  a new thread (in state @c INIT), this also sets its starting priority.
+
+  @param tcb the thread
+  @param nice the nice value, from @c NICE_MIN to @c NICE_MAX
+ */
+void sched_set_nice(TCB* tcb, int nice);
+
+/**
+  @brief Set the affinity mask of a thread.
+
+  Bit @c i of @c mask is set iff the thread may run on core @c i; bits of
+  cores that do not exist are ignored. The mask is honoured the next time 
+  the thread is queued; if the current thread is not allowed on its core 
+  any more, it yields, to move to an allowed core.
+
+  @param tcb the thread
+  @param mask the affinity mask
+  @returns 0 on success, or -1 if the mask has no existing core, or the 
+     thread is real-time (and therefore bound to its core)
+ */
+int sched_set_affinity(TCB* tcb, uint64_t mask);
+
+/**
+  @brief Turn gang scheduling of the threads of a process on or off.
+  The threads of a gang run together on the cores, in gang slots. The mode
+  is honoured the next time a thread is queued; if the current thread 
+  belongs to the process, it yields, to move to its new queue.
+  @param pcb the process
+  @param gang non-zero for gang scheduling
+  @see SetGang
+ */
+void sched_set_gang(PCB* pcb, int gang);
+
+/**
+  @brief Return the run time and the wait time of a thread.
+
+  The counters of the thread are completed with its current time-slice, if
+  it is running, or with its current wait, if it is ready. The result is a
+  snapshot, since the thread may be running on another core.
+
+  @param tcb the thread
+  @param run_time where the run time is stored
+  @param wait_time where the wait time is stored
+ */
+void sched_thread_times(TCB* tcb, TimerDuration* run_time, TimerDuration* wait_time);
+
+/**
+  @brief Return 1 if a thread is running on a core, else 0.
+
+  A thread is running if it is the current thread of the core it last ran
+  on. The result is a snapshot, taken without locking.
+
+  @param tcb the thread
+ */
+int sched_thread_running(TCB* tcb);
+
+/**
+  @brief Return the busy time and the idle time of a core.
+
+  Like @c sched_thread_times(), the counters are completed with the current 
+  time-slice of the core.
+
+  @param core the core
+  @param busy_time where the busy time is stored
+  @param idle_time where the idle time is stored
+ */
+void sched_core_times(CCB* core, TimerDuration* busy_time, TimerDuration* idle_time);
+
+/**
+  @brief Merge the run-queue latency histograms of all cores.
+
+  Exactly one of @c level and @c cause must be -1. The histograms are
+  read without stopping the cores.
+
+  @param level a priority level, @c LATENCY_GANG or @c LATENCY_REALTIME, or -1
+  @param cause an @c enum SCHED_CAUSE value, or -1
+  @param info where the merged histogram is stored
+  @returns the number of latencies in the histogram
+  @see OpenLatencyInfo
+ */
+unsigned long sched_latency_read(int level, int cause, latencyinfo* info);
+
 /**
   @brief Enter the scheduler.
 
@@ -269,16 +547,32 @@ void run_scheduler(void);
   @brief Initialize the scheduler.
 
    This function is called during kernel initialization.
+
+   @param params the scheduler parameters given at boot time
  */
-void initialize_scheduler(void);
+void initialize_scheduler(const sched_params* params);
 
 /**
   @brief Quantum (in microseconds) 
 
-  This is the default quantum for each thread, in microseconds.
+  This is the default quantum of the top MLFQ level, in microseconds.
+  Lower levels have longer quanta by default, up to @c MAX_QUANTUM.
   */
 #define QUANTUM (10000L)
 
+/** @brief The longest default quantum, for the lower MLFQ levels (in microseconds) */
+#define MAX_QUANTUM (8*QUANTUM)
+
+/**
+  @brief Timer slack (in microseconds)
+
+  When a new time-slice ends up to this much later than the deadline already
+  programmed into the core timer, the timer is left as is. This saves
+  reprogramming the timer at most context switches, at the cost of slightly
+  shorter time-slices.
+  */
+#define QUANTUM_SLACK (QUANTUM/10)
+
 /** @} */
 
 #endif
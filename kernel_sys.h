@@ -11,10 +11,20 @@ SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadEx, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(ThreadInfo, int, (Tid_t tid, threadinfo* info), (tid, info))\
+SYSCALL(YieldTo, int, (Tid_t tid), (tid))\
+SYSCALL(CoreInfo, int, (unsigned int core, coreinfo* info), (core, info))\
+SYSCALL(SetPriority, int, (Tid_t tid, int nice), (tid, nice))\
+SYSCALL(GetPriority, int, (Tid_t tid, int* nice), (tid, nice))\
+SYSCALL(SetRealtime, int, (const rt_params* params), (params))\
+SYSCALL(SetThreadAffinity, int, (Tid_t tid, cpumask_t mask), (tid, mask))\
+SYSCALL(GetThreadAffinity, int, (Tid_t tid, cpumask_t* mask), (tid, mask))\
+SYSCALL(SetGang, int, (int gang), (gang))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
@@ -29,6 +39,7 @@ SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(OpenLatencyInfo, Fid_t, (), ())\
 
 
 
@@ -146,7 +146,7 @@ void start_thread()
   void* args = CURTHREAD->ptcb->args;
 
   thread_exitval = call(argl,args);
-  sys_ThreadExit(thread_exitval);
+  ThreadExit(thread_exitval);
 }
 
 /** 
@@ -154,9 +154,22 @@ void start_thread()
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
+  return sys_CreateThreadEx(task, argl, args, 0);
+}
+
+/** 
+  @brief Create a new thread in the current process, with the given stack size.
+  */
+Tid_t sys_CreateThreadEx(Task task, int argl, void* args, unsigned int stack_size)
+{
+ if(stack_size != 0 && (stack_size < MIN_STACK_SIZE || stack_size > MAX_STACK_SIZE))
+    return NOTHREAD;
+
  if(task != NULL) {
     PCB* curproc=CURPROC;
-    TCB* tcb = spawn_thread(curproc, start_thread);
+    TCB* tcb = spawn_thread(curproc, start_thread, stack_size);
+    sched_set_nice(tcb, CURTHREAD->nice);
+    tcb->affinity = CURTHREAD->affinity;
   
     //aquiring the newly made ptcb 
     PTCB* ptcb=initialize_PTCB(task,argl,args);
@@ -262,6 +275,16 @@ void sys_ThreadExit(int exitval)
 
   TCB* curthread=CURTHREAD;
 
+  //add the scheduler accounting of the thread to the totals of its process
+  PCB* owner=curthread->owner_pcb;
+  TimerDuration run_time, wait_time;
+  sched_thread_times(curthread, &run_time, &wait_time);
+  owner->run_time+=run_time;
+  owner->wait_time+=wait_time;
+  owner->voluntary_switches+=curthread->voluntary_switches;
+  owner->involuntary_switches+=curthread->involuntary_switches;
+  owner->migrations+=curthread->migrations;
+
   //change the exitval of the ptcb
   curthread->ptcb->exitval=exitval;
   //make the exited flag of the ptcb true
@@ -289,3 +312,130 @@ void sys_ThreadExit(int exitval)
   kernel_sleep(EXITED, SCHED_USER);
 }
 
+
+/**
+  @brief Return scheduling information about a thread.
+  */
+int sys_ThreadInfo(Tid_t tid, threadinfo* info)
+{
+  PTCB* ptcb=(PTCB*) tid;
+  //check whether tid exists in the pcb list of ptcbs and the thread is still alive
+  if(info==NULL||!check_valid_PTCB(ptcb)||ptcb->exited)
+    return -1;
+
+  //the scheduler fields are read without locking, as a snapshot
+  TCB* tcb=ptcb->tcb;
+  int priority=tcb->priority;
+
+  info->tid=tid;
+  info->priority=priority;
+  info->quantum=sched_quantum[priority];
+  info->nice=tcb->nice;
+  info->core=tcb->last_core;
+  info->running=sched_thread_running(tcb);
+  info->migrations=tcb->migrations;
+  TimerDuration run_time, wait_time;
+  sched_thread_times(tcb, &run_time, &wait_time);
+  info->run_time=run_time;
+  info->wait_time=wait_time;
+  info->voluntary_switches=tcb->voluntary_switches;
+  info->involuntary_switches=tcb->involuntary_switches;
+  info->realtime=(tcb->rt_period!=0);
+  info->deadline_misses=tcb->rt_misses;
+
+  return 0;
+}
+
+
+int sys_YieldTo(Tid_t tid)
+{
+  PTCB* ptcb=(PTCB*) tid;
+  if(!check_valid_PTCB(ptcb)||ptcb->exited)
+    return -1;
+
+  return sched_yield_to(ptcb->tcb);
+}
+
+
+int sys_CoreInfo(unsigned int core, coreinfo* info)
+{
+  if(info==NULL||core>=cpu_cores())
+    return -1;
+
+  //the counters are updated by their own core, and read as a snapshot
+  CCB* ccb=&cctx[core];
+  info->core=core;
+  info->migrations=__atomic_load_n(&ccb->migrations, __ATOMIC_RELAXED);
+  TimerDuration busy_time, idle_time;
+  sched_core_times(ccb, &busy_time, &idle_time);
+  info->busy_time=busy_time;
+  info->idle_time=idle_time;
+  info->switches=__atomic_load_n(&ccb->switches, __ATOMIC_RELAXED);
+  info->thread_allocs=__atomic_load_n(&ccb->tcb_allocs, __ATOMIC_RELAXED);
+  info->thread_reuses=__atomic_load_n(&ccb->tcb_reuses, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+
+int sys_SetPriority(Tid_t tid, int nice)
+{
+  PTCB* ptcb=(PTCB*) tid;
+  if(nice<NICE_MIN||nice>NICE_MAX||!check_valid_PTCB(ptcb)||ptcb->exited)
+    return -1;
+
+  sched_set_nice(ptcb->tcb, nice);
+  return 0;
+}
+
+
+int sys_GetPriority(Tid_t tid, int* nice)
+{
+  PTCB* ptcb=(PTCB*) tid;
+  if(nice==NULL||!check_valid_PTCB(ptcb)||ptcb->exited)
+    return -1;
+
+  *nice=ptcb->tcb->nice;
+  return 0;
+}
+
+
+int sys_SetThreadAffinity(Tid_t tid, cpumask_t mask)
+{
+  PTCB* ptcb=(PTCB*) tid;
+  if(!check_valid_PTCB(ptcb)||ptcb->exited)
+    return -1;
+
+  return sched_set_affinity(ptcb->tcb, mask);
+}
+
+
+int sys_GetThreadAffinity(Tid_t tid, cpumask_t* mask)
+{
+  PTCB* ptcb=(PTCB*) tid;
+  if(mask==NULL||!check_valid_PTCB(ptcb)||ptcb->exited)
+    return -1;
+
+  *mask=ptcb->tcb->affinity;
+  return 0;
+}
+
+
+int sys_SetRealtime(const rt_params* params)
+{
+  //a NULL params makes the thread normal again
+  if(params==NULL)
+    return sched_set_realtime(0, 0, 0);
+
+  if(params->period==0)
+    return -1;
+  return sched_set_realtime(params->runtime, params->period, params->deadline);
+}
+
+
+int sys_SetGang(int gang)
+{
+  int old=CURPROC->gang;
+  sched_set_gang(CURPROC, gang!=0);
+  return old;
+}
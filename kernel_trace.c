@@ -0,0 +1,197 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "kernel_trace.h"
+#include "kernel_proc.h"
+
+/**
+	@file kernel_trace.c
+	@brief The implementation of scheduler tracing.
+ */
+
+int trace_enabled = 0;
+
+/* The ring buffer of a core. Only the core itself records events in it. */
+typedef struct trace_ring {
+	trace_event* events;
+	unsigned long head;    /* The number of events recorded */
+} trace_ring;
+
+static trace_ring trace_rings[MAX_CORES];
+static unsigned int trace_cores;
+static const char* trace_path;
+static struct timespec trace_start;
+static unsigned int trace_next_id;
+
+static const char* trace_causes[] = {
+	"quantum", "io", "mutex", "pipe", "poll", "idle", "user", "preempt"
+};
+_Static_assert(sizeof(trace_causes)/sizeof(trace_causes[0]) == SCHED_CAUSES,
+	"trace_causes[] must name every enum SCHED_CAUSE value");
+
+
+void initialize_trace(const char* path)
+{
+	trace_enabled = 0;
+	if (path == NULL)
+		return;
+
+	trace_path = path;
+	trace_cores = cpu_cores();
+	for (unsigned int c = 0; c < trace_cores; c++) {
+		trace_rings[c].events = xmalloc(TRACE_EVENTS * sizeof(trace_event));
+		trace_rings[c].head = 0;
+	}
+	trace_next_id = 0;
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	trace_enabled = 1;
+}
+
+
+unsigned int trace_id(TCB* tcb)
+{
+	if (tcb == NULL || tcb->type == IDLE_THREAD)
+		return 0;
+
+	unsigned int id = __atomic_load_n(&tcb->trace_id, __ATOMIC_RELAXED);
+	if (id == 0) {
+		/* Another core may assign an id at the same time; the first one wins */
+		unsigned int new_id = __atomic_add_fetch(&trace_next_id, 1, __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&tcb->trace_id, &id, new_id, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			id = new_id;
+	}
+	return id;
+}
+
+
+void trace_record(trace_type type, TCB* tcb, unsigned int other, int cause, const char* wchan)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	/* Reserve a slot; an interrupt handler on this core may record in between */
+	trace_ring* ring = &trace_rings[cpu_core_id];
+	unsigned long slot = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	trace_event* e = &ring->events[slot & (TRACE_EVENTS-1)];
+
+	e->ns = (uint64_t)(t.tv_sec - trace_start.tv_sec) * 1000000000ull
+		+ t.tv_nsec - trace_start.tv_nsec;
+	e->wchan = wchan;
+	e->tid = trace_id(tcb);
+	e->other = other;
+	e->pid = (tcb != NULL && tcb->type != IDLE_THREAD) ? get_pid(tcb->owner_pcb) : 0;
+	e->type = type;
+	e->cause = cause;
+}
+
+
+/* Helpers for the JSON output */
+
+static void trace_json_thread(FILE* f, const trace_event* e)
+{
+	if (e->tid == 0)
+		fprintf(f, "\"thread\":\"idle\"");
+	else
+		fprintf(f, "\"thread\":%u,\"pid\":%d", e->tid, e->pid);
+}
+
+static void trace_json_instant(FILE* f, unsigned int core, const trace_event* e, const char* name)
+{
+	fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":0,\"tid\":%u,\"args\":{",
+		name, e->ns / 1000.0, core);
+	switch (e->type) {
+	case TRACE_BOOST:
+		break;
+	case TRACE_BLOCK:
+		trace_json_thread(f, e);
+		fprintf(f, ",\"cause\":\"%s\"", trace_causes[e->cause]);
+		if (e->wchan != NULL)
+			fprintf(f, ",\"wchan\":\"%s\"", e->wchan);
+		break;
+	case TRACE_MIGRATE:
+		trace_json_thread(f, e);
+		fprintf(f, ",\"from_core\":%u", e->other);
+		break;
+	default:
+		trace_json_thread(f, e);
+	}
+	fprintf(f, "}}");
+}
+
+/*
+  Each core is a track (tid) of process 0. The run of a thread on a core
+  is a complete ("X") event, from its switch in to its switch out; the
+  idle thread is not shown, so that idle gaps show as empty space.
+*/
+static void trace_json_core(FILE* f, unsigned int core, uint64_t end)
+{
+	trace_ring* ring = &trace_rings[core];
+	unsigned long head = ring->head;
+	unsigned long first = (head > TRACE_EVENTS) ? head - TRACE_EVENTS : 0;
+
+	fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"core %u\"}}",
+		core, core);
+
+	/* The thread running on the core, since when */
+	const trace_event* run = NULL;
+	for (unsigned long i = first; i < head; i++) {
+		const trace_event* e = &ring->events[i & (TRACE_EVENTS-1)];
+		switch (e->type) {
+		case TRACE_SWITCH:
+			if (run != NULL && run->tid != 0)
+				fprintf(f, ",\n{\"name\":\"T%u (pid %d)\",\"cat\":\"run\",\"ph\":\"X\",\"ts\":%.3f,"
+					"\"dur\":%.3f,\"pid\":0,\"tid\":%u,\"args\":{\"end_cause\":\"%s\"}}",
+					run->tid, run->pid, run->ns / 1000.0, (e->ns - run->ns) / 1000.0, core,
+					trace_causes[e->cause]);
+			run = e;
+			break;
+		case TRACE_WAKEUP: trace_json_instant(f, core, e, "wakeup"); break;
+		case TRACE_BLOCK: trace_json_instant(f, core, e, "block"); break;
+		case TRACE_MIGRATE: trace_json_instant(f, core, e, "migrate"); break;
+		case TRACE_BOOST: trace_json_instant(f, core, e, "boost"); break;
+		case TRACE_EXIT: trace_json_instant(f, core, e, "exit"); break;
+		}
+	}
+	if (run != NULL && run->tid != 0 && end > run->ns)
+		fprintf(f, ",\n{\"name\":\"T%u (pid %d)\",\"cat\":\"run\",\"ph\":\"X\",\"ts\":%.3f,"
+			"\"dur\":%.3f,\"pid\":0,\"tid\":%u}",
+			run->tid, run->pid, run->ns / 1000.0, (end - run->ns) / 1000.0, core);
+}
+
+
+void trace_dump()
+{
+	if (! trace_enabled)
+		return;
+	trace_enabled = 0;
+
+	/* The end of the trace is its last event */
+	uint64_t end = 0;
+	for (unsigned int c = 0; c < trace_cores; c++) {
+		trace_ring* ring = &trace_rings[c];
+		if (ring->head > 0) {
+			uint64_t ns = ring->events[(ring->head - 1) & (TRACE_EVENTS-1)].ns;
+			if (ns > end) end = ns;
+		}
+	}
+
+	FILE* f = fopen(trace_path, "w");
+	if (f == NULL) {
+		perror("tinyos: cannot write the trace");
+	} else {
+		fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+			"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"cores\"}}");
+		for (unsigned int c = 0; c < trace_cores; c++)
+			trace_json_core(f, c, end);
+		fprintf(f, "\n]}\n");
+		fclose(f);
+	}
+
+	for (unsigned int c = 0; c < trace_cores; c++) {
+		free(trace_rings[c].events);
+		trace_rings[c].events = NULL;
+	}
+}
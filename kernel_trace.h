@@ -0,0 +1,129 @@
+#ifndef __KERNEL_TRACE_H
+#define __KERNEL_TRACE_H
+
+#include <stdint.h>
+#include "kernel_sched.h"
+
+/**
+	@file kernel_trace.h
+	@brief Tracing of scheduler events.
+
+	@defgroup trace Tracing.
+	@ingroup kernel
+	@brief Tracing of scheduler events.
+
+	When tracing is on, the scheduler records its events (context switches,
+	wakeups, blocks, migrations, boosts and thread exits) in a ring buffer
+	per core. A slot of the ring is reserved by an atomic increment, so that
+	a core never waits to record, even if it records from an interrupt handler.
+	When the ring is full, the oldest events are overwritten.
+
+	After the simulated computer halts, the events are written to a file in
+	the Chrome trace-event JSON format, which can be opened by a trace viewer
+	(e.g., ui.perfetto.dev, or chrome://tracing). Each core is shown as a
+	track, with a slice for each time a thread ran on it.
+
+	When tracing is off, each trace point costs a single branch.
+
+	@see sched_params
+	@{
+*/
+
+/** @brief The number of events kept by the ring buffer of each core. Must be a power of 2. */
+#define TRACE_EVENTS (1 << 16)
+
+/** @brief The types of trace events. */
+typedef enum trace_type {
+	TRACE_SWITCH,   /**< @brief A thread was switched in, replacing another */
+	TRACE_WAKEUP,   /**< @brief A thread was made ready */
+	TRACE_BLOCK,    /**< @brief A thread blocked */
+	TRACE_MIGRATE,  /**< @brief A thread ran on a core other than the one it last ran on */
+	TRACE_BOOST,    /**< @brief The ready queues of a core were boosted */
+	TRACE_EXIT      /**< @brief A thread exited */
+} trace_type;
+
+/** @brief A trace event. */
+typedef struct trace_event {
+	uint64_t ns;           /**< @brief The time of the event, in nsec since tracing started */
+	const char* wchan;     /**< @brief The wait channel of a blocked thread, or NULL */
+	unsigned int tid;      /**< @brief The trace id of the thread, or 0 for the idle thread */
+	unsigned int other;    /**< @brief The trace id of the thread switched out (@c TRACE_SWITCH),
+	                            or the core the thread last ran on (@c TRACE_MIGRATE) */
+	int pid;               /**< @brief The pid of the process of the thread */
+	uint8_t type;          /**< @brief The @c trace_type of the event */
+	uint8_t cause;         /**< @brief The @c SCHED_CAUSE of a block, or of the switch out */
+} trace_event;
+
+/** @brief Set while tracing is on. */
+extern int trace_enabled;
+
+/** @brief The branch that guards every trace point. */
+#define TRACE_ON __builtin_expect(trace_enabled, 0)
+
+/**
+	@brief Start tracing.
+
+	This is called once at boot, by core 0, before the scheduler is initialized.
+	If @c path is @c NULL, tracing stays off.
+
+	@param path the file where the trace will be written
+ */
+void initialize_trace(const char* path);
+
+/**
+	@brief Write the trace to its file, and stop tracing.
+
+	This is called after the simulated computer has halted.
+ */
+void trace_dump();
+
+/**
+	@brief Record an event in the ring buffer of the current core.
+
+	This should not be called directly; use the @c trace_* helpers,
+	which test @c TRACE_ON first.
+ */
+void trace_record(trace_type type, TCB* tcb, unsigned int other, int cause, const char* wchan);
+
+/** @brief Return the trace id of a thread, assigning one on first use. */
+unsigned int trace_id(TCB* tcb);
+
+/** @brief Trace the switch from @c prev to @c next, where @c prev left for @c cause. */
+static inline void trace_switch(TCB* prev, TCB* next, enum SCHED_CAUSE cause)
+{
+	if (TRACE_ON) trace_record(TRACE_SWITCH, next, trace_id(prev), cause, NULL);
+}
+
+/** @brief Trace a thread made ready. */
+static inline void trace_wakeup(TCB* tcb)
+{
+	if (TRACE_ON) trace_record(TRACE_WAKEUP, tcb, 0, 0, NULL);
+}
+
+/** @brief Trace a thread that blocks for @c cause, at wait channel @c wchan (which may be NULL). */
+static inline void trace_block(TCB* tcb, enum SCHED_CAUSE cause, const char* wchan)
+{
+	if (TRACE_ON) trace_record(TRACE_BLOCK, tcb, 0, cause, wchan);
+}
+
+/** @brief Trace a thread that runs on the current core, after running on core @c from. */
+static inline void trace_migrate(TCB* tcb, int from)
+{
+	if (TRACE_ON) trace_record(TRACE_MIGRATE, tcb, from, 0, NULL);
+}
+
+/** @brief Trace a boost of the ready queues of the current core. */
+static inline void trace_boost()
+{
+	if (TRACE_ON) trace_record(TRACE_BOOST, NULL, 0, 0, NULL);
+}
+
+/** @brief Trace the exit of a thread. */
+static inline void trace_exit(TCB* tcb)
+{
+	if (TRACE_ON) trace_record(TRACE_EXIT, tcb, 0, 0, NULL);
+}
+
+/** @} */
+
+#endif
@@ -4,7 +4,11 @@
 #include <string.h>
 #include <time.h>
 #include <setjmp.h>
+#include <math.h>
+#include <unistd.h>
 #include "util.h"
+#include "bios.h"
+#include "kernel_cc.h"
 
 #include "unit_testing.h"
 
@@ -128,8 +132,10 @@ BARE_TEST(test_list_queue,
 	while(! is_rlist_empty(&L)) {
 		rlnode* p = rlist_pop_back(&L);
 		ASSERT(I==p);
+		ASSERT(p->next==p && p->prev==p);
 		I++;
 	}
+	ASSERT(I==n+10);
 
 	ASSERT(is_rlist_empty(&L));
 
@@ -266,6 +272,133 @@ TEST_SUITE(rlist_tests,
 
 
 
+/* Unit tests for the red-black trees */
+
+/* 
+	Check the red-black properties of the subtree of n, and return its black height,
+	or -1 if a property is violated.
+ */
+static int rbtree_check(rbnode* n, rbnode* parent)
+{
+	if(n == NULL) return 0;
+	if(n->parent != parent) return -1;
+	if(n->red && ((n->left && n->left->red) || (n->right && n->right->red))) return -1;
+	if(n->left && n->left->key > n->key) return -1;
+	if(n->right && n->right->key < n->key) return -1;
+	int hl = rbtree_check(n->left, n);
+	int hr = rbtree_check(n->right, n);
+	if(hl < 0 || hl != hr) return -1;
+	return hl + (n->red ? 0 : 1);
+}
+
+/* Check the tree and its in-order traversal */
+static int rbtree_valid(rbtree* T)
+{
+	if(T->root && T->root->red) return 0;
+	if(rbtree_check(T->root, NULL) < 0) return 0;
+
+	size_t count = 0;
+	rbnode* prev = NULL;
+	for(rbnode* n = rbtree_first(T); n != NULL; n = rbtree_next(n)) {
+		if(prev && (prev->key > n->key || rbtree_prev(n) != prev)) return 0;
+		prev = n;
+		count++;
+	}
+	return count == T->size && prev == rbtree_last(T);
+}
+
+
+BARE_TEST(test_rbtree_insert_remove,
+	"Test inserting and removing nodes in random order, checking the red-black\n"
+	"properties and the order of the nodes."
+	)
+{
+	const int N = 1000;
+	rbnode nodes[N];
+	rbtree T;
+	rbtree_init(&T);
+	ASSERT(is_rbtree_empty(&T));
+	ASSERT(rbtree_first(&T)==NULL && rbtree_last(&T)==NULL);
+
+	srand(1);
+	for(int i=0; i<N; i++) {
+		rbnode_init(&nodes[i], NULL)->key = rand() % (N/2);
+		nodes[i].num = i;
+		rbtree_insert(&T, &nodes[i]);
+	}
+	ASSERT(T.size == N);
+	ASSERT(rbtree_valid(&T));
+
+	/* Remove every other node, in scattered order */
+	for(int i=0; i<N; i+=2) {
+		rbtree_remove(&T, &nodes[(i*389) % N]);
+	}
+	ASSERT(T.size == N/2);
+	ASSERT(rbtree_valid(&T));
+
+	/* Remove the rest, smallest first */
+	while(! is_rbtree_empty(&T)) {
+		rbnode* n = rbtree_first(&T);
+		rbtree_remove(&T, n);
+		ASSERT(n->parent == NULL && n->left == NULL && n->right == NULL);
+		if(T.size % 50 == 0) ASSERT(rbtree_valid(&T));
+	}
+	ASSERT(T.size == 0 && rbtree_first(&T)==NULL);
+}
+
+
+BARE_TEST(test_rbtree_equal_keys,
+	"Test that nodes with equal keys are kept in insertion order."
+	)
+{
+	const int N = 100;
+	rbnode nodes[N];
+	rbtree T;
+	rbtree_init(&T);
+
+	for(int i=0; i<N; i++) {
+		rbnode_init(&nodes[i], NULL)->key = i % 3;
+		nodes[i].num = i;
+		rbtree_insert(&T, &nodes[i]);
+	}
+	ASSERT(rbtree_valid(&T));
+	ASSERT(rbtree_first(&T) == &nodes[0]);
+	int lastidx = N-1;
+	while(lastidx % 3 != 2) lastidx--;
+	ASSERT(rbtree_last(&T) == &nodes[lastidx]);
+
+	/* Within each key, the nodes come in insertion order */
+	intptr_t last[3] = { -1, -1, -1 };
+	for(rbnode* n = rbtree_first(&T); n != NULL; n = rbtree_next(n)) {
+		ASSERT(n->num > last[n->key]);
+		last[n->key] = n->num;
+	}
+
+	/* Popping the first node is a FIFO queue, for equal keys */
+	rbtree_init(&T);
+	for(int i=0; i<N; i++) {
+		rbnode_init(&nodes[i], NULL)->key = 7;
+		nodes[i].num = i;
+		rbtree_insert(&T, &nodes[i]);
+	}
+	for(int i=0; i<N; i++) {
+		rbnode* n = rbtree_first(&T);
+		ASSERT(n->num == i);
+		rbtree_remove(&T, n);
+	}
+	ASSERT(is_rbtree_empty(&T));
+}
+
+
+TEST_SUITE(rbtree_tests,
+	"Tests for the red-black trees")
+{
+	&test_rbtree_insert_remove,
+	&test_rbtree_equal_keys,
+	NULL
+};
+
+
 void test_argv(size_t argc, const char* argv[])
 {
 	int l = argvlen(argc, argv);
@@ -544,12 +677,154 @@ TEST_SUITE(exception_tests,
 
 
 
+/* Benchmarks of the kernel primitives, run on the cores of the VM */
+
+/* The state of the lock benchmark; each core of the VM runs lockbench_core() */
+static Spinlock lockbench_spinlock;
+static Mutex lockbench_mutex;
+static int lockbench_queued;
+static unsigned int lockbench_rounds;
+static volatile unsigned long lockbench_counter;
+static struct timespec lockbench_start[MAX_CORES], lockbench_end[MAX_CORES];
+
+static void lockbench_core()
+{
+	int preempt = preempt_off;
+	cpu_core_barrier_sync();
+	clock_gettime(CLOCK_MONOTONIC, &lockbench_start[cpu_core_id]);
+
+	for (unsigned int i = 0; i < lockbench_rounds; i++) {
+		if (lockbench_queued) {
+			spin_lock(&lockbench_spinlock);
+			lockbench_counter++;
+			spin_unlock(&lockbench_spinlock);
+		} else {
+			Mutex_Lock(&lockbench_mutex);
+			lockbench_counter++;
+			Mutex_Unlock(&lockbench_mutex);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &lockbench_end[cpu_core_id]);
+	if (preempt) preempt_on;
+}
+
+/* Return the average time of an acquisition, in nsec, from the first core that starts to the last one that ends */
+static double lockbench(int queued, unsigned int cores, unsigned int rounds)
+{
+	lockbench_spinlock = SPINLOCK_INIT;
+	lockbench_mutex = MUTEX_INIT;
+	lockbench_queued = queued;
+	lockbench_rounds = rounds;
+	lockbench_counter = 0;
+
+	vm_boot(lockbench_core, cores, 0);
+	if (lockbench_counter != (unsigned long) cores * rounds)
+		return -1.0;
+
+	double start = INFINITY, end = 0.0;
+	for (unsigned int c = 0; c < cores; c++) {
+		start = fmin(start, 1E9*lockbench_start[c].tv_sec + lockbench_start[c].tv_nsec);
+		end = fmax(end, 1E9*lockbench_end[c].tv_sec + lockbench_end[c].tv_nsec);
+	}
+	return (end - start) / ((double) cores * rounds);
+}
+
+BARE_TEST(test_spinlock_scaling,
+	"Test the queued spinlocks of the kernel, and report the time of an acquisition\n"
+	"under contention by 1 to 32 cores, for queued spinlocks and for mutexes\n"
+	"locked with preemption off. Where each core has a host cpu of its own, check\n"
+	"that the time of a queued acquisition does not grow past that of 2 cores."
+	)
+{
+	const unsigned int rounds = 20000;
+	long host_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double contended = 0.0;
+
+	MSG("cores   spin_lock(ns)   Mutex_Lock(ns)\n");
+	for (unsigned int cores = 1; cores <= MAX_CORES; cores *= 2) {
+		double queued = lockbench(1, cores, rounds);
+		double mutex = lockbench(0, cores, rounds);
+		ASSERT(queued >= 0.0 && mutex >= 0.0);
+		MSG("%5u   %13.1f   %14.1f\n", cores, queued, mutex);
+
+		/* 
+		  With fewer host cpus, the lock is passed to cores that the host has
+		  descheduled, and the time is up to the host scheduler.
+		 */
+		if (cores == 2)
+			contended = queued;
+		else if (cores > 2 && cores <= host_cpus)
+			ASSERT_MSG(queued <= 2.0*contended, 
+				"%u cores: %.1f nsec per acquisition, %.1f nsec for 2 cores\n", 
+				cores, queued, contended);
+	}
+	if (host_cpus < MAX_CORES)
+		MSG("The host has %ld cpus; the scaling is not checked for more cores.\n", host_cpus);
+}
+
+
+/* The contexts for the ping-pong benchmark */
+static cpu_context_t pingpong_main, pingpong_ctx;
+static volatile unsigned long pingpong_count;
+
+static void pingpong_func()
+{
+	while(1) {
+		pingpong_count++;
+		cpu_swap_context(&pingpong_ctx, &pingpong_main);
+	}
+}
+
+BARE_TEST(test_cpu_swap_context,
+	"Test that cpu_swap_context switches correctly between two contexts, and\n"
+	"report the context switch latency, measured by a ping-pong benchmark."
+	)
+{
+	const size_t stack_size = 128*1024;
+	void* stack = malloc(stack_size);
+	ASSERT(stack != NULL);
+
+	cpu_initialize_context(&pingpong_ctx, stack, stack_size, pingpong_func);
+	pingpong_count = 0;
+
+	const unsigned long N = 1000000;
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for(unsigned long i=0; i<N; i++) {
+		unsigned long prev = pingpong_count;
+		cpu_swap_context(&pingpong_main, &pingpong_ctx);
+		ASSERT(pingpong_count == prev+1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	double ns = 1E9*(t2.tv_sec-t1.tv_sec) + (t2.tv_nsec-t1.tv_nsec);
+	MSG("%.1f nsec per context switch\n", ns/(2*N));
+
+	free(stack);
+}
+
+
+
+TEST_SUITE(kernel_tests,
+	"Tests and benchmarks of the low-level primitives of the kernel.")
+{
+	&test_spinlock_scaling,
+	&test_cpu_swap_context,
+	NULL
+};
+
+
+
+
 TEST_SUITE(all_tests,
 	"All tests")
 {
 	&rlist_tests,
+	&rbtree_tests,
 	&test_pack_unpack,
 	&exception_tests,	
+	&kernel_tests,
 	NULL
 };
 
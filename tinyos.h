@@ -76,7 +76,7 @@ typedef uintptr_t Tid_t;
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef uintptr_t Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -92,7 +92,9 @@ typedef char Mutex;
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the locking thread spins for a while, as long as
+  the owner of the mutex runs on another core, and then sleeps until the mutex is handed 
+  off to it; waiters get the mutex in FIFO order.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -122,7 +124,7 @@ void Mutex_Unlock(Mutex*);
  */
 typedef struct {
   void *waitset;        /**< The set of waiting threads */
-  Mutex waitset_lock;   /**< A mutex to protect `waitset` */
+  void *waitset_lock;   /**< Used by the kernel to protect `waitset` */
 } CondVar;
 
 
@@ -133,7 +135,7 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#define COND_INIT ((CondVar){ NULL, NULL })
 
 
 /** @brief Wait on a condition variable. 
@@ -319,6 +321,37 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+
+/** @brief The minimum stack size for @c CreateThreadEx */
+#define MIN_STACK_SIZE (16*1024)
+
+/** @brief The maximum stack size for @c CreateThreadEx */
+#define MAX_STACK_SIZE (64*1024*1024)
+
+/** 
+  @brief Create a new thread in the current process, with the given stack size.
+
+  This is the same as @c CreateThread, except that the caller chooses the
+  size of the stack of the new thread. The stack memory is reserved, but
+  it only consumes memory as it is used. A small stack can be used for
+  threads that mostly sleep, while a large stack can be used for deep
+  recursion.
+
+  @param task a function to execute
+  @param argl the integer argument of the thread
+  @param args the pointer argument of the thread
+  @param stack_size the size of the stack in bytes, which is rounded up 
+     to a multiple of the page size. If it is 0, the default stack size 
+     is used.
+  @returns the Tid of the new thread, or @c NOTHREAD on error. Possible errors:
+    - @c task is @c NULL
+    - @c stack_size is not 0 and it is less than @c MIN_STACK_SIZE or greater
+      than @c MAX_STACK_SIZE
+
+  @see CreateThread
+  */
+Tid_t CreateThreadEx(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -374,6 +407,238 @@ int ThreadDetach(Tid_t tid);
   */
 void ThreadExit(int exitval);
 
+/**
+  @brief Give the rest of the time-slice of the current thread to another thread.
+
+  If thread @c tid is ready to run, but waits for a core, it runs at once 
+  on the core of the caller, ahead of any other waiting thread, for the 
+  rest of the caller's time-slice. The caller stays ready, and runs again
+  after it. This is useful when the caller waits for a result of @c tid, or
+  has just handed work to it. Real-time threads, and threads of a process in
+  gang mode, are scheduled on their own terms and cannot be yielded to.
+
+  Note that the kernel does the same, implicitly, when a thread wakes up 
+  another thread (by @c Cond_Signal, or by writing to a pipe) and then 
+  blocks: the woken thread takes over the core.
+
+  @param tid the thread to run, which must belong to the current process
+  @returns 0 if @c tid ran, and -1 otherwise. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the thread has exited.
+    - the thread is running, or blocked, or it may not run on the current core.
+  */
+int YieldTo(Tid_t tid);
+
+/**
+  @brief Scheduling information about a thread.
+
+  @see ThreadInfo
+  */
+typedef struct threadinfo {
+  Tid_t tid;              /**< @brief The tid of the thread */
+  int priority;           /**< @brief The current priority level of the thread, 
+                               where 0 is the lowest priority */
+  int nice;               /**< @brief The nice value of the thread */
+  int core;               /**< @brief The core the thread runs on, or last ran on */
+  int running;            /**< @brief Set if the thread is running on @c core now */
+  unsigned long migrations;  /**< @brief The number of times the thread started running 
+                                  on a core other than the one it last ran on */
+  unsigned long run_time;    /**< @brief The time (in usec) the thread ran on a core */
+  unsigned long wait_time;   /**< @brief The time (in usec) the thread was ready, waiting 
+                                  for a core */
+  unsigned long voluntary_switches;    /**< @brief The number of times the thread blocked or 
+                                            yielded its core */
+  unsigned long involuntary_switches;  /**< @brief The number of times the thread was switched 
+                                            out at the end of its quantum, or was preempted */
+  unsigned long quantum;  /**< @brief The time-slice (in usec) of the thread at its 
+                               current priority level */
+  int realtime;           /**< @brief Set if the thread is real-time 
+                               @see SetRealtime */
+  unsigned long deadline_misses;  /**< @brief The number of periods in which the 
+                                       real-time thread missed its deadline */
+} threadinfo;
+
+/**
+  @brief Return scheduling information about a thread.
+
+  The information is a snapshot; it may change as soon as the call returns.
+
+  @param tid the thread, which must belong to the current process
+  @param info the location where the information is stored
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the thread has exited.
+    - @c info is @c NULL.
+  */
+int ThreadInfo(Tid_t tid, threadinfo* info);
+
+/**
+  @brief Scheduling information about a core.
+
+  @see CoreInfo
+  */
+typedef struct coreinfo {
+  unsigned int core;         /**< @brief The core number */
+  unsigned long migrations;  /**< @brief The number of times a thread started running on 
+                                  this core, after it last ran on another core */
+  unsigned long busy_time;   /**< @brief The time (in usec) the core ran threads */
+  unsigned long idle_time;   /**< @brief The time (in usec) the core was idle */
+  unsigned long switches;    /**< @brief The number of context switches on this core */
+  unsigned long thread_allocs;  /**< @brief The number of thread blocks (TCB and stack) 
+                                     allocated by the threads of this core */
+  unsigned long thread_reuses;  /**< @brief The number of threads created on this core with 
+                                     a block recycled from an exited thread */
+} coreinfo;
+
+/**
+  @brief Return scheduling information about a core.
+
+  The counters are cumulative since boot, and they are read without 
+  stopping the core.
+
+  @param core the core number, from 0 to the number of cores minus 1
+  @param info the location where the information is stored
+  @returns 0 on success and -1 on error. Possible errors are:
+    - the core does not exist.
+    - @c info is @c NULL.
+  */
+int CoreInfo(unsigned int core, coreinfo* info);
+
+/** @brief The lowest nice value, which gives a thread the largest share of the cpu */
+#define NICE_MIN (-20)
+
+/** @brief The highest nice value, which gives a thread the smallest share of the cpu */
+#define NICE_MAX 19
+
+/**
+  @brief Set the nice value of a thread.
+
+  The nice value of a thread determines its share of the cpu, relative
+  to other threads. Under the fair-share policy, each step of the nice value 
+  changes the share by about 25%. Under the MLFQ policy, a negative nice value
+  raises the lowest level the thread can be demoted to, and a positive one 
+  lowers the highest level it can reach, by I/O or by boosts; thus, a thread 
+  of nice 19 never competes with threads above the bottom level. The nice 
+  value also biases the starting level of new threads. A new thread starts 
+  with the nice value of the thread that created it (by @c CreateThread or 
+  @c Exec).
+
+  @param tid the thread, which must belong to the current process
+  @param nice the new nice value, from @c NICE_MIN to @c NICE_MAX
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the thread has exited.
+    - @c nice is out of range.
+  @see SCHED_POLICY_FAIR
+  */
+int SetPriority(Tid_t tid, int nice);
+
+/**
+  @brief Get the nice value of a thread.
+
+  @param tid the thread, which must belong to the current process
+  @param nice the location where the nice value is stored
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the thread has exited.
+    - @c nice is @c NULL.
+  @see SetPriority
+  */
+int GetPriority(Tid_t tid, int* nice);
+
+/**
+  @brief A set of cores, where bit @c i is set iff core @c i is in the set.
+
+  @see SetThreadAffinity
+  */
+typedef uint64_t cpumask_t;
+
+/**
+  @brief Set the cores a thread may run on.
+
+  The thread will only be scheduled on the cores of @c mask; bits of cores 
+  that do not exist are ignored. A new mask takes effect the next time the 
+  thread is queued for execution, which, for the calling thread, is at once. 
+  A new thread starts with the affinity mask of the thread that created it 
+  (by @c CreateThread or @c Exec); initially, threads may run on all cores.
+
+  @param tid the thread, which must belong to the current process
+  @param mask the set of allowed cores
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the thread has exited.
+    - @c mask contains no existing core.
+    - the thread is real-time, and therefore bound to one core.
+  @see GetThreadAffinity
+  */
+int SetThreadAffinity(Tid_t tid, cpumask_t mask);
+
+/**
+  @brief Get the cores a thread may run on.
+
+  @param tid the thread, which must belong to the current process
+  @param mask the location where the set of allowed cores is stored
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the thread has exited.
+    - @c mask is @c NULL.
+  @see SetThreadAffinity
+  */
+int GetThreadAffinity(Tid_t tid, cpumask_t* mask);
+
+/**
+  @brief Real-time parameters of a thread, in usec.
+
+  @see SetRealtime
+  */
+typedef struct rt_params {
+  unsigned long runtime;   /**< @brief The cpu time the thread may use in each period */
+  unsigned long period;    /**< @brief The length of a period */
+  unsigned long deadline;  /**< @brief The deadline, relative to the start of a period.
+                                If 0, the deadline is the end of the period. */
+} rt_params;
+
+/**
+  @brief Make the current thread a real-time thread, or a normal one again.
+
+  Real-time threads are scheduled by earliest deadline first (EDF), ahead of
+  all other threads, regardless of the scheduling policy. In each period, a 
+  real-time thread may use up to @c runtime usec of cpu time; when it has used
+  it up, it waits until its next period. A period starts when the thread is 
+  ready after the end of its previous period, and the work of the period is 
+  due @c deadline usec after its start. A period in which the thread runs past 
+  its deadline is counted as a deadline miss, reported by @c ThreadInfo.
+
+  The call is subject to admission control: each real-time thread is assigned
+  to one core, and it is admitted only if the real-time threads of that core 
+  can meet their deadlines, leaving some time to the other threads. Real-time
+  parameters are not inherited by new threads. Periods and deadlines have a 
+  resolution of about 1 msec.
+
+  @param params the real-time parameters, or NULL to make the thread normal again
+  @returns 0 on success and -1 on error. Possible errors are:
+    - @c runtime is 0, or @c runtime > @c deadline, or @c deadline > @c period.
+    - admitting the thread would overload the cores.
+  @see ThreadInfo
+  */
+int SetRealtime(const rt_params* params);
+
+/**
+  @brief Turn gang scheduling of the current process on or off.
+
+  The threads of a process in gang mode are co-scheduled: they run together,
+  on as many cores as there are ready threads of the process, in time slots
+  shared in turn with the other processes in gang mode and with the rest of 
+  the threads. This suits tightly coupled threads, which synchronize often 
+  (e.g., by @c BarrierSync); a thread then rarely waits for another thread 
+  that is not running. Real-time threads of the process are not affected.
+  Gang mode is not inherited by child processes.
+
+  @param gang non-zero to turn gang mode on, 0 to turn it off
+  @returns 1 if gang mode was on before the call, else 0
+  */
+int SetGang(int gang);
+
 
 
 /*******************************************
@@ -723,6 +988,18 @@ typedef struct procinfo
   int alive;      /**< @brief Non-zero if process is alive, zero if process is zombie. */
 	
   unsigned long thread_count; /**< Current no of threads. */
+
+  unsigned long run_time;   /**< @brief The time (in usec) the threads of the process ran 
+                                 on a core. */
+  unsigned long wait_time;  /**< @brief The time (in usec) the threads of the process were 
+                                 ready, waiting for a core. */
+  unsigned long voluntary_switches;    /**< @brief The number of times the threads of the 
+                                            process blocked or yielded their core. */
+  unsigned long involuntary_switches;  /**< @brief The number of times the threads of the 
+                                            process were switched out at the end of their 
+                                            quantum, or were preempted. */
+  unsigned long migrations; /**< @brief The number of times the threads of the process started 
+                                 running on a core other than the one they last ran on. */
 	
   Task main_task;  /**< @brief The main task of the process. */
 	
@@ -760,6 +1037,63 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/** @brief The number of buckets of a @c latencyinfo histogram. */
+#define LATENCY_BUCKETS 24
+
+/** @brief The number of causes for which @c latencyinfo records are kept. */
+#define LATENCY_CAUSES 8
+
+/** @brief The @c latencyinfo level of gang threads. @see SetGang */
+#define LATENCY_GANG MAX_SCHED_LEVELS
+
+/** @brief The @c latencyinfo level of real-time threads. @see SetRealtime */
+#define LATENCY_REALTIME (MAX_SCHED_LEVELS+1)
+
+/**
+  @brief A histogram of the run-queue latency of threads.
+
+  The run-queue latency is the time from when a thread becomes ready, until it 
+  starts running on a core. Bucket 0 counts the latencies under 1 usec, and 
+  bucket @c i>0 those from @c 2^(i-1) up to @c 2^i usec; the last bucket also 
+  counts all longer latencies.
+
+  A record holds the latencies of the threads of a priority level, or the
+  latencies of the threads that left their core for a cause. The causes are 
+  0: the end of the quantum, 1: I/O, 2: a contended mutex, 3: a pipe or socket,
+  4: polling, 5: idle, 6: a call of the thread (e.g. @c Cond_Wait), 7: preemption.
+
+  @see OpenLatencyInfo
+  */
+typedef struct latencyinfo
+{
+  int level;   /**< @brief The priority level of the threads, @c LATENCY_GANG, 
+                    @c LATENCY_REALTIME, or -1 if the record is by cause */
+  int cause;   /**< @brief The cause for which the threads last left their core, 
+                    or -1 if the record is by level */
+  unsigned long count;     /**< @brief The number of latencies */
+  unsigned long total;     /**< @brief The sum of the latencies (in usec) */
+  unsigned long max;       /**< @brief The longest latency (in usec) */
+  unsigned long buckets[LATENCY_BUCKETS];  /**< @brief The log2 histogram of the latencies */
+} latencyinfo;
+
+
+/**
+	@brief Open a run-queue latency stream.
+
+	This is a read-only stream that returns a sequence of @c latencyinfo 
+	structures, each packed into a block of size @c sizeof(latencyinfo).
+	First, one record is returned for each priority level, in increasing 
+	order, and then one for each cause; the records without latencies are
+	skipped. The histograms are cumulative since boot, merged over all cores.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+	@see LatencyPercentile
+ */
+Fid_t OpenLatencyInfo();
+
+
 
 
 /*******************************************
@@ -768,6 +1102,55 @@ Fid_t OpenInfo();
  *
  *******************************************/
 
+/** @brief The maximum number of priority levels of the scheduler. */
+#define MAX_SCHED_LEVELS 64
+
+/** @brief The scheduling policies, selected at boot time.
+
+  @see sched_params
+  */
+typedef enum sched_policy {
+  SCHED_POLICY_MLFQ,  /**< @brief Multi-level feedback queues (the default) */
+  SCHED_POLICY_RR,    /**< @brief Plain round-robin, with a single priority level */
+  SCHED_POLICY_FAIR   /**< @brief Fair-share, where each thread gets a share of the cpu 
+                           according to its nice value. 
+                           @see SetPriority */
+} sched_policy;
+
+/** @brief Scheduler parameters, given at boot time.
+
+  A zero value in any field selects the default for this field. Therefore,
+  a parameter object can be initialized as
+  @code
+  sched_params params = { .levels = 16 };
+  @endcode
+
+  @see boot_sched
+  */
+typedef struct sched_params {
+  sched_policy policy;   /**< @brief The scheduling policy. The default is @c SCHED_POLICY_MLFQ. */
+  unsigned int levels;   /**< @brief The number of MLFQ priority levels, from 1 to 
+                              @c MAX_SCHED_LEVELS. The default is 3. Policies 
+                              with a fixed number of levels ignore this. */
+  unsigned long quantum[MAX_SCHED_LEVELS]; /**< @brief The time-slice (in usec) of each 
+                              level, where level 0 is the lowest priority. By default, 
+                              the top level has a time-slice of 10 msec, and each lower 
+                              level has double the time-slice of the level above it, 
+                              up to 80 msec. */
+  const char* trace;     /**< @brief The file where a trace of the scheduler events is 
+                              written when the computer halts, in the Chrome trace-event 
+                              JSON format, or NULL for no tracing. If it is NULL, the 
+                              file named by the environment variable @c TINYOS_TRACE 
+                              is used, if it is set. */
+  int no_handoff;        /**< @brief If set, a thread woken at a condition variable, a pipe 
+                              or a socket is not handed off the core of the waker, but 
+                              is scheduled as any other woken thread. The default is 0. */
+  int no_affine_wakeup;  /**< @brief If set, a woken thread is not preferred to the core it 
+                              last ran on, when a core is preempted or chosen to queue 
+                              the thread at. The default is 0. */
+} sched_params;
+
+
 /** @brief Boot tinyos3. 
 
    The function must initialize the simulated computer with the given number of
@@ -780,6 +1163,17 @@ Fid_t OpenInfo();
    */
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
+/** @brief Boot tinyos3 with the given scheduler parameters.
+
+   This is the same as @c boot, except that the scheduler is configured by
+   @c params. If @c params is @c NULL, the defaults are used.
+
+   @see boot
+   @see sched_params
+   */
+void boot_sched(unsigned int ncores, unsigned int terminals, const sched_params* params,
+  Task boot_task, int argl, void* args);
+
 
 /** @} */
 
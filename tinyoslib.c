@@ -144,6 +144,27 @@ int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv )
 }
 
 
+unsigned long LatencyPercentile(const latencyinfo* linfo, double p)
+{
+	if(linfo->count == 0) return 0;
+
+	/* The rank of the percentile, counting from 1 */
+	unsigned long rank = (unsigned long)(p/100.0 * linfo->count);
+	if(rank < 1) rank = 1;
+	if(rank > linfo->count) rank = linfo->count;
+
+	unsigned long seen = 0;
+	for(int b=0; b<LATENCY_BUCKETS-1; b++) {
+		seen += linfo->buckets[b];
+		if(seen >= rank) {
+			unsigned long bound = 1ul << b;
+			return bound < linfo->max ? bound : linfo->max;
+		}
+	}
+	return linfo->max;
+}
+
+
 
 int Execute(Program prog, size_t argc, const char** argv)
 {
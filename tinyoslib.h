@@ -73,6 +73,20 @@ int Execute(Program prog, size_t argc, const char** argv);
 int ParseProcInfo(procinfo* pinfo, Program* prog, int argc, const char** argv );
 
 
+/**
+	@brief Estimate a percentile of the latencies of a @ref latencyinfo histogram.
+
+	The estimate is the upper bound of the histogram bucket that holds the 
+	percentile, but no more than the longest latency. Thus, it is at most 
+	twice the actual percentile.
+
+	@param linfo the latencyinfo object, returned by a @ref OpenLatencyInfo stream
+	@param p the percentile, between 0 and 100
+	@returns the estimate (in usec), or 0 if the histogram is empty
+*/
+unsigned long LatencyPercentile(const latencyinfo* linfo, double p);
+
+
 
 typedef struct barrier {
 	Mutex mx;
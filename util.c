@@ -43,3 +43,229 @@ void exception_unwind(exception_context context, int errcode)
 		raise_exception(context);
 }
 
+
+
+/*
+	Red-black trees.
+
+	The implementation follows Cormen et al., "Introduction to Algorithms",
+	with NULL in place of the sentinel leaf.
+ */
+
+rbnode* rbtree_next(rbnode* n)
+{
+	if(n->right) {
+		n = n->right;
+		while(n->left) n = n->left;
+		return n;
+	}
+	while(n->parent && n == n->parent->right)
+		n = n->parent;
+	return n->parent;
+}
+
+rbnode* rbtree_prev(rbnode* n)
+{
+	if(n->left) {
+		n = n->left;
+		while(n->right) n = n->right;
+		return n;
+	}
+	while(n->parent && n == n->parent->left)
+		n = n->parent;
+	return n->parent;
+}
+
+/* Make v take the place of u in the tree (v may be NULL) */
+static void rb_transplant(rbtree* T, rbnode* u, rbnode* v)
+{
+	if(u->parent == NULL)
+		T->root = v;
+	else if(u == u->parent->left)
+		u->parent->left = v;
+	else
+		u->parent->right = v;
+	if(v) v->parent = u->parent;
+}
+
+static void rb_rotate_left(rbtree* T, rbnode* x)
+{
+	rbnode* y = x->right;
+	x->right = y->left;
+	if(y->left) y->left->parent = x;
+	rb_transplant(T, x, y);
+	y->left = x;
+	x->parent = y;
+}
+
+static void rb_rotate_right(rbtree* T, rbnode* x)
+{
+	rbnode* y = x->left;
+	x->left = y->right;
+	if(y->right) y->right->parent = x;
+	rb_transplant(T, x, y);
+	y->right = x;
+	x->parent = y;
+}
+
+static inline int rb_is_red(rbnode* n) { return n != NULL && n->red; }
+
+void rbtree_insert(rbtree* T, rbnode* z)
+{
+	/* Find the place, after any equal keys */
+	rbnode* p = NULL;
+	rbnode** link = &T->root;
+	int leftmost = 1;
+	while(*link) {
+		p = *link;
+		if(z->key < p->key) 
+			link = &p->left;
+		else {
+			link = &p->right;
+			leftmost = 0;
+		}
+	}
+	z->parent = p;
+	z->left = z->right = NULL;
+	z->red = 1;
+	*link = z;
+	if(leftmost) T->first = z;
+	T->size++;
+
+	/* Restore the red-black properties */
+	while(rb_is_red(z->parent)) {
+		p = z->parent;
+		rbnode* g = p->parent;
+		if(p == g->left) {
+			rbnode* u = g->right;
+			if(rb_is_red(u)) {
+				p->red = u->red = 0;
+				g->red = 1;
+				z = g;
+			} else {
+				if(z == p->right) {
+					z = p;
+					rb_rotate_left(T, z);
+					p = z->parent;
+				}
+				p->red = 0;
+				g->red = 1;
+				rb_rotate_right(T, g);
+			}
+		} else {
+			rbnode* u = g->left;
+			if(rb_is_red(u)) {
+				p->red = u->red = 0;
+				g->red = 1;
+				z = g;
+			} else {
+				if(z == p->left) {
+					z = p;
+					rb_rotate_right(T, z);
+					p = z->parent;
+				}
+				p->red = 0;
+				g->red = 1;
+				rb_rotate_left(T, g);
+			}
+		}
+	}
+	T->root->red = 0;
+}
+
+void rbtree_remove(rbtree* T, rbnode* z)
+{
+	if(T->first == z) T->first = rbtree_next(z);
+	T->size--;
+
+	/* x takes the place of y, which is z or the successor of z; xp is the parent of x */
+	rbnode *y = z, *x, *xp;
+	int y_red = y->red;
+	if(z->left == NULL) {
+		x = z->right;
+		xp = z->parent;
+		rb_transplant(T, z, x);
+	}
+	else if(z->right == NULL) {
+		x = z->left;
+		xp = z->parent;
+		rb_transplant(T, z, x);
+	}
+	else {
+		y = z->right;
+		while(y->left) y = y->left;
+		y_red = y->red;
+		x = y->right;
+		if(y->parent == z)
+			xp = y;
+		else {
+			xp = y->parent;
+			rb_transplant(T, y, x);
+			y->right = z->right;
+			y->right->parent = y;
+		}
+		rb_transplant(T, z, y);
+		y->left = z->left;
+		y->left->parent = y;
+		y->red = z->red;
+	}
+	z->parent = z->left = z->right = NULL;
+
+	if(y_red) return;
+
+	/* Restore the red-black properties */
+	while(x != T->root && !rb_is_red(x)) {
+		if(x == xp->left) {
+			rbnode* w = xp->right;
+			if(w->red) {
+				w->red = 0;
+				xp->red = 1;
+				rb_rotate_left(T, xp);
+				w = xp->right;
+			}
+			if(!rb_is_red(w->left) && !rb_is_red(w->right)) {
+				w->red = 1;
+				x = xp;
+				xp = x->parent;
+			} else {
+				if(!rb_is_red(w->right)) {
+					w->left->red = 0;
+					w->red = 1;
+					rb_rotate_right(T, w);
+					w = xp->right;
+				}
+				w->red = xp->red;
+				xp->red = 0;
+				w->right->red = 0;
+				rb_rotate_left(T, xp);
+				x = T->root;
+			}
+		} else {
+			rbnode* w = xp->left;
+			if(w->red) {
+				w->red = 0;
+				xp->red = 1;
+				rb_rotate_right(T, xp);
+				w = xp->left;
+			}
+			if(!rb_is_red(w->left) && !rb_is_red(w->right)) {
+				w->red = 1;
+				x = xp;
+				xp = x->parent;
+			} else {
+				if(!rb_is_red(w->left)) {
+					w->right->red = 0;
+					w->red = 1;
+					rb_rotate_left(T, w);
+					w = xp->left;
+				}
+				w->red = xp->red;
+				xp->red = 0;
+				w->left->red = 0;
+				rb_rotate_right(T, xp);
+				x = T->root;
+			}
+		}
+	}
+	if(x) x->red = 0;
+}
@@ -18,6 +18,7 @@
 	This file defines the following:
 	- macros for error checking and message reporting
 	- a _resource list_ data structure
+	- a red-black tree data structure
 
 	Resource list
 	--------------
@@ -453,7 +454,7 @@ static inline rlnode* rlist_pop_front(rlnode* list) { return rl_splice(list, lis
 	This function, applied on a non-empty list, will remove the tail of 
 	the list and return in.
 */
-static inline rlnode* rlist_pop_back(rlnode* list) { return rl_splice(list, list->prev); }
+static inline rlnode* rlist_pop_back(rlnode* list) { return rlist_remove(list->prev); }
 
 /**
 	@brief Return the length of a list.
@@ -583,6 +584,149 @@ static inline void rlist_select(rlnode* Lsrc, rlnode* Ldest, int (*pred)(rlnode*
 
 
 
+/*******************************************************
+ *
+ *
+ *******************************************************/
+
+/**
+	@defgroup rbtrees  Red-black trees
+	@brief  An intrusive, balanced binary search tree.
+
+	A red-black tree keeps a set of nodes ordered by an integer key, and
+	supports insertion and removal of a node in O(log n) time. The node with 
+	the smallest key is cached, so that it is returned in O(1) time. Nodes 
+	with equal keys are kept in the order they were inserted.
+
+	As with resource lists, the nodes are usually stored inside the objects
+	they point to (intrusive trees). A node must be initialized by 
+	@c rbnode_init before it is inserted, and the key must be set before
+	insertion and not change while the node is in a tree.
+	@code
+	rbtree T;
+	rbtree_init(&T);
+
+	rbnode_init(&tcb->fair_node, tcb)->key = 42;
+	rbtree_insert(&T, &tcb->fair_node);
+
+	for(rbnode* n = rbtree_first(&T); n != NULL; n = rbtree_next(n))
+		... n->tcb ...
+	@endcode
+
+	@{
+ */
+
+/** @brief A convenience typedef */
+typedef struct rbtree_node rbnode;
+
+/**
+	@brief Tree node
+*/
+struct rbtree_node {
+  /** @brief The object of this node, as in @c rlnode */
+  union {
+    PCB* pcb; 
+    TCB* tcb;
+    void* obj;
+    intptr_t num;
+    uintptr_t unum;
+  };
+
+  uint64_t key;     /**< @brief The key that orders the tree */
+
+  rbnode* parent;   /**< @brief The parent node, or NULL for the root */
+  rbnode* left;     /**< @brief The left child, or NULL */
+  rbnode* right;    /**< @brief The right child, or NULL */
+  int red;          /**< @brief The color of the node */
+};
+
+/**
+	@brief A red-black tree
+*/
+typedef struct rbtree {
+  rbnode* root;     /**< @brief The root node, or NULL for the empty tree */
+  rbnode* first;    /**< @brief The node with the smallest key, or NULL */
+  size_t size;      /**< @brief The number of nodes in the tree */
+} rbtree;
+
+
+/**
+	@brief Initialize an empty tree.
+ */
+static inline void rbtree_init(rbtree* T)
+{
+	T->root = T->first = NULL;
+	T->size = 0;
+}
+
+/**
+	@brief Initialize a tree node, storing a pointer to its object.
+
+	@returns the node itself
+ */
+static inline rbnode* rbnode_init(rbnode* n, void* ptr)
+{
+	n->obj = ptr;
+	n->key = 0;
+	n->parent = n->left = n->right = NULL;
+	n->red = 0;
+	return n;
+}
+
+/**
+	@brief Return true if the tree is empty.
+ */
+static inline int is_rbtree_empty(rbtree* T) { return T->root == NULL; }
+
+/**
+	@brief Return the node with the smallest key, or NULL for an empty tree.
+
+	Among nodes with equal keys, the one inserted first is returned.
+	This takes O(1) time.
+ */
+static inline rbnode* rbtree_first(rbtree* T) { return T->first; }
+
+/**
+	@brief Return the node with the largest key, or NULL for an empty tree.
+
+	Among nodes with equal keys, the one inserted last is returned.
+ */
+static inline rbnode* rbtree_last(rbtree* T)
+{
+	rbnode* n = T->root;
+	if(n) while(n->right) n = n->right;
+	return n;
+}
+
+/**
+	@brief Return the node following @c n in key order, or NULL.
+ */
+rbnode* rbtree_next(rbnode* n);
+
+/**
+	@brief Return the node preceding @c n in key order, or NULL.
+ */
+rbnode* rbtree_prev(rbnode* n);
+
+/**
+	@brief Insert a node into a tree.
+
+	The node is placed after all nodes with an equal key.
+	@pre the node is not in a tree, and its key is set
+ */
+void rbtree_insert(rbtree* T, rbnode* n);
+
+/**
+	@brief Remove a node from the tree that contains it.
+
+	@pre the node is in tree @c T
+ */
+void rbtree_remove(rbtree* T, rbnode* n);
+
+/* @} rbtrees */
+
+
+
 /*
 	Some helpers for packing and unpacking vectors of strings into
 	(argl, args)
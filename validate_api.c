@@ -923,6 +923,33 @@ void sleep_thread(int sec) {
 	ASSERT(Cond_TimedWait(&mx,&cond,1000*sec)==0);
 }
 
+void sleep_ms(int ms) {
+	Mutex mx = MUTEX_INIT;
+	CondVar cond = COND_INIT;
+
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx,&cond,ms);
+	Mutex_Unlock(&mx);
+}
+
+/* The time elapsed since t0, in msec */
+double msec_since(struct timespec t0) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return 1E3*(t.tv_sec-t0.tv_sec) + 1E-6*(t.tv_nsec-t0.tv_nsec);
+}
+
+/* 
+  The time that the current core has run on the host since c0, as taken by
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c0), in msec. Unlike msec_since(),
+  it does not advance while the host deschedules the core.
+ */
+double core_msec_since(struct timespec c0) {
+	struct timespec t;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	return 1E3*(t.tv_sec-c0.tv_sec) + 1E-6*(t.tv_nsec-c0.tv_nsec);
+}
+
 
 BOOT_TEST(test_threadself,
 	"Test that ThreadSelf is somewhat sane")
@@ -1286,6 +1313,78 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
+BOOT_TEST(test_mutex_contention,
+	"Test that threads waiting for a mutex held by a sleeping thread do not use the\n"
+	"cores, and report the throughput of a contended mutex.",
+	.timeout = 60
+	)
+{
+	unsigned long busy_time() {
+		unsigned long busy = 0;
+		for(unsigned int c=0; c<cpu_cores(); c++) {
+			coreinfo ci;
+			if(CoreInfo(c, &ci)==0) busy += ci.busy_time;
+		}
+		return busy;
+	}
+
+	Mutex mx = MUTEX_INIT;
+	const int N = 2*cpu_cores();
+	Tid_t tids[2*MAX_CORES];
+
+	/* The waiters sleep while the holder of the mutex sleeps */
+	int waiter(int argl, void* args) {
+		Mutex_Lock(&mx);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+	Mutex_Lock(&mx);
+	for(int i=0; i<N; i++)
+		tids[i] = CreateThread(waiter, 0, NULL);
+	Mutex smx = MUTEX_INIT;
+	CondVar scv = COND_INIT;
+	struct timespec t0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	unsigned long busy0 = busy_time();
+	Mutex_Lock(&smx);
+	while(msec_since(t0) < 100.0)
+		Cond_TimedWait(&smx, &scv, 10);
+	Mutex_Unlock(&smx);
+	unsigned long busy = busy_time() - busy0;
+	Mutex_Unlock(&mx);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	MSG("%.1f msec of core time used by %d waiters in 100 msec\n", busy/1000.0, N);
+	ASSERT(busy < 50000);
+
+	/* Count under the mutex */
+	const int ROUNDS = 2000;
+	unsigned long count = 0;
+	int counter(int argl, void* args) {
+		for(int r=0; r<ROUNDS; r++) {
+			Mutex_Lock(&mx);
+			count++;
+			fibo(8);
+			Mutex_Unlock(&mx);
+			fibo(8);
+		}
+		return 0;
+	}
+	busy0 = busy_time();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(int i=0; i<N; i++)
+		tids[i] = CreateThread(counter, 0, NULL);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	double msec = msec_since(t0);
+	busy = busy_time() - busy0;
+	ASSERT(count == N*ROUNDS);
+	MSG("%.2f usec per critical section, %.2f usec of core time\n", 
+		1000.0*msec/count, (double)busy/count);
+	return 0;
+}
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
@@ -1304,6 +1403,7 @@ TEST_SUITE(thread_tests,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_mutex_contention,
 	NULL
 };
 
@@ -2465,11 +2565,1670 @@ BARE_TEST(dummy_user_test,
 }
 
 
+/*
+  Helpers for the scheduler tests.
+ */
+
+/* Set to make the hogs return */
+static int hogs_done;
+
+/* 
+  A CPU-bound thread, which runs until stop_hogs(). If args is not NULL, 
+  it points to a counter of the work done by the hog.
+ */
+static int hog(int argl, void* args)
+{
+	unsigned long* count = args;
+	while(! __atomic_load_n(&hogs_done, __ATOMIC_RELAXED)) {
+		fibo(15);
+		if(count) __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/* Create n hogs */
+static void start_hogs(Tid_t* tids, int n)
+{
+	__atomic_store_n(&hogs_done, 0, __ATOMIC_RELAXED);
+	for(int i=0; i<n; i++)
+		tids[i] = CreateThread(hog, 0, NULL);
+}
+
+/* Stop the hogs and join them */
+static void stop_hogs(Tid_t* tids, int n)
+{
+	__atomic_store_n(&hogs_done, 1, __ATOMIC_RELAXED);
+	for(int i=0; i<n; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+}
+
+/* 
+  Bounds on wall-clock timing are asserted only when each core has a host
+  cpu of its own; else, the host scheduler dominates the timing.
+ */
+static int host_cpu_per_core()
+{
+	return cpu_cores() <= sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+
+/* The result of work_stealing_boot(), in processes completed per second */
+static double stealing_throughput;
+
+static int work_stealing_boot(int argl, void* args)
+{
+	int compute(int argl, void* args)
+	{
+		return fibo(30) % 2;
+	}
+
+	coreinfo c0[MAX_CORES], c1[MAX_CORES];
+	for(unsigned int c=0; c<cpu_cores(); c++)
+		ASSERT(CoreInfo(c, &c0[c])==0);
+	struct timespec t0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	const int N = 4*cpu_cores();
+	for(int i=0; i<N; i++)
+		ASSERT(Exec(compute, 0, NULL)!=NOPROC);
+	for(int i=0; i<N; i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	ASSERT(WaitChild(NOPROC, NULL)==NOPROC);
+
+	stealing_throughput = N / (1E-3*msec_since(t0));
+
+	/* Every core ran some of the processes */
+	for(unsigned int c=0; c<cpu_cores(); c++) {
+		ASSERT(CoreInfo(c, &c1[c])==0);
+		ASSERT_MSG(c1[c].busy_time > c0[c].busy_time && c1[c].switches > c0[c].switches,
+			"core %u of %u did no work\n", c, cpu_cores());
+	}
+	return 0;
+}
+
+BARE_TEST(test_sched_work_stealing,
+	"Test that a burst of processes, all made ready by the same core, is\n"
+	"run by every core, and report the throughput for 1 to 32 cores. Check\n"
+	"that the throughput grows with the cores, up to the host cpus, and\n"
+	"does not collapse beyond them.",
+	.timeout = 120
+	)
+{
+	long host_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double base = 0.0;
+
+	MSG("cores   processes/sec\n");
+	for(unsigned int cores = 1; cores <= MAX_CORES; cores *= 2) {
+		stealing_throughput = -1.0;
+		boot_sched(cores, 0, NULL, work_stealing_boot, 0, NULL);
+		ASSERT(stealing_throughput > 0.0);
+		MSG("%5u   %13.1f\n", cores, stealing_throughput);
+
+		/* Half of the ideal speedup, which is bounded by the host cpus */
+		if(cores == 1)
+			base = stealing_throughput;
+		else {
+			double speedup = (cores < host_cpus) ? cores : host_cpus;
+			ASSERT_MSG(stealing_throughput >= 0.5*speedup*base,
+				"%u cores: %.1f processes/sec, %.1f for 1 core\n", 
+				cores, stealing_throughput, base);
+		}
+	}
+	if(host_cpus < MAX_CORES)
+		MSG("The host has %ld cpus; the throughput cannot grow beyond them.\n", host_cpus);
+}
+
+
+static int sched_levels_boot(int argl, void* args)
+{
+	int compute(int argl, void* args)
+	{
+		/* Mix computation with I/O-like yields, to move across levels */
+		int r = fibo(20);
+		pipe_t pipe;
+		if(Pipe(&pipe)==0) { Close(pipe.read); Close(pipe.write); }
+		return r % 2;
+	}
+
+	const int N = 8;
+	for(int i=0; i<N; i++)
+		if(Exec(compute, 0, NULL)==NOPROC) return 1;
+	for(int i=0; i<N; i++)
+		if(WaitChild(NOPROC, NULL)==NOPROC) return 1;
+	return 0;
+}
+
+BARE_TEST(test_sched_levels,
+	"Test that the system boots and runs with the minimum and maximum\n"
+	"number of scheduler levels."
+	)
+{
+	unsigned int levels[] = { 1, 2, MAX_SCHED_LEVELS };
+	for(int i=0; i<sizeof(levels)/sizeof(levels[0]); i++) {
+		sched_params params = { .levels = levels[i] };
+		for(unsigned int ncores=1; ncores<=2; ncores++)
+			boot_sched(ncores, 0, &params, sched_levels_boot, 0, NULL);
+	}
+	/* The defaults */
+	boot_sched(1, 0, NULL, sched_levels_boot, 0, NULL);
+}
+
+
+static int sched_quantum_boot(int argl, void* args)
+{
+	const unsigned long* quantum = args;
+
+	threadinfo info;
+	ASSERT(ThreadInfo(ThreadSelf(), &info)==0);
+	ASSERT(info.tid == ThreadSelf());
+	ASSERT(info.quantum == quantum[info.priority]);
+
+	/* A CPU-bound thread drops to level 0, and gets the level 0 time-slice */
+	Tid_t h;
+	start_hogs(&h, 1);
+	for(int i=0; i<100; i++) {
+		ASSERT(ThreadInfo(h, &info)==0);
+		if(info.priority == 0) break;
+		sleep_ms(50);
+	}
+	ASSERT(info.priority == 0);
+	ASSERT(info.quantum == quantum[0]);
+
+	stop_hogs(&h, 1);
+	ASSERT(ThreadInfo(h, &info)==-1);
+	ASSERT(ThreadInfo(ThreadSelf(), NULL)==-1);
+	ASSERT(ThreadInfo(NOTHREAD, &info)==-1);
+	return 0;
+}
+
+BARE_TEST(test_sched_quantum,
+	"Test that the time-slice of each scheduler level is set at boot time,\n"
+	"and that it is reported by ThreadInfo."
+	)
+{
+	/* The defaults, for 3 levels */
+	unsigned long dflt[] = { 40000, 20000, 10000 };
+	boot_sched(1, 0, NULL, sched_quantum_boot, sizeof(dflt), dflt);
+
+	sched_params params = { .levels = 2, .quantum = { 50000, 5000 } };
+	for(unsigned int ncores=1; ncores<=2; ncores++)
+		boot_sched(ncores, 0, &params, sched_quantum_boot, sizeof(params.quantum), params.quantum);
+}
+
+
+BARE_TEST(test_sched_policies,
+	"Test that the system boots and runs with each scheduling policy."
+	)
+{
+	sched_policy policies[] = { SCHED_POLICY_MLFQ, SCHED_POLICY_RR, SCHED_POLICY_FAIR };
+	for(int i=0; i<sizeof(policies)/sizeof(policies[0]); i++) {
+		sched_params params = { .policy = policies[i] };
+		for(unsigned int ncores=1; ncores<=2; ncores++)
+			boot_sched(ncores, 0, &params, sched_levels_boot, 0, NULL);
+	}
+
+	/* Round-robin has a single level, with the default time-slice */
+	unsigned long quantum[] = { 10000 };
+	sched_params params = { .policy = SCHED_POLICY_RR, .levels = 8 };
+	boot_sched(2, 0, &params, sched_quantum_boot, sizeof(quantum), quantum);
+}
+
+
+/* The time-slices of the nice 5 hog of each core, over which the shares are measured */
+#define FAIR_SLICES 30
+
+static int sched_fair_boot(int argl, void* args)
+{
+	threadinfo info(Tid_t t) {
+		threadinfo ti = { 0 };
+		ThreadInfo(t, &ti);
+		return ti;
+	}
+
+	/* The nice value is checked and inherited */
+	int nice;
+	ASSERT(SetPriority(ThreadSelf(), NICE_MIN-1)==-1);
+	ASSERT(SetPriority(ThreadSelf(), NICE_MAX+1)==-1);
+	ASSERT(SetPriority(NOTHREAD, 0)==-1);
+	ASSERT(GetPriority(ThreadSelf(), NULL)==-1);
+	ASSERT(SetPriority(ThreadSelf(), -3)==0);
+	int get_nice(int argl, void* args) {
+		int n;
+		return (GetPriority(ThreadSelf(), &n)==0) ? n : 100;
+	}
+	Tid_t t = CreateThread(get_nice, 0, NULL);
+	ASSERT(ThreadJoin(t, &nice)==0 && nice==-3);
+	ASSERT(SetPriority(ThreadSelf(), 0)==0);
+	ASSERT(GetPriority(ThreadSelf(), &nice)==0 && nice==0);
+
+	/* Half of the hogs have nice 0 and half have nice 5 */
+	const int N = 2*cpu_cores();
+	Tid_t tids[2*MAX_CORES];
+	for(int i=0; i<N; i++) {
+		ASSERT(SetPriority(ThreadSelf(), (i%2) ? 5 : 0)==0);
+		start_hogs(&tids[i], 1);
+	}
+
+	/* At nice 19 we weigh too little to make the balancer move a hog off our core */
+	ASSERT(SetPriority(ThreadSelf(), NICE_MAX)==0);
+
+	/* 
+	  Balancing by weight pairs the hogs: each core gets one of nice 0 and 
+	  one of nice 5. 
+	 */
+	int nice0[MAX_CORES], nice5[MAX_CORES];
+	int paired() {
+		for(int c=0; c<cpu_cores(); c++)
+			nice0[c] = nice5[c] = -1;
+		for(int i=0; i<N; i++) {
+			int c = info(tids[i]).core;
+			int* slot = (i%2) ? &nice5[c] : &nice0[c];
+			if(*slot != -1) return 0;
+			*slot = i;
+		}
+		return 1;
+	}
+	struct timespec t0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while(!paired() && msec_since(t0) < 10000.0)
+		sleep_ms(50);
+	ASSERT(paired());
+
+	/* 
+	  Compare the run time of the two hogs of each core, as accounted by the
+	  scheduler. Across cores, the shares cannot be compared: the host does 
+	  not give the same cpu to every core. The scheduler keeps the shares of 
+	  a core within one time-slice of the ideal, so we wait for enough
+	  time-slices at every core, rather than for a fixed time.
+	 */
+	threadinfo i0[2*MAX_CORES];
+	for(int i=0; i<N; i++)
+		i0[i] = info(tids[i]);
+	int slices_done() {
+		for(int c=0; c<cpu_cores(); c++)
+			if(info(tids[nice5[c]]).involuntary_switches - i0[nice5[c]].involuntary_switches < FAIR_SLICES)
+				return 0;
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while(!slices_done() && msec_since(t0) < 60000.0)
+		sleep_ms(100);
+	ASSERT(slices_done());
+
+	double ratio = 0.0, lo = 1e9, hi = 0.0;
+	for(int c=0; c<cpu_cores(); c++) {
+		threadinfo a = info(tids[nice0[c]]), b = info(tids[nice5[c]]);
+		/* The pair stayed in place */
+		ASSERT(a.migrations==i0[nice0[c]].migrations && b.migrations==i0[nice5[c]].migrations);
+		double r = (double)(a.run_time - i0[nice0[c]].run_time) 
+			/ (double)(b.run_time - i0[nice5[c]].run_time + 1);
+		ratio += r / cpu_cores();
+		if(r<lo) lo=r;
+		if(r>hi) hi=r;
+	}
+
+	stop_hogs(tids, N);
+
+	/* The weights of nice 0 and nice 5 are 1024 and 335 */
+	MSG("cores=%u: nice 0 got %.2f times the cpu of nice 5 (ideal %.2f, per core %.2f to %.2f)\n", 
+		cpu_cores(), ratio, 1024.0/335.0, lo, hi);
+	ASSERT(ratio > 0.95*1024.0/335.0 && ratio < 1.05*1024.0/335.0);
+	ASSERT(lo > 0.9*1024.0/335.0 && hi < 1.1*1024.0/335.0);
+	return 0;
+}
+
+BARE_TEST(test_sched_fair_share,
+	"Test that the fair-share policy divides the cpu among threads according\n"
+	"to their nice values, and that SetPriority and GetPriority work.",
+	.timeout = 120
+	)
+{
+	sched_params params = { .policy = SCHED_POLICY_FAIR };
+	for(unsigned int ncores=1; ncores<=MAX_CORES; ncores*=2)
+		boot_sched(ncores, 0, &params, sched_fair_boot, 0, NULL);
+}
+
+
+static int sched_nice_boot(int argl, void* args)
+{
+	int levels = argl;
+	int priority(Tid_t t) {
+		threadinfo info;
+		return (ThreadInfo(t, &info)==0) ? info.priority : -1;
+	}
+
+	/* The nice value biases the starting level of new threads */
+	int start_level(int argl, void* args) {
+		return priority(ThreadSelf());
+	}
+	int child_level(int nice) {
+		int level = -1;
+		ASSERT(SetPriority(ThreadSelf(), nice)==0);
+		ASSERT(ThreadJoin(CreateThread(start_level, 0, NULL), &level)==0);
+		return level;
+	}
+	ASSERT(child_level(0) == levels/2);
+	ASSERT(child_level(-10) > levels/2);
+	ASSERT(child_level(10) < levels/2);
+	ASSERT(child_level(-20) == levels-1);
+	ASSERT(child_level(19) == 0);
+	ASSERT(SetPriority(ThreadSelf(), 0)==0);
+
+	/* 
+	  A thread of negative nice is not demoted below its floor, and a thread
+	  of nice 19 stays at the bottom level, across boosts.
+	 */
+	int nices[] = { -10, 0, 19 };
+	Tid_t tids[3];
+	for(int i=0; i<3; i++) {
+		ASSERT(SetPriority(ThreadSelf(), nices[i])==0);
+		start_hogs(&tids[i], 1);
+	}
+	ASSERT(SetPriority(ThreadSelf(), 0)==0);
+
+	int floor = 10*(levels-1)/20;
+	int lowest[3] = { levels, levels, levels };
+	for(int t=0; t<300 && (lowest[0] > floor || lowest[1] > 0); t++) {
+		sleep_ms(10);
+		for(int i=0; i<3; i++) {
+			int p = priority(tids[i]);
+			if(p < lowest[i]) lowest[i] = p;
+		}
+		ASSERT(priority(tids[2]) == 0);
+	}
+	ASSERT(lowest[0] == floor);
+	ASSERT(lowest[1] == 0);
+	stop_hogs(tids, 3);
+
+	/* 
+	  The nice value of a thread that waits in the queues moves it to a level
+	  within its new bounds, and the thread can still be taken out of the 
+	  queues, by YieldTo, and by the scheduler. On a single core, the hogs 
+	  are queued whenever we run. 
+	 */
+	const cpumask_t all = (1ull << cpu_cores()) - 1;
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1)==0);
+	ASSERT(SetPriority(ThreadSelf(), NICE_MIN)==0);
+	start_hogs(tids, 3);
+	for(int r=0; r<20; r++) {
+		sleep_ms(10);
+		for(int i=0; i<3; i++) {
+			int top = (r+i) % 2;
+			ASSERT(SetPriority(tids[i], top ? NICE_MIN : NICE_MAX)==0);
+			ASSERT(priority(tids[i]) == (top ? levels-1 : 0));
+		}
+		for(int i=0; i<3; i++)
+			ASSERT(YieldTo(tids[i])==0);
+	}
+	stop_hogs(tids, 3);
+	ASSERT(SetPriority(ThreadSelf(), 0)==0);
+	ASSERT(SetThreadAffinity(ThreadSelf(), all)==0);
+	return 0;
+}
+
+BARE_TEST(test_sched_nice_mlfq,
+	"Test that the nice value of a thread biases its starting MLFQ level,\n"
+	"and bounds the levels it is demoted or boosted to, also when it changes\n"
+	"while the thread is queued."
+	)
+{
+	sched_params params = { .levels = 8 };
+	for(unsigned int ncores=1; ncores<=2; ncores++)
+		boot_sched(ncores, 0, &params, sched_nice_boot, 8, NULL);
+}
+
+
+BOOT_TEST(test_sched_many_timeouts,
+	"Test that many timed waits, with timeouts spanning several levels of\n"
+	"the timer wheel, expire on time, and that cancelled ones are woken up.",
+	.timeout = 30
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;      /* never signalled */
+	CondVar lcv = COND_INIT;     /* broadcast to the long waiters */
+	CondVar pcv = COND_INIT;
+	int long_waiters = 0;
+
+	unsigned long tspec2msec(struct timespec t)
+	{
+		return 1000ul*t.tv_sec + t.tv_nsec/1000000ul;
+	}
+
+	int do_timeout(int argl, void* args) {
+		timeout_t t = argl;
+		struct timespec t1, t2;
+
+		clock_gettime(CLOCK_REALTIME, &t1);
+		Mutex_Lock(&mx);
+		int signalled;
+		if(t >= 1000) {
+			long_waiters++;
+			Cond_Signal(&pcv);
+			signalled = Cond_TimedWait(&mx, &lcv, t);
+		} else
+			signalled = Cond_TimedWait(&mx, &cv, t);
+		Mutex_Unlock(&mx);
+		clock_gettime(CLOCK_REALTIME, &t2);
+
+		unsigned long Dt = tspec2msec(t2)-tspec2msec(t1);
+		if(t < 1000) {
+			/* Expired, not early */
+			ASSERT(!signalled);
+			ASSERT(Dt + 1 >= t);
+		} else {
+			/* Cancelled by the broadcast */
+			ASSERT(signalled);
+		}
+		return 0;
+	}
+
+	const int N = 200;
+	for(int i=0; i<N; i++) {
+		/* Every fourth child waits for (practically) ever */
+		timeout_t t = (i % 4 == 3) ? 10000000 : 1 + (i*37) % 300;
+		ASSERT(Exec(do_timeout, t, NULL)!=NOPROC);
+	}
+
+	/* Let the short timeouts expire, then wake up the rest */
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &pcv, 500);
+	while(long_waiters < N/4)
+		Cond_Wait(&mx, &pcv);
+	Cond_Broadcast(&lcv);
+	Mutex_Unlock(&mx);
+
+	for(int i=0; i<N; i++)
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+}
+
+
+BOOT_TEST(test_sched_idle_cores_halt,
+	"Test that idle cores do not consume host CPU time while threads sleep,\n"
+	"and that the sleeping threads are woken up on time.",
+	.timeout = 10
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	struct timespec cpu1, cpu2, t1, t2;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+	clock_gettime(CLOCK_REALTIME, &t1);
+	Mutex_Lock(&mx);
+	ASSERT(Cond_TimedWait(&mx, &cv, 500)==0);
+	Mutex_Unlock(&mx);
+	clock_gettime(CLOCK_REALTIME, &t2);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu2);
+
+	double cpu = (cpu2.tv_sec-cpu1.tv_sec) + 1E-9*(cpu2.tv_nsec-cpu1.tv_nsec);
+	double wall = (t2.tv_sec-t1.tv_sec) + 1E-9*(t2.tv_nsec-t1.tv_nsec);
+
+	ASSERT_MSG(cpu < 0.1*wall, "cpu=%.3f sec during %.3f sec of sleep\n", cpu, wall);
+	ASSERT(wall >= 0.5 && wall < 0.6);
+	return 0;
+}
+
+
+BOOT_TEST(test_sched_thread_churn,
+	"Test that many threads can be created and joined in waves, recycling\n"
+	"their thread blocks, and report the blocks allocated after the first wave.",
+	.timeout = 60
+	)
+{
+	int worker(int argl, void* args) {
+		return argl;
+	}
+
+	const int WAVES = 200;
+	const int M = 50;
+	Tid_t tids[M];
+
+	/* The thread blocks allocated, and recycled, by all cores */
+	unsigned long allocs, reuses;
+	void count_blocks() {
+		allocs = reuses = 0;
+		for(unsigned int c=0; c<cpu_cores(); c++) {
+			coreinfo ci;
+			ASSERT(CoreInfo(c, &ci)==0);
+			allocs += ci.thread_allocs;
+			reuses += ci.thread_reuses;
+		}
+	}
+
+	struct timespec t1, t2;
+	unsigned long allocs1 = 0, reuses1 = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for(int w=0; w<WAVES; w++) {
+		for(int i=0; i<M; i++) {
+			tids[i] = CreateThread(worker, i, NULL);
+			ASSERT(tids[i]!=NOTHREAD);
+		}
+		for(int i=0; i<M; i++) {
+			int retval;
+			ASSERT(ThreadJoin(tids[i], &retval)==0);
+			ASSERT(retval==i);
+		}
+		if(w==0) {
+			count_blocks();
+			allocs1 = allocs;
+			reuses1 = reuses;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	count_blocks();
+
+	double us = 1E6*(t2.tv_sec-t1.tv_sec) + 1E-3*(t2.tv_nsec-t1.tv_nsec);
+	MSG("%.2f usec per thread create/join\n", us/(WAVES*M));
+	MSG("%lu thread blocks allocated after the first wave, %lu recycled\n", 
+		allocs-allocs1, reuses-reuses1);
+
+	/* 
+	  After the first wave, new threads reuse the blocks of exited threads. 
+	  On a single core, no block is allocated. A block freed at another core
+	  stays in the cache of that core (of at most 16 blocks), until the cache
+	  spills to the global pool; thus, a block is allocated only while the 
+	  caches of other cores hold all the free blocks. As we may move between
+	  cores, this bounds the blocks allocated by a cache per core.
+	 */
+	ASSERT(reuses - reuses1 == (WAVES-1)*M - (allocs - allocs1));
+	ASSERT(cpu_cores() > 1 || allocs == allocs1);
+	ASSERT(allocs - allocs1 <= 16*cpu_cores());
+	return 0;
+}
+
+
+static int deep_recursion(int n)
+{
+	/* Each call uses more than 1 kbyte of stack */
+	volatile char frame[1024];
+	frame[n % 1024] = 1;
+	if(n==0) return 0;
+	int r = deep_recursion(n-1);
+	return r + frame[n % 1024];
+}
+
+BOOT_TEST(test_create_thread_ex,
+	"Test that CreateThreadEx creates threads with the requested stack size,\n"
+	"and rejects stack sizes out of range."
+	)
+{
+	int recurse(int argl, void* args) {
+		return deep_recursion(argl);
+	}
+
+	ASSERT(CreateThreadEx(NULL, 0, NULL, 0)==NOTHREAD);
+	ASSERT(CreateThreadEx(recurse, 0, NULL, MIN_STACK_SIZE-1)==NOTHREAD);
+	ASSERT(CreateThreadEx(recurse, 0, NULL, MAX_STACK_SIZE+1)==NOTHREAD);
+
+	int retval;
+
+	/* About 1 Mbyte of stack, much more than the default */
+	Tid_t t = CreateThreadEx(recurse, 1000, NULL, 4*1024*1024);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, &retval)==0 && retval==1000);
+
+	/* The minimum stack, and a size that is not a multiple of the page size */
+	t = CreateThreadEx(recurse, 4, NULL, MIN_STACK_SIZE);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, &retval)==0 && retval==4);
+
+	t = CreateThreadEx(recurse, 4, NULL, MIN_STACK_SIZE+100);
+	ASSERT(t!=NOTHREAD);
+	ASSERT(ThreadJoin(t, &retval)==0 && retval==4);
+	return 0;
+}
+
+
+/* Return the resident memory of this process, in bytes */
+static size_t resident_memory()
+{
+	unsigned long size, resident;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if(f==NULL) return 0;
+	int rc = fscanf(f, "%lu %lu", &size, &resident);
+	fclose(f);
+	return (rc==2) ? resident*sysconf(_SC_PAGESIZE) : 0;
+}
+
+BOOT_TEST(test_sched_many_idle_threads,
+	"Test that many sleeping threads can be created, and that their resident\n"
+	"memory is proportional to the stack they use, not the stack they reserve.",
+	.timeout = 120
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	int go = 0;
+
+	int sleeper(int argl, void* args) {
+		Mutex_Lock(&mx);
+		while(!go) Cond_Wait(&mx, &cv);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	const int N = 10000;
+	Tid_t* tids = malloc(N*sizeof(Tid_t));
+	ASSERT(tids != NULL);
+
+	size_t rss1 = resident_memory();
+	for(int i=0; i<N; i++) {
+		tids[i] = CreateThread(sleeper, 0, NULL);
+		ASSERT(tids[i]!=NOTHREAD);
+	}
+	/* Let them all run and sleep */
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 100);
+	Mutex_Unlock(&mx);
+	size_t rss2 = resident_memory();
+
+	/* The default stack is 128 kbytes */
+	const size_t stack_size = 128*1024;
+	MSG("%lu kbytes resident per idle thread (%lu kbytes of stack reserved)\n",
+		(rss2-rss1)/N/1024, stack_size/1024);
+	ASSERT(rss2-rss1 < N * stack_size/4);
+
+	Mutex_Lock(&mx);
+	go = 1;
+	Cond_Broadcast(&cv);
+	Mutex_Unlock(&mx);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	free(tids);
+	return 0;
+}
+
+
+BOOT_TEST(test_sched_wakeup_preemption,
+	"Test that a thread woken up while CPU-bound threads occupy all cores\n"
+	"runs without waiting for a quantum to expire.",
+	.timeout = 30
+	)
+{
+	pipe_t pipe;
+	struct timespec sent;
+	double latency = 0.0;
+	int turn = 0;
+
+	int partner(int argl, void* args) {
+		char c;
+		struct timespec t;
+		for(int i=0; i<argl; i++) {
+			ASSERT(Read(pipe.read, &c, 1)==1);
+			clock_gettime(CLOCK_MONOTONIC, &t);
+			latency += 1E6*(t.tv_sec-sent.tv_sec) + 1E-3*(t.tv_nsec-sent.tv_nsec);
+			__atomic_store_n(&turn, 0, __ATOMIC_RELEASE);
+		}
+		return 0;
+	}
+
+	ASSERT(Pipe(&pipe)==0);
+
+	const int HOGS = cpu_cores();
+	const int ROUNDS = 100;
+	Tid_t hogs[MAX_CORES];
+	start_hogs(hogs, HOGS);
+	Tid_t p = CreateThread(partner, ROUNDS, NULL);
+
+	/* Let the hogs drop to a low priority */
+	sleep_ms(200);
+
+	for(int i=0; i<ROUNDS; i++) {
+		/* Wake up the partner, and keep this core busy until it runs */
+		__atomic_store_n(&turn, 1, __ATOMIC_RELAXED);
+		clock_gettime(CLOCK_MONOTONIC, &sent);
+		ASSERT(Write(pipe.write, "x", 1)==1);
+		while(__atomic_load_n(&turn, __ATOMIC_ACQUIRE)==1);
+	}
+
+	ASSERT(ThreadJoin(p, NULL)==0);
+	stop_hogs(hogs, HOGS);
+
+	double usec = latency/ROUNDS;
+	MSG("%.1f usec per wakeup\n", usec);
+
+	/* 
+	   Without preemption, each wakeup waits for a quantum (10 msec). When the 
+	   cores outnumber the host cpus, the host scheduler dominates the latency.
+	 */
+	if(host_cpu_per_core())
+		ASSERT(usec < 5000.0);
+	return 0;
+}
+
+
+BOOT_TEST(test_sched_idle_core_wakeup,
+	"Test that a thread woken up while other cores are idle is run by an\n"
+	"idle core, while the waker keeps its own core busy.",
+	.minimum_cores = 2, .timeout = 30
+	)
+{
+	pipe_t pipe;
+	struct timespec sent;
+	double latency = 0.0;
+	int turn = 0;
+
+	int partner(int argl, void* args) {
+		char c;
+		struct timespec t;
+		for(int i=0; i<argl; i++) {
+			ASSERT(Read(pipe.read, &c, 1)==1);
+			clock_gettime(CLOCK_MONOTONIC, &t);
+			latency += 1E6*(t.tv_sec-sent.tv_sec) + 1E-3*(t.tv_nsec-sent.tv_nsec);
+			__atomic_store_n(&turn, 0, __ATOMIC_RELEASE);
+		}
+		return 0;
+	}
+
+	ASSERT(Pipe(&pipe)==0);
+
+	const int ROUNDS = 100;
+	Tid_t p = CreateThread(partner, ROUNDS, NULL);
+
+	for(int i=0; i<ROUNDS; i++) {
+		/* Let the other cores go idle, then wake up the partner */
+		sleep_ms(2);
+
+		__atomic_store_n(&turn, 1, __ATOMIC_RELAXED);
+		clock_gettime(CLOCK_MONOTONIC, &sent);
+		ASSERT(Write(pipe.write, "x", 1)==1);
+		while(__atomic_load_n(&turn, __ATOMIC_ACQUIRE)==1);
+	}
+
+	ASSERT(ThreadJoin(p, NULL)==0);
+
+	double usec = latency/ROUNDS;
+	MSG("%.1f usec per wakeup\n", usec);
+
+	/* A lost restart would leave the partner waiting for the waker's quantum to end */
+	if(host_cpu_per_core())
+		ASSERT(usec < 5000.0);
+	return 0;
+}
+
+
+BOOT_TEST(test_sched_boost,
+	"Test that a CPU-bound thread, demoted to the lowest priority, is boosted\n"
+	"and makes progress while threads of higher priority keep all cores busy.",
+	.timeout = 60
+	)
+{
+	unsigned long count = 0;
+
+	/* Burn 2 msec and sleep 1 msec, without ever finishing a quantum */
+	int busy(int argl, void* args) {
+		while(! __atomic_load_n(&hogs_done, __ATOMIC_RELAXED)) {
+			struct timespec t0;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			while(msec_since(t0) < 2.0);
+			sleep_ms(1);
+		}
+		return 0;
+	}
+
+	/* Let the hog drop to the lowest priority */
+	hogs_done = 0;
+	Tid_t h = CreateThread(hog, 0, &count);
+	sleep_ms(100);
+
+	const int BUSY = 4*cpu_cores();
+	Tid_t tids[4*MAX_CORES];
+	for(int i=0; i<BUSY; i++)
+		tids[i] = CreateThread(busy, 0, NULL);
+	sleep_ms(50);
+
+	/* Wait for the hog to make progress */
+	struct timespec t0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	unsigned long c0 = __atomic_load_n(&count, __ATOMIC_RELAXED);
+	double msec;
+	do {
+		sleep_ms(10);
+		msec = msec_since(t0);
+	} while(__atomic_load_n(&count, __ATOMIC_RELAXED) == c0 && msec < 20000.0);
+	MSG("the hog made progress after %.1f msec\n", msec);
+	ASSERT(__atomic_load_n(&count, __ATOMIC_RELAXED) != c0);
+
+	stop_hogs(&h, 1);
+	for(int i=0; i<BUSY; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_sched_edf,
+	"Test the admission control of real-time threads, that a periodic\n"
+	"real-time thread meets its deadlines and is woken up on time, while\n"
+	"CPU-bound threads keep its core busy, and that a real-time thread is\n"
+	"throttled to its budget.",
+	.timeout = 60
+	)
+{
+	/* Invalid parameters, and a density above the limit of a core */
+	rt_params bad[] = { {0, 10000, 0}, {6000, 10000, 5000}, {1000, 10000, 20000}, 
+		{9900, 10000, 0}, {1000, 0, 0} };
+	for(int i=0; i<sizeof(bad)/sizeof(bad[0]); i++)
+		ASSERT(SetRealtime(&bad[i])==-1);
+	threadinfo info;
+	ASSERT(ThreadInfo(ThreadSelf(), &info)==0 && info.realtime==0);
+
+	/* Each core admits one thread of density 0.6 */
+	int admitted = 0, tried = 0, done = 0;
+	int reserve(int argl, void* args) {
+		rt_params p = { 6000, 10000, 0 };
+		if(SetRealtime(&p)==0)
+			__atomic_add_fetch(&admitted, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&tried, 1, __ATOMIC_RELAXED);
+		while(! __atomic_load_n(&done, __ATOMIC_RELAXED))
+			sleep_ms(5);
+		return 0;
+	}
+	const int R = cpu_cores()+1;
+	Tid_t rtids[MAX_CORES+1];
+	for(int i=0; i<R; i++) {
+		rtids[i] = CreateThread(reserve, 0, NULL);
+		while(__atomic_load_n(&tried, __ATOMIC_RELAXED) <= i)
+			sleep_ms(1);
+	}
+	ASSERT(admitted == cpu_cores());
+	__atomic_store_n(&done, 1, __ATOMIC_RELAXED);
+	for(int i=0; i<R; i++)
+		ASSERT(ThreadJoin(rtids[i], NULL)==0);
+
+	/* The reservations of exited threads are released */
+	rt_params p = { 6000, 10000, 0 };
+	ASSERT(SetRealtime(&p)==0);
+	ASSERT(ThreadInfo(ThreadSelf(), &info)==0 && info.realtime==1);
+	ASSERT(SetRealtime(NULL)==0);
+	ASSERT(ThreadInfo(ThreadSelf(), &info)==0 && info.realtime==0);
+
+	/* 
+	  Keep the last core busy, and run the real-time threads there. The other
+	  cores stay idle, so that they do not compete with this core for the
+	  host cpus, and the deadlines, which are in host time, can be met at any
+	  number of cores.
+	 */
+	const cpumask_t all = (1ull << cpu_cores()) - 1, last = 1ull << (cpu_cores()-1);
+	ASSERT(SetThreadAffinity(ThreadSelf(), last)==0);
+	const int H = 2;
+	Tid_t tids[2];
+	start_hogs(tids, H);
+	sleep_ms(100);
+
+	/* 
+	  A periodic thread: sleep 9 msec, then compute for 1 msec. The times are
+	  taken on the clock of the core, which stops while the host deschedules
+	  the core. When the host takes the core away from the thread, its budget
+	  is charged for the lost time, and the overrun is paid in the next 
+	  period; a deadline miss or a late wakeup is allowed only then. The 
+	  thread runs until 100 periods are not disturbed by the host.
+	 */
+	double lateness = 0.0;
+	int late = 0, checked = 0, unexcused = 0;
+	unsigned long misses = 0;
+	int periodic(int argl, void* args) {
+		rt_params p = { 3000, 10000, 0 };
+		if(SetRealtime(&p)!=0) return 1;
+		threadinfo info;
+		double stolen = 0.0;
+		for(int i=0; i<1000 && checked<100; i++) {
+			struct timespec t0, c0, c1;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c0);
+			sleep_ms(9);
+			double l = core_msec_since(c0) - 9.0;
+			clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c1);
+			while(core_msec_since(c1) < 1.0);
+			if(ThreadInfo(ThreadSelf(), &info)!=0) return 1;
+
+			double prev = stolen;
+			stolen = msec_since(t0) - core_msec_since(c0);
+			if(stolen <= 2.0 && prev <= 2.0) {
+				checked++;
+				if(l > lateness) lateness = l;
+				if(l > 2.0) late++;
+				if(info.deadline_misses > misses) unexcused++;
+			}
+			misses = info.deadline_misses;
+		}
+		if(!info.realtime || info.core!=cpu_cores()-1) return 1;
+		return 0;
+	}
+	int exitval;
+	Tid_t t = CreateThread(periodic, 0, NULL);
+	ASSERT(ThreadJoin(t, &exitval)==0 && exitval==0);
+	MSG("%lu deadline misses, %d periods checked, worst wakeup lateness %.2f msec\n", 
+		misses, checked, lateness);
+	stop_hogs(tids, H);
+
+	/* In the periods checked, no deadline is missed, and wakeups are late by at most a timer tick */
+	ASSERT(checked == 100);
+	ASSERT(unexcused == 0);
+	ASSERT(late == 0);
+
+	/* 
+	  A CPU-bound real-time thread is throttled to its budget. The shares are
+	  the run times accounted by the scheduler, on the clock that the budget
+	  is charged on.
+	 */
+	done = 0;
+	int counter(int argl, void* args) {
+		rt_params p = { 2000, 10000, 0 };
+		if(argl && SetRealtime(&p)!=0) return 1;
+		while(! __atomic_load_n(&done, __ATOMIC_RELAXED))
+			fibo(15);
+		return 0;
+	}
+	Tid_t ct[2];
+	for(int i=0; i<2; i++)
+		ct[i] = CreateThread(counter, i, NULL);
+	sleep_ms(100);
+	threadinfo c0[2], c1[2];
+	struct timespec t0, v0;
+	for(int i=0; i<2; i++)
+		ASSERT(ThreadInfo(ct[i], &c0[i])==0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &v0);
+	sleep_ms(1000);
+	for(int i=0; i<2; i++)
+		ASSERT(ThreadInfo(ct[i], &c1[i])==0);
+	double elapsed = msec_since(t0);
+	double stolen = elapsed - core_msec_since(v0);
+	done = 1;
+	for(int i=0; i<2; i++)
+		ASSERT(ThreadJoin(ct[i], &exitval)==0 && exitval==0);
+	ASSERT(SetThreadAffinity(ThreadSelf(), all)==0);
+
+	double run[2];
+	for(int i=0; i<2; i++)
+		run[i] = 1E-3*(c1[i].run_time - c0[i].run_time);
+	double share = run[1] / elapsed;
+	MSG("a real-time thread with 20%% of a core got %.1f%% of the time, and the other thread %.1f%%\n", 
+		100.0*share, 100.0*run[0]/elapsed);
+
+	/* 
+	  At most one budget (2 msec) per period (10 msec) is used, plus the 
+	  budget of the period in progress. A period may start up to a tick late,
+	  after the thread is throttled. The time that the host takes the core
+	  away is charged to the thread that runs, and the thread pays for at 
+	  most one budget of it; it may add to, or take from, the run time.
+	 */
+	ASSERT(c1[1].realtime && c1[1].core==cpu_cores()-1);
+	ASSERT(run[1] <= 2.0*(elapsed/10.0 + 1.0) + stolen);
+	ASSERT(run[1] >= 2.0*(elapsed/12.0 - 1.0) - stolen);
+	return 0;
+}
+
+
+BOOT_TEST(test_sched_affinity,
+	"Test that threads pinned to a core by SetThreadAffinity run only on\n"
+	"this core, and that the affinity mask is inherited by CreateThread and Exec.",
+	.minimum_cores = 2, .timeout = 30
+	)
+{
+	int on_core(int c) {
+		threadinfo info;
+		cpumask_t m;
+		return ThreadInfo(ThreadSelf(), &info)==0 && info.core==c
+			&& GetThreadAffinity(ThreadSelf(), &m)==0 && m==(1ull << c);
+	}
+
+	cpumask_t all = (1ull << cpu_cores()) - 1, m;
+	ASSERT(GetThreadAffinity(ThreadSelf(), &m)==0 && m==all);
+	ASSERT(GetThreadAffinity(ThreadSelf(), NULL)==-1);
+	ASSERT(SetThreadAffinity(ThreadSelf(), 0)==-1);
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1ull << cpu_cores())==-1);
+	ASSERT(SetThreadAffinity(NOTHREAD, all)==-1);
+
+	/* Pinned workers stay on their core, across sleeps and preemptions */
+	int worker(int argl, void* args) {
+		for(int i=0; i<50; i++) {
+			fibo(15);
+			if(i%5 == 0) sleep_ms(1);
+			if(! on_core(argl)) return 1;
+		}
+		return 0;
+	}
+
+	const int W = 2*cpu_cores();
+	Tid_t tids[2*MAX_CORES];
+	for(int i=0; i<W; i++) {
+		int c = i % cpu_cores();
+		ASSERT(SetThreadAffinity(ThreadSelf(), 1ull << c)==0);
+		ASSERT(on_core(c));
+		tids[i] = CreateThread(worker, c, NULL);
+	}
+	for(int i=0; i<W; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(tids[i], &exitval)==0 && exitval==0);
+	}
+
+	/* A child process inherits the mask */
+	int child(int argl, void* args) {
+		return on_core(1) ? 0 : 1;
+	}
+	ASSERT(SetThreadAffinity(ThreadSelf(), 2)==0);
+	ASSERT(Exec(child, 0, NULL)!=NOPROC);
+	int status;
+	ASSERT(WaitChild(NOPROC, &status)!=NOPROC && status==0);
+
+	ASSERT(SetThreadAffinity(ThreadSelf(), all)==0);
+	ASSERT(GetThreadAffinity(ThreadSelf(), &m)==0 && m==all);
+	return 0;
+}
+
+
+/* The result of affine_pingpong_boot(), in migrations of the ping-pong threads per wakeup */
+static double affine_migrations;
+
+/* Ping-pong a byte over two pipes, while other threads compute */
+static int affine_pingpong_boot(int argl, void* args)
+{
+	coreinfo ci;
+	ASSERT(CoreInfo(cpu_cores(), &ci)==-1);
+	ASSERT(CoreInfo(0, NULL)==-1);
+
+	unsigned long core_migrations() {
+		unsigned long m = 0;
+		for(unsigned int c=0; c<cpu_cores(); c++) {
+			coreinfo ci;
+			if(CoreInfo(c, &ci)==0 && ci.core==c) m += ci.migrations;
+		}
+		return m;
+	}
+
+	const int H = cpu_cores();
+	Tid_t hogs[MAX_CORES];
+	start_hogs(hogs, H);
+
+	const int ROUNDS = 2000;
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0 && Pipe(&p2)==0);
+	unsigned long thread_migrations = 0;
+	int pong(int argl, void* args) {
+		char c;
+		for(int i=0; i<ROUNDS; i++) {
+			if(Read(p1.read, &c, 1)!=1 || Write(p2.write, &c, 1)!=1) return 1;
+		}
+		threadinfo info;
+		if(ThreadInfo(ThreadSelf(), &info)!=0) return 1;
+		__atomic_add_fetch(&thread_migrations, info.migrations, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	unsigned long m0 = core_migrations();
+	threadinfo info;
+	ASSERT(ThreadInfo(ThreadSelf(), &info)==0);
+	unsigned long self0 = info.migrations;
+
+	Tid_t t = CreateThread(pong, 0, NULL);
+	char c = 'x';
+	for(int i=0; i<ROUNDS; i++)
+		ASSERT(Write(p1.write, &c, 1)==1 && Read(p2.read, &c, 1)==1);
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0 && exitval==0);
+
+	ASSERT(ThreadInfo(ThreadSelf(), &info)==0);
+	thread_migrations += info.migrations - self0;
+	unsigned long m = core_migrations() - m0;
+	ASSERT(m >= thread_migrations);
+
+	/* Each round trip wakes up each thread once */
+	affine_migrations = (double)thread_migrations / (2*ROUNDS);
+
+	stop_hogs(hogs, H);
+	Close(p1.read); Close(p1.write); Close(p2.read); Close(p2.write);
+	return 0;
+}
+
+BARE_TEST(test_sched_affine_wakeup,
+	"Test that the migrations of threads are counted per thread and per core,\n"
+	"and that the threads of a pipe ping-pong seldom migrate when woken, while\n"
+	"other threads compute, against a run with sched_params::no_affine_wakeup set.",
+	.timeout = 60
+	)
+{
+	MSG("cores   migrations per wakeup (without / with the last-core preference)\n");
+	for(unsigned int cores = 2; cores <= 4; cores *= 2) {
+		double migrations[2];
+		for(int affine=0; affine<2; affine++) {
+			sched_params params = { .no_affine_wakeup = !affine };
+			affine_migrations = -1.0;
+			boot_sched(cores, 0, &params, affine_pingpong_boot, 0, NULL);
+			ASSERT(affine_migrations >= 0.0);
+			migrations[affine] = affine_migrations;
+		}
+		MSG("%5u   %.3f / %.3f\n", cores, migrations[0], migrations[1]);
+
+		/* 
+		  A woken thread seldom leaves the core it last ran on. Without the
+		  preference, the ping-pong mostly stays put as well, since a core 
+		  that blocks takes the woken thread back from the queue of the core
+		  it preempted, unless the latter runs first; thus, the preference 
+		  must not add migrations, but the gain depends on the host.
+		 */
+		ASSERT(migrations[1] < 0.1);
+		ASSERT(migrations[1] <= migrations[0] + 0.01);
+	}
+}
+
+
+BOOT_TEST(test_sched_handoff,
+	"Test that YieldTo fails for a blocked thread, and runs a ready thread\n"
+	"before the caller resumes.",
+	.timeout = 60
+	)
+{
+	ASSERT(YieldTo(ThreadSelf())==-1);
+	ASSERT(YieldTo(NOTHREAD)==-1);
+
+	/* 
+	  Run on the first core only, with the threads we create. Then, they are
+	  queued whenever we run, unless they are blocked.
+	 */
+	const cpumask_t all = (1ull << cpu_cores()) - 1;
+	ASSERT(SetThreadAffinity(ThreadSelf(), 1)==0);
+
+	/* A blocked thread cannot be yielded to */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	int go = 0;
+	int waiter(int argl, void* args) {
+		Mutex_Lock(&mx);
+		while(!go) Cond_Wait(&mx, &cv);
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+	unsigned long blocked(Tid_t t) {
+		threadinfo info;
+		ASSERT(ThreadInfo(t, &info)==0);
+		return info.voluntary_switches;
+	}
+	Tid_t t = CreateThread(waiter, 0, NULL);
+	/* Until it blocks, it is ready */
+	while(!blocked(t))
+		ASSERT(YieldTo(t)==0);
+	for(int i=0; i<10; i++)
+		ASSERT(YieldTo(t)==-1);
+	Mutex_Lock(&mx);
+	go = 1;
+	Cond_Signal(&cv);
+	Mutex_Unlock(&mx);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(YieldTo(t)==-1);
+
+	/* Yielding to a ready thread runs it before we resume */
+	int ran = 0, stop = 0;
+	int runner(int argl, void* args) {
+		while(! __atomic_load_n(&stop, __ATOMIC_RELAXED))
+			__atomic_store_n(&ran, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	t = CreateThread(runner, 0, NULL);
+	for(int i=0; i<10; i++) {
+		__atomic_store_n(&ran, 0, __ATOMIC_RELAXED);
+		ASSERT(YieldTo(t)==0);
+		ASSERT(__atomic_load_n(&ran, __ATOMIC_RELAXED));
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	ASSERT(SetThreadAffinity(ThreadSelf(), all)==0);
+	return 0;
+}
+
+
+/* The result of handoff_pingpong_boot(), in usec and migrations per round trip */
+static double pingpong_usec, pingpong_migrations;
+
+/* Ping-pong a byte over two pipes */
+static int handoff_pingpong_boot(int argl, void* args)
+{
+	const int ROUNDS = 10000;
+	pipe_t p1, p2;
+	if(Pipe(&p1)!=0 || Pipe(&p2)!=0) return 1;
+	int pong(int argl, void* args) {
+		char c;
+		for(int i=0; i<ROUNDS; i++) {
+			if(Read(p1.read, &c, 1)!=1 || Write(p2.write, &c, 1)!=1) return 1;
+		}
+		return 0;
+	}
+	unsigned long migrations() {
+		unsigned long m = 0;
+		for(unsigned int c=0; c<cpu_cores(); c++) {
+			coreinfo ci;
+			if(CoreInfo(c, &ci)==0) m += ci.migrations;
+		}
+		return m;
+	}
+
+	unsigned long m0 = migrations();
+	struct timespec t0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	Tid_t t = CreateThread(pong, 0, NULL);
+	char c = 'x';
+	for(int i=0; i<ROUNDS; i++)
+		if(Write(p1.write, &c, 1)!=1 || Read(p2.read, &c, 1)!=1) return 1;
+	int exitval;
+	if(ThreadJoin(t, &exitval)!=0 || exitval!=0) return 1;
+
+	pingpong_usec = 1E3*msec_since(t0) / ROUNDS;
+	pingpong_migrations = (double)(migrations()-m0) / ROUNDS;
+	Close(p1.read); Close(p1.write); Close(p2.read); Close(p2.write);
+	return 0;
+}
+
+BARE_TEST(test_sched_handoff_latency,
+	"Test that handing off the core to a woken thread shortens the round trip of\n"
+	"a pipe ping-pong on 2 cores, against a run with sched_params::no_handoff set."
+	)
+{
+	double usec[2], migrations[2];
+	for(int handoff=0; handoff<2; handoff++) {
+		sched_params params = { .no_handoff = !handoff };
+		pingpong_usec = -1.0;
+		boot_sched(2, 0, &params, handoff_pingpong_boot, 0, NULL);
+		ASSERT(pingpong_usec >= 0.0);
+		usec[handoff] = pingpong_usec;
+		migrations[handoff] = pingpong_migrations;
+	}
+
+	MSG("without hand-off: %.2f usec and %.3f migrations per round trip\n", usec[0], migrations[0]);
+	MSG("with hand-off:    %.2f usec and %.3f migrations per round trip\n", usec[1], migrations[1]);
+	ASSERT(usec[1] < usec[0]);
+}
+
+
+BOOT_TEST(test_sched_gang,
+	"Test that the threads of a process in gang mode are co-scheduled, as\n"
+	"sampled by ThreadInfo, and report the barrier wait time of barrier-heavy\n"
+	"threads, with and without gang mode, while other threads compute.",
+	.timeout = 120
+	)
+{
+	/* SetGang returns the previous mode */
+	ASSERT(SetGang(1)==0);
+	ASSERT(SetGang(1)==1);
+	ASSERT(SetGang(0)==1);
+	ASSERT(SetGang(0)==0);
+
+	/* Each worker computes, then waits at a barrier for the others */
+	const int N = cpu_cores();
+	const int ROUNDS = 50;
+	barrier B;
+	double waited = 0.0;
+	Mutex waited_mx = MUTEX_INIT;
+	int worker(int argl, void* args) {
+		double w = 0.0;
+		for(int r=0; r<ROUNDS; r++) {
+			fibo(24);
+			struct timespec t0;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			BarrierSync(&B, N);
+			w += msec_since(t0);
+		}
+		Mutex_Lock(&waited_mx);
+		waited += w;
+		Mutex_Unlock(&waited_mx);
+		return 0;
+	}
+	int workers(int argl, void* args) {
+		SetGang(argl);
+		Tid_t tids[MAX_CORES];
+		for(int i=0; i<N; i++)
+			tids[i] = CreateThread(worker, 0, NULL);
+		for(int i=0; i<N; i++)
+			if(ThreadJoin(tids[i], NULL)!=0) return 1;
+		return 0;
+	}
+
+	/* 
+	  A process of a thread per core samples its other threads by ThreadInfo,
+	  for a second, and counts how many of them run at the same time as the
+	  sampler, on distinct cores. The other threads have the highest nice 
+	  value and hogs of the lowest nice value keep the cores busy, thus, the 
+	  other threads run only in the slots of the gang, if the process is in
+	  gang mode. Whether all of them run together depends on the host 
+	  scheduler, unless each core has a host cpu of its own.
+	 */
+	int spin, samples[2], running[2], together[2];
+	int spinner(int argl, void* args) {
+		while(__atomic_load_n(&spin, __ATOMIC_RELAXED))
+			fibo(15);
+		return 0;
+	}
+	int sampler(int argl, void* args) {
+		SetGang(argl);
+		if(SetPriority(ThreadSelf(), NICE_MIN)!=0) return 1;
+		const int G = cpu_cores()-1;
+		Tid_t tids[MAX_CORES];
+		spin = 1;
+		for(int i=0; i<G; i++) {
+			tids[i] = CreateThread(spinner, 0, NULL);
+			if(SetPriority(tids[i], NICE_MAX)!=0) return 1;
+		}
+		samples[argl] = running[argl] = together[argl] = 0;
+		struct timespec t0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		while(msec_since(t0) < 1000.0) {
+			threadinfo info;
+			if(ThreadInfo(ThreadSelf(), &info)!=0) return 1;
+			uint64_t cores = 1ull << info.core;
+			int n = 0;
+			for(int i=0; i<G; i++) {
+				if(ThreadInfo(tids[i], &info)!=0) return 1;
+				if(info.running && !(cores & (1ull << info.core))) {
+					cores |= 1ull << info.core;
+					n++;
+				}
+			}
+			samples[argl]++;
+			running[argl] += n;
+			if(n == G) together[argl]++;
+		}
+		__atomic_store_n(&spin, 0, __ATOMIC_RELAXED);
+		for(int i=0; i<G; i++)
+			if(ThreadJoin(tids[i], NULL)!=0) return 1;
+		return 0;
+	}
+	if(cpu_cores() > 1) {
+		Tid_t busy[MAX_CORES];
+		start_hogs(busy, cpu_cores());
+		for(int i=0; i<cpu_cores(); i++)
+			ASSERT(SetPriority(busy[i], NICE_MIN)==0);
+		for(int gang=0; gang<2; gang++) {
+			ASSERT(Exec(sampler, gang, NULL)!=NOPROC);
+			int status;
+			ASSERT(WaitChild(NOPROC, &status)!=NOPROC && status==0);
+		}
+		stop_hogs(busy, cpu_cores());
+
+		double mean[2];
+		for(int gang=0; gang<2; gang++)
+			mean[gang] = (double)running[gang]/samples[gang];
+		MSG("threads running with the sampler: %.2f of %d under the policy, %.2f in gang mode\n",
+			mean[0], cpu_cores()-1, mean[1]);
+		MSG("all of them in %d of %d samples in gang mode\n", together[1], samples[1]);
+		ASSERT(mean[1] > 2.0*mean[0]);
+		ASSERT(together[1] > 0 || !host_cpu_per_core());
+	}
+
+	/* The hogs belong to this process, which is not in gang mode */
+	const int H = cpu_cores();
+	Tid_t hogs[MAX_CORES];
+	start_hogs(hogs, H);
+
+	double wait[2];
+	for(int gang=0; gang<2; gang++) {
+		B = BARRIER_INIT;
+		waited = 0.0;
+		ASSERT(Exec(workers, gang, NULL)!=NOPROC);
+		int status;
+		ASSERT(WaitChild(NOPROC, &status)!=NOPROC && status==0);
+		wait[gang] = waited / (N*ROUNDS);
+	}
+
+	stop_hogs(hogs, H);
+
+	MSG("mean barrier wait %.2f msec under the policy, %.2f msec in gang mode\n", 
+		wait[0], wait[1]);
+
+	/* Without a host cpu per core, the cores take turns and gang mode cannot help */
+	if(cpu_cores() > 1 && host_cpu_per_core())
+		ASSERT_MSG(wait[1] < wait[0], "gang mode did not shorten the barrier wait\n");
+	else if(cpu_cores() > 1)
+		MSG("The host has %ld cpus; gang mode is not expected to shorten the wait.\n",
+			sysconf(_SC_NPROCESSORS_ONLN));
+	return 0;
+}
+
+
+BOOT_TEST(test_sched_accounting,
+	"Test the scheduler accounting of threads, cores and processes, with a\n"
+	"process whose threads compute and sleep, and report the busy time of the cores.",
+	.timeout = 60
+	)
+{
+	void core_totals(unsigned long* busy, unsigned long* idle, unsigned long* switches) {
+		*busy = *idle = *switches = 0;
+		for(unsigned int c=0; c<cpu_cores(); c++) {
+			coreinfo ci;
+			if(CoreInfo(c, &ci)==0) {
+				*busy += ci.busy_time;  *idle += ci.idle_time;  *switches += ci.switches;
+			}
+		}
+	}
+
+	/* The child reports its threads, then waits until its procinfo is read */
+	const int SLEEPS = 20;
+	threadinfo hog_info, sleeper_info;
+	double lifetime;
+	pipe_t ready, release;
+	ASSERT(Pipe(&ready)==0 && Pipe(&release)==0);
+	int compute(int argl, void* args) {
+		struct timespec t0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		while(msec_since(t0) < 50.0)
+			fibo(15);
+		return ThreadInfo(ThreadSelf(), &hog_info);
+	}
+	int sleeper(int argl, void* args) {
+		for(int i=0; i<SLEEPS; i++)
+			sleep_ms(1);
+		return ThreadInfo(ThreadSelf(), &sleeper_info);
+	}
+	int child(int argl, void* args) {
+		struct timespec t0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		Tid_t t1 = CreateThread(compute, 0, NULL);
+		Tid_t t2 = CreateThread(sleeper, 0, NULL);
+		int e1, e2;
+		if(ThreadJoin(t1, &e1)!=0 || ThreadJoin(t2, &e2)!=0 || e1!=0 || e2!=0) return 1;
+		lifetime = msec_since(t0);
+		char c = 'x';
+		if(Write(ready.write, &c, 1)!=1 || Read(release.read, &c, 1)!=1) return 1;
+		return 0;
+	}
+
+	unsigned long busy0, idle0, sw0;
+	core_totals(&busy0, &idle0, &sw0);
+	Pid_t pid = Exec(child, 0, NULL);
+	ASSERT(pid!=NOPROC);
+	char c;
+	ASSERT(Read(ready.read, &c, 1)==1);
+	unsigned long busy1, idle1, sw1;
+	core_totals(&busy1, &idle1, &sw1);
+
+	/* The time of a thread is within its lifetime */
+	ASSERT(hog_info.run_time > 0);
+	ASSERT(hog_info.run_time + hog_info.wait_time <= 1000*lifetime);
+	ASSERT(sleeper_info.run_time + sleeper_info.wait_time <= 1000*lifetime);
+	ASSERT(sleeper_info.voluntary_switches >= SLEEPS);
+
+	/* The cores ran the hog, and switched at least once per sleep */
+	ASSERT(busy1 - busy0 >= hog_info.run_time);
+	ASSERT(sw1 - sw0 >= SLEEPS);
+
+	/* The process totals include its exited threads */
+	procinfo pinfo;
+	int found = 0;
+	Fid_t finfo = OpenInfo();
+	ASSERT(finfo!=NOFILE);
+	while(Read(finfo, (char*) &pinfo, sizeof(pinfo)) == sizeof(pinfo)) {
+		if(pinfo.pid != pid) continue;
+		found = 1;
+		ASSERT(pinfo.run_time >= hog_info.run_time + sleeper_info.run_time);
+		ASSERT(pinfo.wait_time >= hog_info.wait_time + sleeper_info.wait_time);
+		ASSERT(pinfo.voluntary_switches >= hog_info.voluntary_switches + sleeper_info.voluntary_switches);
+		ASSERT(pinfo.involuntary_switches >= hog_info.involuntary_switches + sleeper_info.involuntary_switches);
+		ASSERT(pinfo.migrations >= hog_info.migrations + sleeper_info.migrations);
+	}
+	ASSERT(found);
+	Close(finfo);
+
+	ASSERT(Write(release.write, &c, 1)==1);
+	int status;
+	ASSERT(WaitChild(pid, &status)==pid && status==0);
+	Close(ready.read); Close(ready.write); Close(release.read); Close(release.write);
+
+	MSG("hog: %lu usec run, %lu usec wait, %lu involuntary switches; "
+		"cores %.1f%% busy\n", hog_info.run_time, hog_info.wait_time, 
+		hog_info.involuntary_switches, 
+		100.0*(busy1-busy0)/((busy1-busy0)+(idle1-idle0)+1));
+	return 0;
+}
+
+
+BOOT_TEST(test_sched_latency,
+	"Test the run-queue latency histograms, with threads that compute and\n"
+	"sleep, and report the percentiles of the latency per level and per cause.",
+	.timeout = 60
+	)
+{
+	/* Read the latencies by cause, and check the records */
+	unsigned long cause_count[LATENCY_CAUSES];
+	latencyinfo levels[MAX_SCHED_LEVELS+2];
+	int nlevels;
+	void read_latencies() {
+		for(int c=0; c<LATENCY_CAUSES; c++) cause_count[c] = 0;
+		nlevels = 0;
+		Fid_t f = OpenLatencyInfo();
+		ASSERT(f!=NOFILE);
+		latencyinfo info;
+		int last_level = -1, last_cause = -1;
+		while(Read(f, (char*) &info, sizeof(info)) == sizeof(info)) {
+			ASSERT((info.level < 0) != (info.cause < 0));
+			ASSERT(info.count > 0 && info.max <= info.total);
+			unsigned long n = 0;
+			for(int b=0; b<LATENCY_BUCKETS; b++) n += info.buckets[b];
+			ASSERT(n == info.count);
+			ASSERT(LatencyPercentile(&info, 50) <= LatencyPercentile(&info, 99));
+			ASSERT(LatencyPercentile(&info, 99) <= info.max);
+			if(info.level >= 0) {
+				/* Levels come first, in increasing order */
+				ASSERT(last_cause == -1 && info.level > last_level);
+				ASSERT(info.level <= LATENCY_REALTIME);
+				last_level = info.level;
+				levels[nlevels++] = info;
+			} else {
+				ASSERT(info.cause > last_cause && info.cause < LATENCY_CAUSES);
+				last_cause = info.cause;
+				cause_count[info.cause] = info.count;
+			}
+		}
+		Close(f);
+	}
+
+	read_latencies();
+	unsigned long user0 = cause_count[6];
+
+	const int SLEEPS = 50;
+	int sleeper(int argl, void* args) {
+		for(int i=0; i<SLEEPS; i++)
+			sleep_ms(1);
+		return 0;
+	}
+	const int H = cpu_cores()+1;
+	Tid_t hogs[MAX_CORES+1];
+	start_hogs(hogs, H);
+	Tid_t s = CreateThread(sleeper, 0, NULL);
+	ASSERT(ThreadJoin(s, NULL)==0);
+	stop_hogs(hogs, H);
+
+	/* Each wakeup of the sleeper after Cond_TimedWait was recorded */
+	read_latencies();
+	ASSERT(cause_count[6] - user0 >= SLEEPS);
+
+	for(int i=0; i<nlevels; i++)
+		MSG("level %2d: %6lu runs, p50 %5lu usec, p99 %6lu usec, max %6lu usec\n", 
+			levels[i].level, levels[i].count, LatencyPercentile(&levels[i], 50), 
+			LatencyPercentile(&levels[i], 99), levels[i].max);
+	return 0;
+}
+
+
+BARE_TEST(test_sched_trace,
+	"Test that a trace of the scheduler events is written at shutdown, in the\n"
+	"Chrome trace-event format, and report the time of a run with and without tracing."
+	)
+{
+	char path[] = "/tmp/tinyos_trace_XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT(fd >= 0);
+	close(fd);
+
+	struct timespec t0;
+	sched_params params = { .trace = NULL };
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	boot_sched(2, 0, &params, sched_levels_boot, 0, NULL);
+	double untraced = msec_since(t0);
+
+	params.trace = path;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	boot_sched(2, 0, &params, sched_levels_boot, 0, NULL);
+	double traced = msec_since(t0);
+
+	/* Read the trace back */
+	FILE* f = fopen(path, "r");
+	ASSERT(f != NULL);
+	static char buf[1<<20];
+	size_t n = fread(buf, 1, sizeof(buf)-1, f);
+	fclose(f);
+	unlink(path);
+	buf[n] = '\0';
+
+	ASSERT(strncmp(buf, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 39)==0);
+	ASSERT(n < sizeof(buf)-1 && strcmp(buf+n-4, "\n]}\n")==0);
+	ASSERT(strstr(buf, "\"ph\":\"X\"") != NULL);
+	ASSERT(strstr(buf, "\"name\":\"wakeup\"") != NULL);
+	ASSERT(strstr(buf, "\"name\":\"exit\"") != NULL);
+	ASSERT(strstr(buf, "\"wchan\":\"wait_for_any_child\"") != NULL);
+
+	MSG("%.1f msec without tracing, %.1f msec with tracing, %zu bytes of trace\n", 
+		untraced, traced, n);
+}
+
+
+TEST_SUITE(scheduler_tests,
+	"A suite of tests for the scheduler."
+	)
+{
+	&test_sched_work_stealing,
+	&test_sched_levels,
+	&test_sched_quantum,
+	&test_sched_policies,
+	&test_sched_fair_share,
+	&test_sched_nice_mlfq,
+	&test_sched_many_timeouts,
+	&test_sched_idle_cores_halt,
+	&test_sched_thread_churn,
+	&test_create_thread_ex,
+	&test_sched_many_idle_threads,
+	&test_sched_wakeup_preemption,
+	&test_sched_idle_core_wakeup,
+	&test_sched_boost,
+	&test_sched_edf,
+	&test_sched_affinity,
+	&test_sched_affine_wakeup,
+	&test_sched_gang,
+	&test_sched_handoff,
+	&test_sched_handoff_latency,
+	&test_sched_accounting,
+	&test_sched_latency,
+	&test_sched_trace,
+	NULL
+};
+
+
 TEST_SUITE(user_tests, 
 	"These are tests defined by the user."
 	)
 {
 	&dummy_user_test,
+	&scheduler_tests,
 	NULL
 };
 